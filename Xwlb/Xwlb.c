@@ -485,6 +485,38 @@ x11_compositor_find_output(struct x11_compositor *c, xcb_window_t window)
 	assert(0);
 }
 
+static void
+x11_output_put_image(struct x11_output *output, xcb_rectangle_t *rect)
+{
+	xcb_void_cookie_t cookie;
+	xcb_generic_error_t *err;
+
+	cookie = xcb_set_clip_rectangles_checked(output->compositor->conn,
+						 XCB_CLIP_ORDERING_UNSORTED,
+						 output->gc,
+						 0, 0, 1,
+						 rect);
+	err = xcb_request_check(output->compositor->conn, cookie);
+	if (err != NULL) {
+		fprintf(stderr, "Failed to set clip rects, err: %d\n", err->error_code);
+		free(err);
+	}
+
+	cookie = xcb_shm_put_image_checked(output->compositor->conn,
+					   output->window, output->gc,
+					   output->window_width,
+					   output->window_height,
+					   rect->x, rect->y, rect->width, rect->height,
+					   rect->x, rect->y, output->depth,
+					   XCB_IMAGE_FORMAT_Z_PIXMAP,
+					   0, output->segment, 0);
+	err = xcb_request_check(output->compositor->conn, cookie);
+	if (err != NULL) {
+		fprintf(stderr, "Failed to put shm image, err: %d\n", err->error_code);
+		free(err);
+	}
+}
+
 #ifdef HAVE_XCB_XKB
 static void
 update_xkb_state(struct x11_compositor *c, xcb_xkb_state_notify_event_t *state)
@@ -767,13 +799,21 @@ x11_compositor_handle_event(int fd, uint32_t mask, void *data)
 			x11_compositor_deliver_motion_event(c, event);
 			break;
 
-#if 0
 		case XCB_EXPOSE:
 			expose = (xcb_expose_event_t *) event;
 			output = x11_compositor_find_output(c, expose->window);
-			weston_output_schedule_repaint(&output->base);
+			/* The SHM image still holds the last frame, so we
+			 * only need to push the exposed part again. */
+			if (c->pixman_renderer) {
+				xcb_rectangle_t rect = {
+					expose->x, expose->y,
+					expose->width, expose->height
+				};
+				x11_output_put_image(output, &rect);
+			}
 			break;
 
+#if 0
 		case XCB_ENTER_NOTIFY:
 			x11_compositor_deliver_enter_event(c, event);
 			break;
@@ -875,7 +915,8 @@ init_gl_renderer(struct x11_compositor *c)
 }
 
 struct x11_compositor *
-x11_compositor_create(struct wl_display *display, int use_pixman)
+x11_compositor_create(struct wl_display *display, int use_pixman,
+		      int num_threads)
 {
 	struct x11_compositor *c;
 	xcb_screen_iterator_t siter;
@@ -915,8 +956,13 @@ x11_compositor_create(struct wl_display *display, int use_pixman)
 			       "Falling back to software compositing\n");
 	}
 
-	if (!c->gles2_renderer)
+	if (!c->gles2_renderer) {
 		c->pixman_renderer = wlb_pixman_renderer_create(c->compositor);
+		if (c->pixman_renderer && num_threads > 0 &&
+		    wlb_pixman_renderer_set_num_threads(c->pixman_renderer,
+							num_threads) < 0)
+			printf("Failed to start compositing threads\n");
+	}
 
 	if (x11_input_create(c) < 0)
 		goto err_xdisplay;
@@ -1080,45 +1126,33 @@ x11_output_repaint_shm(struct x11_output *output)
 	struct wlb_surface *surface;
 	struct wl_resource *buffer;
 	xcb_rectangle_t rect;
-	xcb_void_cookie_t cookie;
-	xcb_generic_error_t *err;
 	uint32_t msec;
 	struct timeval tv;
+	pixman_region32_t damage;
+	pixman_box32_t *extents;
 	
 	if (!wlb_output_needs_repaint(output->output))
 		return;
-	
-	wlb_pixman_renderer_repaint_output(output->compositor->pixman_renderer,
-					   output->output, output->hw_surface);
 
-	rect.x = 0;
-	rect.y = 0;
-	rect.width = output->window_width;
-	rect.height = output->window_height;
+	pixman_region32_init(&damage);
+	wlb_pixman_renderer_repaint_output_with_damage(
+		output->compositor->pixman_renderer, output->output,
+		output->hw_surface, &damage);
 
-	cookie = xcb_set_clip_rectangles_checked(output->compositor->conn,
-						 XCB_CLIP_ORDERING_UNSORTED,
-						 output->gc,
-						 0, 0, 1,
-						 &rect);
-	err = xcb_request_check(output->compositor->conn, cookie);
-	if (err != NULL) {
-		fprintf(stderr, "Failed to set clip rects, err: %d\n", err->error_code);
-		free(err);
+	if (!pixman_region32_not_empty(&damage)) {
+		pixman_region32_fini(&damage);
+		return 1;
 	}
 
-	cookie = xcb_shm_put_image_checked(output->compositor->conn,
-					   output->window, output->gc,
-					   rect.width, rect.height,
-					   0, 0, rect.width, rect.height,
-					   0, 0, output->depth,
-					   XCB_IMAGE_FORMAT_Z_PIXMAP,
-					   0, output->segment, 0);
-	err = xcb_request_check(output->compositor->conn, cookie);
-	if (err != NULL) {
-		fprintf(stderr, "Failed to put shm image, err: %d\n", err->error_code);
-		free(err);
-	}
+	/* Only push the part of the image that actually changed */
+	extents = pixman_region32_extents(&damage);
+	rect.x = extents->x1;
+	rect.y = extents->y1;
+	rect.width = extents->x2 - extents->x1;
+	rect.height = extents->y2 - extents->y1;
+	pixman_region32_fini(&damage);
+
+	x11_output_put_image(output, &rect);
 
 	return 1;
 }
@@ -1255,6 +1289,7 @@ print_usage(int retval)
 		"  --height=HEIGHT\tHeight of the X window\n"
 		"  --scale=SCALE\t\tScale factor of the output\n"
 		"  --use-pixman\t\tUse the pixman (CPU) renderer\n"
+		"  --threads=THREADS\tExtra threads for the pixman renderer\n"
 	);
 
 	exit(retval);
@@ -1295,6 +1330,7 @@ main(int argc, char *argv[])
 	struct wl_display *display;
 	enum wl_output_transform transform = WL_OUTPUT_TRANSFORM_NORMAL;
 	int i, width = 1023, height = 640, scale = 1, use_pixman = 0;
+	int num_threads = 0;
 
 	for (i = 1; i < argc; ++i) {
 		if (strcmp(argv[i], "--help") == 0 ||
@@ -1306,6 +1342,8 @@ main(int argc, char *argv[])
 			continue;
 		} else if (sscanf(argv[i], "--scale=%d", &scale) > 0) {
 			continue;
+		} else if (sscanf(argv[i], "--threads=%d", &num_threads) > 0) {
+			continue;
 		} else if (strncmp(argv[i], "--transform=", 12) == 0 &&
 			   parse_transform(argv[i] + 12, &transform) > 0) {
 			continue;
@@ -1320,7 +1358,7 @@ main(int argc, char *argv[])
 	display = wl_display_create();
 	wl_display_add_socket(display, "wayland-0");
 
-	c = x11_compositor_create(display, use_pixman);
+	c = x11_compositor_create(display, use_pixman, num_threads);
 	if (!c)
 		return 12;
 	x11_output_create(c, width, height, scale, transform);
@@ -0,0 +1,200 @@
+/*
+ * Copyright © 2013 Jason Ekstrand
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+/* Compares the blit kernels used by the pixman renderer for unscaled
+ * buffers against compositing the same buffer through a pixman
+ * transform, which is what the renderer used to do. */
+
+#include "wlb-private.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* Maps destination pixels to source pixels the same way the renderer
+ * does for each wl_output_transform. */
+static const struct {
+	const char *name;
+	int32_t xx, xy, yx, yy;
+} transforms[] = {
+	{ "normal",	 1,  0,  0,  1 },
+	{ "90",		 0,  1, -1,  0 },
+	{ "180",	-1,  0,  0, -1 },
+	{ "270",	 0, -1,  1,  0 },
+	{ "flipped",	-1,  0,  0,  1 },
+	{ "flipped-90",	 0, -1, -1,  0 },
+	{ "flipped-180", 1,  0,  0, -1 },
+	{ "flipped-270", 0,  1,  1,  0 },
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+print_usage(int retval)
+{
+	printf(
+		"usage: bench-blit [options]\n\n"
+		"options:\n"
+		"  -h, --help\t\tPrint this help\n"
+		"  --width=WIDTH\t\tWidth of the source buffer\n"
+		"  --height=HEIGHT\tHeight of the source buffer\n"
+		"  --iterations=N\tNumber of copies to time\n"
+	);
+
+	exit(retval);
+}
+
+int
+main(int argc, char *argv[])
+{
+	pixman_image_t *src, *pixman_dest, *blit_dest;
+	pixman_transform_t transform;
+	uint32_t *src_data, *pixman_data, *blit_data;
+	int32_t width = 1920, height = 1080, iterations = 100;
+	int32_t xx, xy, yx, yy, ox, oy, dw, dh, stride, dest_stride;
+	double start, pixman_time, blit_time;
+	int i, t, ret = 0;
+
+	for (i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--help") == 0 ||
+		    strcmp(argv[i], "-h") == 0) {
+			print_usage(0);
+		} else if (sscanf(argv[i], "--width=%d", &width) > 0) {
+			continue;
+		} else if (sscanf(argv[i], "--height=%d", &height) > 0) {
+			continue;
+		} else if (sscanf(argv[i], "--iterations=%d",
+				  &iterations) > 0) {
+			continue;
+		} else {
+			printf("Invalid option: %s\n", argv[i]);
+			print_usage(255);
+		}
+	}
+
+	if (width <= 0 || height <= 0 || iterations <= 0)
+		print_usage(255);
+
+	stride = width * 4;
+	src_data = malloc((size_t)stride * height);
+	pixman_data = malloc((size_t)stride * height);
+	blit_data = malloc((size_t)stride * height);
+	if (!src_data || !pixman_data || !blit_data) {
+		printf("Out of memory\n");
+		return 1;
+	}
+
+	srand(42);
+	for (i = 0; i < width * height; ++i)
+		src_data[i] = ((uint32_t)rand() << 16) ^ rand();
+
+	src = pixman_image_create_bits(PIXMAN_a8r8g8b8, width, height,
+				       src_data, stride);
+
+	printf("%dx%d, %d iterations\n", width, height, iterations);
+	printf("%-12s %12s %12s %9s\n",
+	       "transform", "pixman (ms)", "blit (ms)", "speedup");
+
+	for (t = 0; t < (int)(sizeof transforms / sizeof transforms[0]); ++t) {
+		xx = transforms[t].xx;
+		xy = transforms[t].xy;
+		yx = transforms[t].yx;
+		yy = transforms[t].yy;
+
+		dw = xx ? width : height;
+		dh = xx ? height : width;
+		dest_stride = dw * 4;
+
+		/* Source pixel for destination pixel (0, 0) */
+		ox = (xx < 0 || xy < 0) ? width - 1 : 0;
+		oy = (yx < 0 || yy < 0) ? height - 1 : 0;
+
+		/* pixman samples at pixel centers */
+		pixman_transform_init_identity(&transform);
+		transform.matrix[0][0] = xx * pixman_fixed_1;
+		transform.matrix[0][1] = xy * pixman_fixed_1;
+		transform.matrix[0][2] =
+			pixman_int_to_fixed(ox + (xx + xy < 0 ? 1 : 0));
+		transform.matrix[1][0] = yx * pixman_fixed_1;
+		transform.matrix[1][1] = yy * pixman_fixed_1;
+		transform.matrix[1][2] =
+			pixman_int_to_fixed(oy + (yx + yy < 0 ? 1 : 0));
+		pixman_image_set_transform(src, &transform);
+		pixman_image_set_filter(src, PIXMAN_FILTER_NEAREST, NULL, 0);
+
+		pixman_dest = pixman_image_create_bits(PIXMAN_a8r8g8b8, dw, dh,
+						       pixman_data,
+						       dest_stride);
+		blit_dest = pixman_image_create_bits(PIXMAN_a8r8g8b8, dw, dh,
+						     blit_data, dest_stride);
+
+		start = now();
+		for (i = 0; i < iterations; ++i)
+			pixman_image_composite32(PIXMAN_OP_SRC,
+						 src, NULL, pixman_dest,
+						 0, 0, 0, 0, 0, 0, dw, dh);
+		pixman_time = now() - start;
+
+		start = now();
+		for (i = 0; i < iterations; ++i) {
+			if (xx == 1 && yy == 1)
+				wlb_blit_32(blit_data, dest_stride,
+					    src_data, stride, dw, dh, 0);
+			else
+				wlb_blit_32_rotated(blit_data, dest_stride,
+						    src_data + oy * width + ox,
+						    xx * 4 + yx * stride,
+						    xy * 4 + yy * stride,
+						    dw, dh, 0);
+		}
+		blit_time = now() - start;
+
+		printf("%-12s %12.3f %12.3f %8.2fx%s\n", transforms[t].name,
+		       pixman_time * 1000 / iterations,
+		       blit_time * 1000 / iterations,
+		       pixman_time / blit_time,
+		       memcmp(pixman_data, blit_data,
+			      (size_t)dest_stride * dh) ? " MISMATCH" : "");
+
+		if (memcmp(pixman_data, blit_data, (size_t)dest_stride * dh))
+			ret = 1;
+
+		pixman_image_unref(pixman_dest);
+		pixman_image_unref(blit_dest);
+	}
+
+	pixman_image_unref(src);
+	free(src_data);
+	free(pixman_data);
+	free(blit_data);
+
+	return ret;
+}
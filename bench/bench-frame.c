@@ -0,0 +1,931 @@
+/*
+ * Copyright © 2013 Jason Ekstrand
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+/* End-to-end frame benchmark.  A libwlb compositor with an unthrottled
+ * off-screen output runs in this process, and a forked wl_shm client
+ * talks to it over a socketpair.  The client times every commit until
+ * its frame callback fires; the compositor measures how much CPU it
+ * spent per frame. */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <pixman.h>
+
+#if defined(ENABLE_GLES2) && defined(ENABLE_EGL)
+#	define BENCH_HAVE_GLES2 1
+#	include <EGL/egl.h>
+#	include <EGL/eglext.h>
+#	include <GLES2/gl2.h>
+#endif
+
+#include <wayland-client.h>
+#include "fullscreen-shell-client-protocol.h"
+
+#include "../libwlb/libwlb.h"
+
+#define WARMUP_FRAMES 10
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+
+enum damage_pattern {
+	DAMAGE_FULL,
+	DAMAGE_RECT,
+	DAMAGE_SCATTERED,
+	DAMAGE_SCROLL,
+};
+
+enum renderer_type {
+	RENDERER_PIXMAN,
+	RENDERER_GLES2,
+};
+
+struct bench_options {
+	int32_t output_width, output_height;
+	int32_t width, height;
+	int32_t scale;
+	enum wl_output_transform transform;
+	enum damage_pattern damage;
+	uint32_t method;
+	int frames;
+	int threads;
+};
+
+/* Sent from the client back to the harness when it is done */
+struct client_result {
+	int32_t frames;
+	uint64_t p50, p90, p99, max;
+	uint64_t elapsed;
+	uint64_t cpu;
+};
+
+static uint64_t
+get_time_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The client */
+
+struct client_buffer {
+	struct wl_buffer *buffer;
+	uint32_t *data;
+	int busy;
+};
+
+struct client {
+	const struct bench_options *options;
+
+	struct wl_display *display;
+	struct wl_registry *registry;
+	struct wl_compositor *compositor;
+	struct wl_shm *shm;
+	struct _wl_fullscreen_shell *fshell;
+
+	struct wl_surface *surface;
+	struct client_buffer buffers[2];
+	int32_t surface_width, surface_height;
+
+	int frame_done;
+	uint32_t seed;
+};
+
+static void
+registry_handle_global(void *data, struct wl_registry *registry,
+		       uint32_t name, const char *interface, uint32_t version)
+{
+	struct client *client = data;
+
+	if (strcmp(interface, "wl_compositor") == 0)
+		client->compositor =
+			wl_registry_bind(registry, name,
+					 &wl_compositor_interface, 3);
+	else if (strcmp(interface, "wl_shm") == 0)
+		client->shm = wl_registry_bind(registry, name,
+					       &wl_shm_interface, 1);
+	else if (strcmp(interface, "_wl_fullscreen_shell") == 0)
+		client->fshell =
+			wl_registry_bind(registry, name,
+					 &_wl_fullscreen_shell_interface, 1);
+}
+
+static void
+registry_handle_global_remove(void *data, struct wl_registry *registry,
+			      uint32_t name)
+{
+}
+
+static const struct wl_registry_listener registry_listener = {
+	registry_handle_global,
+	registry_handle_global_remove
+};
+
+static void
+buffer_release(void *data, struct wl_buffer *buffer)
+{
+	struct client_buffer *cb = data;
+
+	cb->busy = 0;
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+	buffer_release
+};
+
+static void
+frame_done(void *data, struct wl_callback *callback, uint32_t time)
+{
+	struct client *client = data;
+
+	client->frame_done = 1;
+	wl_callback_destroy(callback);
+}
+
+static const struct wl_callback_listener frame_listener = {
+	frame_done
+};
+
+static int
+create_anonymous_file(off_t size)
+{
+	static const char template[] = "/bench-frame-XXXXXX";
+	const char *path;
+	char *name;
+	int fd;
+
+	path = getenv("XDG_RUNTIME_DIR");
+	if (!path)
+		path = "/tmp";
+
+	name = malloc(strlen(path) + sizeof template);
+	if (!name)
+		return -1;
+
+	strcpy(name, path);
+	strcat(name, template);
+
+	fd = mkstemp(name);
+	if (fd >= 0)
+		unlink(name);
+	free(name);
+
+	if (fd < 0)
+		return -1;
+
+	if (ftruncate(fd, size) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int
+client_create_buffers(struct client *client)
+{
+	const struct bench_options *options = client->options;
+	struct wl_shm_pool *pool;
+	int32_t stride, size;
+	void *data;
+	int fd, i;
+
+	stride = options->width * 4;
+	size = stride * options->height;
+
+	fd = create_anonymous_file(size * 2);
+	if (fd < 0)
+		return -1;
+
+	data = mmap(NULL, size * 2, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (data == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+
+	pool = wl_shm_create_pool(client->shm, fd, size * 2);
+	for (i = 0; i < 2; ++i) {
+		client->buffers[i].data = (uint32_t *)((char *)data + size * i);
+		client->buffers[i].buffer =
+			wl_shm_pool_create_buffer(pool, size * i,
+						  options->width,
+						  options->height, stride,
+						  WL_SHM_FORMAT_XRGB8888);
+		wl_buffer_add_listener(client->buffers[i].buffer,
+				       &buffer_listener, &client->buffers[i]);
+		memset(client->buffers[i].data, 0x40, size);
+	}
+	wl_shm_pool_destroy(pool);
+	close(fd);
+
+	return 0;
+}
+
+static uint32_t
+client_random(struct client *client)
+{
+	client->seed = client->seed * 1103515245 + 12345;
+	return client->seed >> 8;
+}
+
+/* Paints and damages a rectangle given in surface coordinates.  Only the
+ * compositor's cost matters here, so the buffer is touched just enough
+ * that the pixels do change. */
+static void
+client_damage(struct client *client, struct client_buffer *cb,
+	      int32_t x, int32_t y, int32_t width, int32_t height,
+	      uint32_t color)
+{
+	const struct bench_options *options = client->options;
+	int32_t bx, by, bw, bh, row;
+
+	wl_surface_damage(client->surface, x, y, width, height);
+
+	/* Filling the matching buffer area needs the buffer transform;
+	 * cover the whole buffer footprint of the damage instead. */
+	if (options->transform == WL_OUTPUT_TRANSFORM_NORMAL) {
+		bx = x * options->scale;
+		by = y * options->scale;
+		bw = width * options->scale;
+		bh = height * options->scale;
+	} else {
+		bx = 0;
+		by = 0;
+		bw = options->width;
+		bh = 1;
+	}
+
+	for (row = by; row < by + bh && row < options->height; ++row)
+		memset(cb->data + row * options->width + bx, color & 0xff,
+		       MIN(bw, options->width - bx) * 4);
+}
+
+static void
+client_draw_frame(struct client *client, struct client_buffer *cb, int frame)
+{
+	const struct bench_options *options = client->options;
+	int32_t sw = client->surface_width, sh = client->surface_height;
+	int32_t size, i, top;
+
+	switch (options->damage) {
+	case DAMAGE_FULL:
+		client_damage(client, cb, 0, 0, sw, sh, frame);
+		break;
+	case DAMAGE_RECT:
+		size = MIN(64, MIN(sw, sh));
+		client_damage(client, cb,
+			      (frame * 7) % (sw - size + 1),
+			      (frame * 5) % (sh - size + 1),
+			      size, size, frame);
+		break;
+	case DAMAGE_SCATTERED:
+		size = MIN(16, MIN(sw, sh));
+		for (i = 0; i < 16; ++i)
+			client_damage(client, cb,
+				      client_random(client) % (sw - size + 1),
+				      client_random(client) % (sh - size + 1),
+				      size, size, frame);
+		break;
+	case DAMAGE_SCROLL:
+		/* Everything below a fixed header moves */
+		top = sh / 8;
+		client_damage(client, cb, 0, top, sw, sh - top, frame);
+		break;
+	}
+}
+
+static int
+compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static int
+run_client(int fd, int result_fd, const struct bench_options *options)
+{
+	struct client client;
+	struct client_buffer *cb;
+	struct client_result result;
+	struct wl_callback *callback;
+	uint64_t *latency, commit, start, cpu_start;
+	int frame, i, ret;
+
+	memset(&client, 0, sizeof client);
+	client.options = options;
+	client.seed = 42;
+
+	client.display = wl_display_connect_to_fd(fd);
+	if (!client.display)
+		return 1;
+
+	client.registry = wl_display_get_registry(client.display);
+	wl_registry_add_listener(client.registry, &registry_listener, &client);
+	wl_display_roundtrip(client.display);
+
+	if (!client.compositor || !client.shm || !client.fshell) {
+		fprintf(stderr, "client: missing required globals\n");
+		return 1;
+	}
+
+	if (client_create_buffers(&client) < 0) {
+		fprintf(stderr, "client: failed to create buffers\n");
+		return 1;
+	}
+
+	switch (options->transform) {
+	case WL_OUTPUT_TRANSFORM_90:
+	case WL_OUTPUT_TRANSFORM_270:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		client.surface_width = options->height / options->scale;
+		client.surface_height = options->width / options->scale;
+		break;
+	default:
+		client.surface_width = options->width / options->scale;
+		client.surface_height = options->height / options->scale;
+		break;
+	}
+
+	client.surface = wl_compositor_create_surface(client.compositor);
+	wl_surface_set_buffer_transform(client.surface, options->transform);
+	wl_surface_set_buffer_scale(client.surface, options->scale);
+	_wl_fullscreen_shell_present_surface(client.fshell, client.surface,
+					     options->method, NULL);
+
+	latency = calloc(options->frames, sizeof *latency);
+	if (!latency)
+		return 1;
+
+	start = 0;
+	cpu_start = 0;
+	ret = 0;
+	for (frame = 0; frame < WARMUP_FRAMES + options->frames; ++frame) {
+		if (frame == WARMUP_FRAMES) {
+			start = get_time_ns(CLOCK_MONOTONIC);
+			cpu_start = get_time_ns(CLOCK_PROCESS_CPUTIME_ID);
+		}
+
+		cb = &client.buffers[frame % 2];
+		while (cb->busy && ret >= 0)
+			ret = wl_display_dispatch(client.display);
+		if (ret < 0)
+			break;
+
+		wl_surface_attach(client.surface, cb->buffer, 0, 0);
+		if (frame == 0)
+			wl_surface_damage(client.surface, 0, 0,
+					  client.surface_width,
+					  client.surface_height);
+		else
+			client_draw_frame(&client, cb, frame);
+
+		client.frame_done = 0;
+		callback = wl_surface_frame(client.surface);
+		wl_callback_add_listener(callback, &frame_listener, &client);
+
+		commit = get_time_ns(CLOCK_MONOTONIC);
+		wl_surface_commit(client.surface);
+		cb->busy = 1;
+
+		while (!client.frame_done && ret >= 0)
+			ret = wl_display_dispatch(client.display);
+		if (ret < 0)
+			break;
+
+		if (frame >= WARMUP_FRAMES)
+			latency[frame - WARMUP_FRAMES] =
+				get_time_ns(CLOCK_MONOTONIC) - commit;
+	}
+
+	if (ret < 0) {
+		fprintf(stderr, "client: lost connection to compositor\n");
+		return 1;
+	}
+
+	memset(&result, 0, sizeof result);
+	result.frames = options->frames;
+	result.elapsed = get_time_ns(CLOCK_MONOTONIC) - start;
+	result.cpu = get_time_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+
+	qsort(latency, options->frames, sizeof *latency, compare_u64);
+	i = options->frames - 1;
+	result.p50 = latency[i * 50 / 100];
+	result.p90 = latency[i * 90 / 100];
+	result.p99 = latency[i * 99 / 100];
+	result.max = latency[i];
+	free(latency);
+
+	if (write(result_fd, &result, sizeof result) != sizeof result)
+		return 1;
+
+	wl_display_disconnect(client.display);
+
+	return 0;
+}
+
+/* The compositor */
+
+struct harness {
+	const struct bench_options *options;
+	enum renderer_type renderer_type;
+
+	struct wl_display *display;
+	struct wlb_compositor *compositor;
+	struct wlb_output *output;
+
+	struct wlb_pixman_renderer *pixman_renderer;
+	pixman_image_t *image;
+
+#ifdef BENCH_HAVE_GLES2
+	struct wlb_gles2_renderer *gles2_renderer;
+	EGLDisplay egl_display;
+	EGLContext egl_context;
+	EGLSurface egl_surface;
+#endif
+
+	struct wl_listener client_destroy_listener;
+	int client_running;
+	uint32_t frames;
+};
+
+#ifdef BENCH_HAVE_GLES2
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+/* Renders into a pbuffer, preferring Mesa's surfaceless platform so
+ * that no display server is needed; with LIBGL_ALWAYS_SOFTWARE=1 this
+ * ends up on llvmpipe. */
+static int
+harness_init_gles2(struct harness *h, int32_t width, int32_t height)
+{
+	PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display = NULL;
+	const char *extensions;
+	EGLConfig config;
+	EGLint major, minor, matched;
+
+	static const EGLint config_attribs[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RED_SIZE, 8,
+		EGL_GREEN_SIZE, 8,
+		EGL_BLUE_SIZE, 8,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+		EGL_NONE
+	};
+	static const EGLint context_attribs[] = {
+		EGL_CONTEXT_CLIENT_VERSION, 2,
+		EGL_NONE
+	};
+	EGLint surface_attribs[] = {
+		EGL_WIDTH, width,
+		EGL_HEIGHT, height,
+		EGL_NONE
+	};
+
+	h->egl_display = EGL_NO_DISPLAY;
+	extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	if (extensions && strstr(extensions, "EGL_MESA_platform_surfaceless"))
+		get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+			eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (get_platform_display)
+		h->egl_display =
+			get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+					     EGL_DEFAULT_DISPLAY, NULL);
+	if (h->egl_display == EGL_NO_DISPLAY)
+		h->egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+	if (!eglInitialize(h->egl_display, &major, &minor))
+		return -1;
+
+	if (!eglBindAPI(EGL_OPENGL_ES_API))
+		return -1;
+
+	if (!eglChooseConfig(h->egl_display, config_attribs,
+			     &config, 1, &matched) || matched < 1)
+		return -1;
+
+	h->egl_context = eglCreateContext(h->egl_display, config,
+					  EGL_NO_CONTEXT, context_attribs);
+	if (h->egl_context == EGL_NO_CONTEXT)
+		return -1;
+
+	h->egl_surface = eglCreatePbufferSurface(h->egl_display, config,
+						 surface_attribs);
+	if (h->egl_surface == EGL_NO_SURFACE)
+		return -1;
+
+	if (!eglMakeCurrent(h->egl_display, h->egl_surface, h->egl_surface,
+			    h->egl_context))
+		return -1;
+
+	/* Renders into whatever context is current */
+	h->gles2_renderer = wlb_gles2_renderer_create(h->compositor);
+	if (!h->gles2_renderer)
+		return -1;
+
+	return 0;
+}
+
+static void
+harness_fini_gles2(struct harness *h)
+{
+	if (h->gles2_renderer)
+		wlb_gles2_renderer_destroy(h->gles2_renderer);
+
+	if (h->egl_display == EGL_NO_DISPLAY)
+		return;
+
+	eglMakeCurrent(h->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+		       EGL_NO_CONTEXT);
+	if (h->egl_surface != EGL_NO_SURFACE)
+		eglDestroySurface(h->egl_display, h->egl_surface);
+	if (h->egl_context != EGL_NO_CONTEXT)
+		eglDestroyContext(h->egl_display, h->egl_context);
+	eglTerminate(h->egl_display);
+}
+#endif
+
+static void
+harness_client_destroyed(struct wl_listener *listener, void *data)
+{
+	struct harness *h = wl_container_of(listener, h,
+					    client_destroy_listener);
+
+	h->client_running = 0;
+}
+
+static void
+harness_repaint(struct harness *h)
+{
+	wlb_output_prepare_frame(h->output);
+
+	if (wlb_output_needs_repaint(h->output)) {
+		switch (h->renderer_type) {
+		case RENDERER_PIXMAN:
+			wlb_pixman_renderer_repaint_output(h->pixman_renderer,
+							   h->output,
+							   h->image);
+			break;
+		case RENDERER_GLES2:
+#ifdef BENCH_HAVE_GLES2
+			wlb_gles2_renderer_repaint_output(h->gles2_renderer,
+							  h->output);
+			/* Make sure the frame is really done */
+			glFinish();
+#endif
+			break;
+		}
+		h->frames++;
+	}
+
+	wlb_output_frame_complete(h->output,
+				  get_time_ns(CLOCK_MONOTONIC) / 1000000);
+}
+
+static int
+harness_init(struct harness *h, const struct bench_options *options,
+	     enum renderer_type renderer_type)
+{
+	int32_t width, height;
+
+	memset(h, 0, sizeof *h);
+	h->options = options;
+	h->renderer_type = renderer_type;
+
+	h->display = wl_display_create();
+	if (!h->display)
+		return -1;
+
+	h->compositor = wlb_compositor_create(h->display);
+	if (!h->compositor)
+		return -1;
+
+	h->output = wlb_output_create(h->compositor, 0, 0,
+				      "bench-frame", "none");
+	if (!h->output)
+		return -1;
+
+	width = options->output_width;
+	height = options->output_height;
+	wlb_output_set_mode(h->output, width, height, 0);
+
+	switch (renderer_type) {
+	case RENDERER_PIXMAN:
+		h->pixman_renderer = wlb_pixman_renderer_create(h->compositor);
+		if (!h->pixman_renderer)
+			return -1;
+		if (options->threads > 0 &&
+		    wlb_pixman_renderer_set_num_threads(h->pixman_renderer,
+							options->threads) < 0)
+			return -1;
+
+		h->image = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+						    width, height,
+						    NULL, width * 4);
+		if (!h->image)
+			return -1;
+		break;
+	case RENDERER_GLES2:
+#ifdef BENCH_HAVE_GLES2
+		if (harness_init_gles2(h, width, height) < 0)
+			return -1;
+#else
+		return -1;
+#endif
+		break;
+	}
+
+	wl_display_init_shm(h->display);
+
+	return 0;
+}
+
+static void
+harness_fini(struct harness *h)
+{
+#ifdef BENCH_HAVE_GLES2
+	harness_fini_gles2(h);
+#endif
+	if (h->pixman_renderer)
+		wlb_pixman_renderer_destroy(h->pixman_renderer);
+	if (h->image)
+		pixman_image_unref(h->image);
+	if (h->output)
+		wlb_output_destroy(h->output);
+	if (h->compositor)
+		wlb_compositor_destroy(h->compositor);
+	if (h->display)
+		wl_display_destroy(h->display);
+}
+
+static const char *
+renderer_name(enum renderer_type type)
+{
+	return type == RENDERER_PIXMAN ? "pixman" : "gles2";
+}
+
+static int
+run_benchmark(const struct bench_options *options,
+	      enum renderer_type renderer_type)
+{
+	struct harness h;
+	struct wl_event_loop *loop;
+	struct wl_client *client;
+	struct client_result result;
+	uint64_t cpu_start, cpu;
+	int sockets[2], result_pipe[2], status, ret = -1;
+	pid_t pid;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) < 0)
+		return -1;
+	if (pipe(result_pipe) < 0) {
+		close(sockets[0]);
+		close(sockets[1]);
+		return -1;
+	}
+
+	/* Fork before any compositor state exists */
+	fflush(stdout);
+	pid = fork();
+	if (pid < 0) {
+		close(sockets[0]);
+		close(sockets[1]);
+		close(result_pipe[0]);
+		close(result_pipe[1]);
+		return -1;
+	} else if (pid == 0) {
+		close(sockets[0]);
+		close(result_pipe[0]);
+		_exit(run_client(sockets[1], result_pipe[1], options));
+	}
+
+	close(sockets[1]);
+	close(result_pipe[1]);
+
+	if (harness_init(&h, options, renderer_type) < 0) {
+		fprintf(stderr, "Failed to set up the %s renderer\n",
+			renderer_name(renderer_type));
+		close(sockets[0]);
+		goto out;
+	}
+
+	client = wl_client_create(h.display, sockets[0]);
+	if (!client) {
+		close(sockets[0]);
+		goto out;
+	}
+
+	h.client_running = 1;
+	h.client_destroy_listener.notify = harness_client_destroyed;
+	wl_client_add_destroy_listener(client, &h.client_destroy_listener);
+
+	loop = wl_display_get_event_loop(h.display);
+	cpu_start = get_time_ns(CLOCK_PROCESS_CPUTIME_ID);
+	while (h.client_running) {
+		wl_display_flush_clients(h.display);
+		wl_event_loop_dispatch(loop, 1);
+		if (h.client_running)
+			harness_repaint(&h);
+	}
+	cpu = get_time_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+
+	if (read(result_pipe[0], &result, sizeof result) != sizeof result) {
+		fprintf(stderr, "The %s client failed\n",
+			renderer_name(renderer_type));
+		goto out;
+	}
+
+	printf("%-8s %7.1f %9.3f %9.3f %9.3f %9.3f %11.3f %11.3f\n",
+	       renderer_name(renderer_type),
+	       result.frames / (result.elapsed / 1e9),
+	       result.p50 / 1e6, result.p90 / 1e6,
+	       result.p99 / 1e6, result.max / 1e6,
+	       h.frames ? cpu / 1e6 / h.frames : 0.0,
+	       result.cpu / 1e6 / result.frames);
+	ret = 0;
+
+out:
+	harness_fini(&h);
+	close(result_pipe[0]);
+	waitpid(pid, &status, 0);
+
+	return ret;
+}
+
+static void
+print_usage(int retval)
+{
+	printf(
+		"usage: bench-frame [options]\n\n"
+		"options:\n"
+		"  -h, --help\t\t\tPrint this help\n"
+		"  --output-width=WIDTH\t\tWidth of the output mode\n"
+		"  --output-height=HEIGHT\tHeight of the output mode\n"
+		"  --width=WIDTH\t\t\tWidth of the client's buffers\n"
+		"  --height=HEIGHT\t\tHeight of the client's buffers\n"
+		"  --scale=SCALE\t\t\tBuffer scale of the client surface\n"
+		"  --transform=TRANSFORM\t\tBuffer transform of the client surface\n"
+		"  --damage=PATTERN\t\tfull, rect, scattered or scroll\n"
+		"  --method=METHOD\t\tdefault, center, zoom, zoom-crop or stretch\n"
+		"  --frames=FRAMES\t\tNumber of frames to time\n"
+		"  --renderer=RENDERER\t\tpixman, gles2 or all\n"
+		"  --threads=THREADS\t\tExtra threads for the pixman renderer\n"
+	);
+
+	exit(retval);
+}
+
+static int
+parse_name(const char *str, const char * const *names, int count, int *out)
+{
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		if (strcmp(names[i], str) == 0) {
+			*out = i;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const char * const transforms[] = {
+		"normal", "90", "180", "270",
+		"flipped", "flipped-90", "flipped-180", "flipped-270"
+	};
+	static const char * const damages[] = {
+		"full", "rect", "scattered", "scroll"
+	};
+	static const char * const methods[] = {
+		"default", "center", "zoom", "zoom-crop", "stretch"
+	};
+	static const char * const renderers[] = {
+		"pixman", "gles2", "all"
+	};
+	struct bench_options options;
+	int i, value, renderer = 2, ret = 0;
+
+	memset(&options, 0, sizeof options);
+	options.output_width = 1920;
+	options.output_height = 1080;
+	options.scale = 1;
+	options.transform = WL_OUTPUT_TRANSFORM_NORMAL;
+	options.damage = DAMAGE_FULL;
+	options.method = _WL_FULLSCREEN_SHELL_PRESENT_METHOD_DEFAULT;
+	options.frames = 300;
+
+	for (i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--help") == 0 ||
+		    strcmp(argv[i], "-h") == 0) {
+			print_usage(0);
+		} else if (sscanf(argv[i], "--output-width=%d",
+				  &options.output_width) > 0) {
+			continue;
+		} else if (sscanf(argv[i], "--output-height=%d",
+				  &options.output_height) > 0) {
+			continue;
+		} else if (sscanf(argv[i], "--width=%d", &options.width) > 0) {
+			continue;
+		} else if (sscanf(argv[i], "--height=%d", &options.height) > 0) {
+			continue;
+		} else if (sscanf(argv[i], "--scale=%d", &options.scale) > 0) {
+			continue;
+		} else if (sscanf(argv[i], "--frames=%d", &options.frames) > 0) {
+			continue;
+		} else if (sscanf(argv[i], "--threads=%d",
+				  &options.threads) > 0) {
+			continue;
+		} else if (strncmp(argv[i], "--transform=", 12) == 0 &&
+			   parse_name(argv[i] + 12, transforms, 8, &value)) {
+			options.transform = value;
+		} else if (strncmp(argv[i], "--damage=", 9) == 0 &&
+			   parse_name(argv[i] + 9, damages, 4, &value)) {
+			options.damage = value;
+		} else if (strncmp(argv[i], "--method=", 9) == 0 &&
+			   parse_name(argv[i] + 9, methods, 5, &value)) {
+			options.method = value;
+		} else if (strncmp(argv[i], "--renderer=", 11) == 0 &&
+			   parse_name(argv[i] + 11, renderers, 3, &renderer)) {
+			continue;
+		} else {
+			printf("Invalid option: %s\n", argv[i]);
+			print_usage(255);
+		}
+	}
+
+	if (options.width == 0)
+		options.width = options.output_width;
+	if (options.height == 0)
+		options.height = options.output_height;
+
+	if (options.output_width <= 0 || options.output_height <= 0 ||
+	    options.width <= 0 || options.height <= 0 ||
+	    options.scale <= 0 || options.frames <= 0 ||
+	    options.width / options.scale <= 0 ||
+	    options.height / options.scale <= 0)
+		print_usage(255);
+
+	printf("output %dx%d, buffer %dx%d, scale %d, transform %s, "
+	       "damage %s, method %s, %d frames\n",
+	       options.output_width, options.output_height,
+	       options.width, options.height, options.scale,
+	       transforms[options.transform], damages[options.damage],
+	       methods[options.method], options.frames);
+	printf("%-8s %7s %9s %9s %9s %9s %11s %11s\n",
+	       "renderer", "fps", "p50 (ms)", "p90 (ms)", "p99 (ms)",
+	       "max (ms)", "comp cpu/f", "client cpu/f");
+
+	if (renderer == 0 || renderer == 2)
+		if (run_benchmark(&options, RENDERER_PIXMAN) < 0)
+			ret = 1;
+
+#ifdef BENCH_HAVE_GLES2
+	if (renderer == 1 || renderer == 2)
+		if (run_benchmark(&options, RENDERER_GLES2) < 0)
+			ret = 1;
+#else
+	if (renderer == 1) {
+		printf("GLES2 support was not built\n");
+		ret = 1;
+	}
+#endif
+
+	return ret;
+}
@@ -0,0 +1,578 @@
+/*
+ * Copyright © 2013 Jason Ekstrand
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+/* A backend that renders into memory and never shows anything.  Frames
+ * are paced by a virtual vsync at a fixed refresh rate, or as fast as
+ * the client can keep up, which makes it useful for benchmarking libwlb
+ * and for running clients in CI without a display. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <signal.h>
+#include <time.h>
+
+#include <pixman.h>
+
+#include "config.h"
+
+#if defined(ENABLE_GLES2) && defined(ENABLE_EGL)
+#	define HEADLESS_HAVE_GLES2 1
+#	include <EGL/egl.h>
+#	include <EGL/eglext.h>
+#endif
+
+#include "../libwlb/libwlb.h"
+
+#define MAX_IMAGES 3
+
+struct headless_compositor {
+	struct wl_display *display;
+	struct wlb_compositor *compositor;
+	struct wlb_pixman_renderer *renderer;
+#ifdef HEADLESS_HAVE_GLES2
+	EGLDisplay egl_display;
+	struct wlb_gles2_renderer *gles2_renderer;
+#endif
+
+	struct wl_list output_list;
+
+	/* Refresh rate in mHz, or 0 to repaint as fast as possible */
+	int32_t refresh;
+	int running;
+
+	struct wl_listener client_destroy_listener;
+	struct wl_event_source *sigint_source;
+	struct wl_event_source *sigterm_source;
+};
+
+struct headless_output {
+	struct headless_compositor *compositor;
+	struct wl_list compositor_link;
+	struct wlb_output *output;
+
+	/* Cycled through one per frame, like a swapchain */
+	pixman_image_t *images[MAX_IMAGES];
+	int num_images, current_image;
+
+	struct wl_event_source *repaint_timer;
+	uint64_t next_frame;
+
+	uint32_t frame_count;
+};
+
+static uint64_t
+headless_get_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+headless_output_repaint(struct headless_output *output)
+{
+	struct headless_compositor *c = output->compositor;
+	pixman_image_t *image;
+
+	wlb_output_prepare_frame(output->output);
+
+	if (!wlb_output_needs_repaint(output->output)) {
+		/* Nothing to do */
+#ifdef HEADLESS_HAVE_GLES2
+	} else if (c->gles2_renderer) {
+		wlb_gles2_renderer_repaint_output(c->gles2_renderer,
+						  output->output);
+		output->frame_count++;
+#endif
+	} else {
+		image = output->images[output->current_image];
+		output->current_image =
+			(output->current_image + 1) % output->num_images;
+
+		wlb_pixman_renderer_repaint_output(c->renderer,
+						   output->output, image);
+		output->frame_count++;
+	}
+
+	wlb_output_frame_complete(output->output,
+				  headless_get_time_ns() / 1000000);
+}
+
+/* Schedules the next frame on the virtual vsync.  If we fell more than
+ * a frame behind, the clock is restarted rather than trying to catch up
+ * with a burst of frames. */
+static void
+headless_output_schedule_repaint(struct headless_output *output)
+{
+	uint64_t period, now;
+	int msecs;
+
+	period = 1000000000000ull / output->compositor->refresh;
+	now = headless_get_time_ns();
+
+	output->next_frame += period;
+	if (output->next_frame + period < now)
+		output->next_frame = now + period;
+
+	if (output->next_frame > now)
+		msecs = (output->next_frame - now + 999999) / 1000000;
+	else
+		msecs = 1;
+
+	wl_event_source_timer_update(output->repaint_timer, msecs);
+}
+
+static int
+headless_output_repaint_timer(void *data)
+{
+	struct headless_output *output = data;
+
+	headless_output_repaint(output);
+	headless_output_schedule_repaint(output);
+
+	return 1;
+}
+
+static void
+headless_output_destroy(struct headless_output *output)
+{
+	int i;
+
+	if (output->repaint_timer)
+		wl_event_source_remove(output->repaint_timer);
+
+	for (i = 0; i < output->num_images; ++i)
+		pixman_image_unref(output->images[i]);
+
+	wlb_output_destroy(output->output);
+	wl_list_remove(&output->compositor_link);
+	free(output);
+}
+
+static struct headless_output *
+headless_output_create(struct headless_compositor *c,
+		       int32_t width, int32_t height, int32_t scale,
+		       enum wl_output_transform transform, int num_images)
+{
+	struct headless_output *output;
+	struct wl_event_loop *loop;
+	int32_t mode_width, mode_height;
+	int i;
+
+	output = calloc(1, sizeof *output);
+	if (!output)
+		return NULL;
+
+	output->compositor = c;
+	wl_list_insert(&c->output_list, &output->compositor_link);
+
+	output->output = wlb_output_create(c->compositor, 0, 0,
+					   "headless-wlb", "none");
+	if (!output->output)
+		goto err_free;
+
+	mode_width = width * scale;
+	mode_height = height * scale;
+
+	wlb_output_set_mode(output->output, mode_width, mode_height,
+			    c->refresh);
+	wlb_output_set_scale(output->output, scale);
+	wlb_output_set_transform(output->output, transform);
+
+#ifdef HEADLESS_HAVE_GLES2
+	/* The renderer keeps its own framebuffer */
+	if (c->gles2_renderer) {
+		if (wlb_gles2_renderer_add_offscreen_output(c->gles2_renderer,
+							    output->output) < 0)
+			goto err_output;
+		num_images = 0;
+	}
+#endif
+
+	for (i = 0; i < num_images; ++i) {
+		output->images[i] =
+			pixman_image_create_bits(PIXMAN_x8r8g8b8,
+						 mode_width, mode_height,
+						 NULL, mode_width * 4);
+		if (!output->images[i])
+			goto err_output;
+		output->num_images++;
+	}
+
+	if (c->refresh) {
+		loop = wl_display_get_event_loop(c->display);
+		output->repaint_timer =
+			wl_event_loop_add_timer(loop,
+						headless_output_repaint_timer,
+						output);
+		if (!output->repaint_timer)
+			goto err_output;
+
+		output->next_frame = headless_get_time_ns();
+		headless_output_schedule_repaint(output);
+	}
+
+	return output;
+
+err_output:
+	headless_output_destroy(output);
+	return NULL;
+err_free:
+	wl_list_remove(&output->compositor_link);
+	free(output);
+	return NULL;
+}
+
+static void
+headless_compositor_terminate(struct headless_compositor *c)
+{
+	c->running = 0;
+	wl_display_terminate(c->display);
+}
+
+static int
+handle_signal(int signal_number, void *data)
+{
+	headless_compositor_terminate(data);
+
+	return 1;
+}
+
+static void
+client_destroyed(struct wl_listener *listener, void *data)
+{
+	struct headless_compositor *c =
+		wl_container_of(listener, c, client_destroy_listener);
+
+	headless_compositor_terminate(c);
+}
+
+static void
+headless_compositor_destroy(struct headless_compositor *c)
+{
+	struct headless_output *output, *next;
+
+	wl_list_for_each_safe(output, next, &c->output_list, compositor_link)
+		headless_output_destroy(output);
+
+	if (c->sigint_source)
+		wl_event_source_remove(c->sigint_source);
+	if (c->sigterm_source)
+		wl_event_source_remove(c->sigterm_source);
+
+	if (c->renderer)
+		wlb_pixman_renderer_destroy(c->renderer);
+#ifdef HEADLESS_HAVE_GLES2
+	if (c->gles2_renderer)
+		wlb_gles2_renderer_destroy(c->gles2_renderer);
+	if (c->egl_display != EGL_NO_DISPLAY)
+		eglTerminate(c->egl_display);
+#endif
+	wlb_compositor_destroy(c->compositor);
+	free(c);
+}
+
+#ifdef HEADLESS_HAVE_GLES2
+#ifndef EGL_PLATFORM_SURFACELESS_MESA
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+
+/* Prefers Mesa's surfaceless platform so that no display server is
+ * needed; with LIBGL_ALWAYS_SOFTWARE=1 this ends up on llvmpipe. */
+static int
+headless_compositor_init_gles2(struct headless_compositor *c)
+{
+	PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display = NULL;
+	const char *extensions;
+	EGLint major, minor;
+
+	extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	if (extensions && strstr(extensions, "EGL_MESA_platform_surfaceless"))
+		get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+			eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (get_platform_display)
+		c->egl_display =
+			get_platform_display(EGL_PLATFORM_SURFACELESS_MESA,
+					     EGL_DEFAULT_DISPLAY, NULL);
+	if (c->egl_display == EGL_NO_DISPLAY)
+		c->egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+	if (!eglInitialize(c->egl_display, &major, &minor)) {
+		c->egl_display = EGL_NO_DISPLAY;
+		return -1;
+	}
+
+	c->gles2_renderer = wlb_gles2_renderer_create_for_egl(c->compositor,
+							      c->egl_display,
+							      NULL);
+	if (!c->gles2_renderer)
+		return -1;
+
+	return 0;
+}
+#endif
+
+static struct headless_compositor *
+headless_compositor_create(struct wl_display *display, int32_t refresh,
+			   int num_threads, int use_gles2)
+{
+	struct headless_compositor *c;
+	struct wl_event_loop *loop;
+
+	c = calloc(1, sizeof *c);
+	if (!c)
+		return NULL;
+
+	c->display = display;
+	c->refresh = refresh;
+	c->running = 1;
+	wl_list_init(&c->output_list);
+
+	c->compositor = wlb_compositor_create(display);
+	if (!c->compositor)
+		goto err_free;
+
+#ifdef HEADLESS_HAVE_GLES2
+	c->egl_display = EGL_NO_DISPLAY;
+	if (use_gles2) {
+		if (headless_compositor_init_gles2(c) < 0) {
+			printf("Failed to initialize the GLES2 renderer\n");
+			goto err_gles2;
+		}
+		goto done;
+	}
+#endif
+
+	c->renderer = wlb_pixman_renderer_create(c->compositor);
+	if (!c->renderer)
+		goto err_compositor;
+
+	if (num_threads > 0 &&
+	    wlb_pixman_renderer_set_num_threads(c->renderer,
+						num_threads) < 0)
+		printf("Failed to start compositing threads\n");
+
+#ifdef HEADLESS_HAVE_GLES2
+done:
+#endif
+	loop = wl_display_get_event_loop(display);
+	c->sigint_source = wl_event_loop_add_signal(loop, SIGINT,
+						    handle_signal, c);
+	c->sigterm_source = wl_event_loop_add_signal(loop, SIGTERM,
+						     handle_signal, c);
+
+	return c;
+
+#ifdef HEADLESS_HAVE_GLES2
+err_gles2:
+	if (c->egl_display != EGL_NO_DISPLAY)
+		eglTerminate(c->egl_display);
+#endif
+err_compositor:
+	wlb_compositor_destroy(c->compositor);
+err_free:
+	free(c);
+	return NULL;
+}
+
+/* With no refresh rate there is no clock; instead every trip around the
+ * event loop ends with a frame.  The short timeout keeps frame callbacks
+ * flowing even if the client sends nothing else. */
+static void
+headless_compositor_run_unthrottled(struct headless_compositor *c)
+{
+	struct wl_event_loop *loop;
+	struct headless_output *output;
+
+	loop = wl_display_get_event_loop(c->display);
+
+	while (c->running) {
+		wl_display_flush_clients(c->display);
+		wl_event_loop_dispatch(loop, 1);
+
+		wl_list_for_each(output, &c->output_list, compositor_link)
+			headless_output_repaint(output);
+	}
+}
+
+static void
+print_usage(int retval)
+{
+	printf(
+		"usage: headless-wlb [options] [-- CLIENT [ARGS...]]\n\n"
+		"options:\n"
+		"  -h, --help\t\tPrint this help\n"
+		"  --width=WIDTH\t\tWidth of the output\n"
+		"  --height=HEIGHT\tHeight of the output\n"
+		"  --scale=SCALE\t\tScale factor of the output\n"
+		"  --transform=TRANSFORM\tTransform of the output\n"
+		"  --refresh=HZ\t\tRefresh rate, or 0 for as fast as possible\n"
+		"  --images=N\t\tNumber of images to cycle through (1-3)\n"
+		"  --threads=THREADS\tExtra threads for the pixman renderer\n"
+#ifdef HEADLESS_HAVE_GLES2
+		"  --renderer=RENDERER\tpixman (default) or gles2\n"
+#endif
+		"  --socket=NAME\t\tName of the Wayland socket\n\n"
+		"If CLIENT is given, it is started with WAYLAND_SOCKET set and\n"
+		"headless-wlb exits when it disconnects.  CLIENT must be a path.\n"
+	);
+
+	exit(retval);
+}
+
+static int
+parse_transform(const char *str, enum wl_output_transform *transform)
+{
+	int i;
+	static const struct {
+		const char *name;
+		enum wl_output_transform transform;
+	} names[] = {
+		{ "normal",	WL_OUTPUT_TRANSFORM_NORMAL },
+		{ "90",		WL_OUTPUT_TRANSFORM_90 },
+		{ "180",	WL_OUTPUT_TRANSFORM_180 },
+		{ "270",	WL_OUTPUT_TRANSFORM_270 },
+		{ "flipped",	WL_OUTPUT_TRANSFORM_FLIPPED },
+		{ "flipped-90",	WL_OUTPUT_TRANSFORM_FLIPPED_90 },
+		{ "flipped-180", WL_OUTPUT_TRANSFORM_FLIPPED_180 },
+		{ "flipped-270", WL_OUTPUT_TRANSFORM_FLIPPED_270 },
+	};
+
+	for (i = 0; i < (int)(sizeof names / sizeof names[0]); ++i) {
+		if (strcmp(names[i].name, str) == 0) {
+			*transform = names[i].transform;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct headless_compositor *c;
+	struct headless_output *output;
+	struct wl_display *display;
+	struct wl_client *client;
+	enum wl_output_transform transform = WL_OUTPUT_TRANSFORM_NORMAL;
+	int i, width = 1024, height = 640, scale = 1, refresh = 60;
+	int num_images = 1, num_threads = 0, use_gles2 = 0;
+	const char *socket_name = NULL;
+	char **client_argv = NULL;
+	uint32_t frames;
+	uint64_t start;
+
+	for (i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--help") == 0 ||
+		    strcmp(argv[i], "-h") == 0) {
+			print_usage(0);
+		} else if (strcmp(argv[i], "--") == 0) {
+			if (i + 1 < argc)
+				client_argv = &argv[i + 1];
+			break;
+		} else if (sscanf(argv[i], "--width=%d", &width) > 0) {
+			continue;
+		} else if (sscanf(argv[i], "--height=%d", &height) > 0) {
+			continue;
+		} else if (sscanf(argv[i], "--scale=%d", &scale) > 0) {
+			continue;
+		} else if (sscanf(argv[i], "--refresh=%d", &refresh) > 0) {
+			continue;
+		} else if (sscanf(argv[i], "--images=%d", &num_images) > 0) {
+			continue;
+		} else if (sscanf(argv[i], "--threads=%d", &num_threads) > 0) {
+			continue;
+		} else if (strncmp(argv[i], "--socket=", 9) == 0) {
+			socket_name = argv[i] + 9;
+		} else if (strcmp(argv[i], "--renderer=pixman") == 0) {
+			use_gles2 = 0;
+#ifdef HEADLESS_HAVE_GLES2
+		} else if (strcmp(argv[i], "--renderer=gles2") == 0) {
+			use_gles2 = 1;
+#endif
+		} else if (strncmp(argv[i], "--transform=", 12) == 0 &&
+			   parse_transform(argv[i] + 12, &transform) > 0) {
+			continue;
+		} else {
+			printf("Invalid option: %s\n", argv[i]);
+			print_usage(255);
+		}
+	}
+
+	if (width <= 0 || height <= 0 || scale <= 0 || refresh < 0 ||
+	    num_images < 1 || num_images > MAX_IMAGES) {
+		printf("Invalid output configuration\n");
+		print_usage(255);
+	}
+
+	display = wl_display_create();
+	if (!display)
+		return 1;
+
+	if (wl_display_add_socket(display, socket_name) < 0) {
+		printf("Failed to add socket\n");
+		return 1;
+	}
+
+	c = headless_compositor_create(display, refresh * 1000, num_threads,
+				       use_gles2);
+	if (!c)
+		return 12;
+
+	output = headless_output_create(c, width, height, scale, transform,
+					num_images);
+	if (!output)
+		return 12;
+
+	wl_display_init_shm(display);
+
+	if (client_argv) {
+		client = wlb_compositor_launch_client(c->compositor,
+						      client_argv[0],
+						      client_argv);
+		if (!client)
+			return 1;
+
+		c->client_destroy_listener.notify = client_destroyed;
+		wl_client_add_destroy_listener(client,
+					       &c->client_destroy_listener);
+	}
+
+	start = headless_get_time_ns();
+
+	if (c->refresh)
+		wl_display_run(display);
+	else
+		headless_compositor_run_unthrottled(c);
+
+	frames = output->frame_count;
+	printf("%u frames in %.3f seconds\n", frames,
+	       (headless_get_time_ns() - start) / 1e9);
+
+	headless_compositor_destroy(c);
+	wl_display_destroy(display);
+
+	return 0;
+}
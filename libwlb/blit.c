@@ -0,0 +1,859 @@
+/*
+ * Copyright © 2013 Jason Ekstrand
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+#include "wlb-private.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#	define BLIT_HAVE_X86 1
+#	include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#	define BLIT_HAVE_NEON 1
+#	include <arm_neon.h>
+#endif
+
+#define ALPHA_MASK 0xff000000u
+
+/* 32x32 pixels of source is 4k, which keeps both the rows being read and
+ * the rows being written in L1 while transposing. */
+#define BLIT_TILE_SIZE 32
+
+typedef void (*blit_row_func_t)(uint32_t *dest, const uint32_t *src,
+				int32_t width);
+
+static void
+copy_row_c(uint32_t *dest, const uint32_t *src, int32_t width)
+{
+	memcpy(dest, src, width * sizeof(uint32_t));
+}
+
+static void
+opaque_row_c(uint32_t *dest, const uint32_t *src, int32_t width)
+{
+	int32_t i;
+
+	for (i = 0; i < width; ++i)
+		dest[i] = src[i] | ALPHA_MASK;
+}
+
+#ifdef BLIT_HAVE_X86
+__attribute__((target("sse2"))) static void
+copy_row_sse2(uint32_t *dest, const uint32_t *src, int32_t width)
+{
+	int32_t i = 0;
+
+	for (; i + 16 <= width; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i + 4));
+		__m128i c = _mm_loadu_si128((const __m128i *)(src + i + 8));
+		__m128i d = _mm_loadu_si128((const __m128i *)(src + i + 12));
+		_mm_storeu_si128((__m128i *)(dest + i), a);
+		_mm_storeu_si128((__m128i *)(dest + i + 4), b);
+		_mm_storeu_si128((__m128i *)(dest + i + 8), c);
+		_mm_storeu_si128((__m128i *)(dest + i + 12), d);
+	}
+	for (; i + 4 <= width; i += 4)
+		_mm_storeu_si128((__m128i *)(dest + i),
+				 _mm_loadu_si128((const __m128i *)(src + i)));
+	for (; i < width; ++i)
+		dest[i] = src[i];
+}
+
+__attribute__((target("sse2"))) static void
+opaque_row_sse2(uint32_t *dest, const uint32_t *src, int32_t width)
+{
+	__m128i mask = _mm_set1_epi32((int)ALPHA_MASK);
+	int32_t i = 0;
+
+	for (; i + 8 <= width; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i + 4));
+		_mm_storeu_si128((__m128i *)(dest + i), _mm_or_si128(a, mask));
+		_mm_storeu_si128((__m128i *)(dest + i + 4),
+				 _mm_or_si128(b, mask));
+	}
+	for (; i + 4 <= width; i += 4)
+		_mm_storeu_si128((__m128i *)(dest + i),
+				 _mm_or_si128(_mm_loadu_si128((const __m128i *)
+							      (src + i)),
+					      mask));
+	for (; i < width; ++i)
+		dest[i] = src[i] | ALPHA_MASK;
+}
+
+__attribute__((target("avx2"))) static void
+copy_row_avx2(uint32_t *dest, const uint32_t *src, int32_t width)
+{
+	int32_t i = 0;
+
+	for (; i + 32 <= width; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 8));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(src + i + 16));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(src + i + 24));
+		_mm256_storeu_si256((__m256i *)(dest + i), a);
+		_mm256_storeu_si256((__m256i *)(dest + i + 8), b);
+		_mm256_storeu_si256((__m256i *)(dest + i + 16), c);
+		_mm256_storeu_si256((__m256i *)(dest + i + 24), d);
+	}
+	for (; i + 8 <= width; i += 8)
+		_mm256_storeu_si256((__m256i *)(dest + i),
+				    _mm256_loadu_si256((const __m256i *)
+						       (src + i)));
+	for (; i < width; ++i)
+		dest[i] = src[i];
+}
+
+__attribute__((target("avx2"))) static void
+opaque_row_avx2(uint32_t *dest, const uint32_t *src, int32_t width)
+{
+	__m256i mask = _mm256_set1_epi32((int)ALPHA_MASK);
+	int32_t i = 0;
+
+	for (; i + 16 <= width; i += 16) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 8));
+		_mm256_storeu_si256((__m256i *)(dest + i),
+				    _mm256_or_si256(a, mask));
+		_mm256_storeu_si256((__m256i *)(dest + i + 8),
+				    _mm256_or_si256(b, mask));
+	}
+	for (; i + 8 <= width; i += 8)
+		_mm256_storeu_si256((__m256i *)(dest + i),
+				    _mm256_or_si256(_mm256_loadu_si256(
+						(const __m256i *)(src + i)),
+						    mask));
+	for (; i < width; ++i)
+		dest[i] = src[i] | ALPHA_MASK;
+}
+
+/* Non-temporal stores have to be aligned, so the ends of the row are
+ * copied normally */
+__attribute__((target("sse2"))) static void
+stream_row_sse2(uint32_t *dest, const uint32_t *src, int32_t width)
+{
+	int32_t i = 0;
+
+	for (; i < width && ((uintptr_t)(dest + i) & 15); ++i)
+		dest[i] = src[i];
+	for (; i + 16 <= width; i += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i + 4));
+		__m128i c = _mm_loadu_si128((const __m128i *)(src + i + 8));
+		__m128i d = _mm_loadu_si128((const __m128i *)(src + i + 12));
+		_mm_stream_si128((__m128i *)(dest + i), a);
+		_mm_stream_si128((__m128i *)(dest + i + 4), b);
+		_mm_stream_si128((__m128i *)(dest + i + 8), c);
+		_mm_stream_si128((__m128i *)(dest + i + 12), d);
+	}
+	for (; i + 4 <= width; i += 4)
+		_mm_stream_si128((__m128i *)(dest + i),
+				 _mm_loadu_si128((const __m128i *)(src + i)));
+	for (; i < width; ++i)
+		dest[i] = src[i];
+}
+
+__attribute__((target("avx2"))) static void
+stream_row_avx2(uint32_t *dest, const uint32_t *src, int32_t width)
+{
+	int32_t i = 0;
+
+	for (; i < width && ((uintptr_t)(dest + i) & 31); ++i)
+		dest[i] = src[i];
+	for (; i + 32 <= width; i += 32) {
+		__m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 8));
+		__m256i c = _mm256_loadu_si256((const __m256i *)(src + i + 16));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(src + i + 24));
+		_mm256_stream_si256((__m256i *)(dest + i), a);
+		_mm256_stream_si256((__m256i *)(dest + i + 8), b);
+		_mm256_stream_si256((__m256i *)(dest + i + 16), c);
+		_mm256_stream_si256((__m256i *)(dest + i + 24), d);
+	}
+	for (; i + 8 <= width; i += 8)
+		_mm256_stream_si256((__m256i *)(dest + i),
+				    _mm256_loadu_si256((const __m256i *)
+						       (src + i)));
+	for (; i < width; ++i)
+		dest[i] = src[i];
+}
+
+__attribute__((target("sse2"))) static void
+stream_fence_sse2(void)
+{
+	_mm_sfence();
+}
+#endif
+
+#ifdef BLIT_HAVE_NEON
+static void
+copy_row_neon(uint32_t *dest, const uint32_t *src, int32_t width)
+{
+	int32_t i = 0;
+
+	for (; i + 16 <= width; i += 16) {
+		uint32x4_t a = vld1q_u32(src + i);
+		uint32x4_t b = vld1q_u32(src + i + 4);
+		uint32x4_t c = vld1q_u32(src + i + 8);
+		uint32x4_t d = vld1q_u32(src + i + 12);
+		vst1q_u32(dest + i, a);
+		vst1q_u32(dest + i + 4, b);
+		vst1q_u32(dest + i + 8, c);
+		vst1q_u32(dest + i + 12, d);
+	}
+	for (; i + 4 <= width; i += 4)
+		vst1q_u32(dest + i, vld1q_u32(src + i));
+	for (; i < width; ++i)
+		dest[i] = src[i];
+}
+
+static void
+opaque_row_neon(uint32_t *dest, const uint32_t *src, int32_t width)
+{
+	uint32x4_t mask = vdupq_n_u32(ALPHA_MASK);
+	int32_t i = 0;
+
+	for (; i + 8 <= width; i += 8) {
+		uint32x4_t a = vld1q_u32(src + i);
+		uint32x4_t b = vld1q_u32(src + i + 4);
+		vst1q_u32(dest + i, vorrq_u32(a, mask));
+		vst1q_u32(dest + i + 4, vorrq_u32(b, mask));
+	}
+	for (; i < width; ++i)
+		dest[i] = src[i] | ALPHA_MASK;
+}
+#endif
+
+/* BT.601 limited range with 6 bits of fraction.  Everything fits in 16
+ * bits except the upper end of blue, and that saturates to a value that
+ * clamps to 255 anyway, so the SIMD kernels produce identical results. */
+#define YUV_Y_OFFSET	16
+#define YUV_Y_MUL	75
+#define YUV_R_V		102
+#define YUV_G_U		25
+#define YUV_G_V		52
+#define YUV_B_U		129
+
+typedef void (*yuv_row_func_t)(uint32_t *dest, const uint8_t *y,
+			       const uint8_t *u, const uint8_t *v,
+			       int32_t uv_step, int32_t x, int32_t width);
+
+static inline uint32_t
+clamp_u8(int32_t c)
+{
+	return c < 0 ? 0 : (c > 255 ? 255 : c);
+}
+
+static inline uint32_t
+yuv_pixel(int32_t y, int32_t u, int32_t v)
+{
+	int32_t c, r, g, b;
+
+	c = (y - YUV_Y_OFFSET) * YUV_Y_MUL + 32;
+	u -= 128;
+	v -= 128;
+
+	r = (c + YUV_R_V * v) >> 6;
+	g = (c - YUV_G_U * u - YUV_G_V * v) >> 6;
+	b = (c + YUV_B_U * u) >> 6;
+
+	return ALPHA_MASK | clamp_u8(r) << 16 | clamp_u8(g) << 8 | clamp_u8(b);
+}
+
+/* y, u and v point to the start of the row; x is the first pixel */
+static void
+yuv_row_c(uint32_t *dest, const uint8_t *y, const uint8_t *u,
+	  const uint8_t *v, int32_t uv_step, int32_t x, int32_t width)
+{
+	int32_t i, c;
+
+	for (i = 0; i < width; ++i) {
+		c = ((x + i) / 2) * uv_step;
+		dest[i] = yuv_pixel(y[x + i], u[c], v[c]);
+	}
+}
+
+#ifdef BLIT_HAVE_X86
+__attribute__((target("sse2"))) static void
+yuv_row_sse2(uint32_t *dest, const uint8_t *y, const uint8_t *u,
+	     const uint8_t *v, int32_t uv_step, int32_t x, int32_t width)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i alpha = _mm_set1_epi8(-1);
+	const __m128i low_byte = _mm_set1_epi16(0xff);
+	const __m128i c128 = _mm_set1_epi16(128);
+	const __m128i y_offset = _mm_set1_epi16(YUV_Y_OFFSET);
+	const __m128i y_mul = _mm_set1_epi16(YUV_Y_MUL);
+	const __m128i round = _mm_set1_epi16(32);
+	const __m128i r_v = _mm_set1_epi16(YUV_R_V);
+	const __m128i g_u = _mm_set1_epi16(YUV_G_U);
+	const __m128i g_v = _mm_set1_epi16(YUV_G_V);
+	const __m128i b_u = _mm_set1_epi16(YUV_B_U);
+	__m128i yy, uv, uu, vv, c, r, g, b, bg, ra;
+	uint32_t u4, v4;
+	int32_t i = 0, px;
+
+	/* Start on an even pixel so that chroma samples pair up */
+	if (x & 1) {
+		yuv_row_c(dest, y, u, v, uv_step, x, WLB_MIN(width, 1));
+		i = 1;
+	}
+
+	for (; i + 8 <= width; i += 8) {
+		px = x + i;
+
+		/* Four chroma samples, interleaved as u0 v0 u1 v1 ... */
+		if (uv_step == 2) {
+			uv = _mm_loadl_epi64((const __m128i *)(u + px));
+		} else {
+			memcpy(&u4, u + px / 2, 4);
+			memcpy(&v4, v + px / 2, 4);
+			uv = _mm_unpacklo_epi8(_mm_cvtsi32_si128(u4),
+					       _mm_cvtsi32_si128(v4));
+		}
+		uv = _mm_unpacklo_epi16(uv, uv);
+		uu = _mm_sub_epi16(_mm_and_si128(uv, low_byte), c128);
+		vv = _mm_sub_epi16(_mm_srli_epi16(uv, 8), c128);
+
+		yy = _mm_loadl_epi64((const __m128i *)(y + px));
+		yy = _mm_sub_epi16(_mm_unpacklo_epi8(yy, zero), y_offset);
+		c = _mm_add_epi16(_mm_mullo_epi16(yy, y_mul), round);
+
+		r = _mm_adds_epi16(c, _mm_mullo_epi16(vv, r_v));
+		g = _mm_subs_epi16(_mm_subs_epi16(c, _mm_mullo_epi16(uu, g_u)),
+				   _mm_mullo_epi16(vv, g_v));
+		b = _mm_adds_epi16(c, _mm_mullo_epi16(uu, b_u));
+
+		r = _mm_srai_epi16(r, 6);
+		g = _mm_srai_epi16(g, 6);
+		b = _mm_srai_epi16(b, 6);
+		r = _mm_packus_epi16(r, r);
+		g = _mm_packus_epi16(g, g);
+		b = _mm_packus_epi16(b, b);
+
+		bg = _mm_unpacklo_epi8(b, g);
+		ra = _mm_unpacklo_epi8(r, alpha);
+		_mm_storeu_si128((__m128i *)(dest + i),
+				 _mm_unpacklo_epi16(bg, ra));
+		_mm_storeu_si128((__m128i *)(dest + i + 4),
+				 _mm_unpackhi_epi16(bg, ra));
+	}
+
+	if (i < width)
+		yuv_row_c(dest + i, y, u, v, uv_step, x + i, width - i);
+}
+#endif
+
+#ifdef BLIT_HAVE_NEON
+static void
+yuv_row_neon(uint32_t *dest, const uint8_t *y, const uint8_t *u,
+	     const uint8_t *v, int32_t uv_step, int32_t x, int32_t width)
+{
+	const int16x8_t c128 = vdupq_n_s16(128);
+	const int16x8_t y_offset = vdupq_n_s16(YUV_Y_OFFSET);
+	const int16x8_t round = vdupq_n_s16(32);
+	int16x8_t yy, uu, vv, c, r, g, b;
+	uint8x8_t u8, v8;
+	uint8x8x2_t uv;
+	uint8x8x4_t argb;
+	uint32_t u4, v4;
+	int32_t i = 0, px;
+
+	/* Start on an even pixel so that chroma samples pair up */
+	if (x & 1) {
+		yuv_row_c(dest, y, u, v, uv_step, x, WLB_MIN(width, 1));
+		i = 1;
+	}
+
+	argb.val[3] = vdup_n_u8(0xff);
+
+	for (; i + 8 <= width; i += 8) {
+		px = x + i;
+
+		/* Four chroma samples, each doubled for two pixels */
+		if (uv_step == 2) {
+			u8 = vld1_u8(u + px);
+			uv = vuzp_u8(u8, u8);
+			u8 = uv.val[0];
+			v8 = uv.val[1];
+		} else {
+			memcpy(&u4, u + px / 2, 4);
+			memcpy(&v4, v + px / 2, 4);
+			u8 = vreinterpret_u8_u32(vdup_n_u32(u4));
+			v8 = vreinterpret_u8_u32(vdup_n_u32(v4));
+		}
+		u8 = vzip_u8(u8, u8).val[0];
+		v8 = vzip_u8(v8, v8).val[0];
+		uu = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(u8)), c128);
+		vv = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(v8)), c128);
+
+		yy = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(y + px)));
+		yy = vsubq_s16(yy, y_offset);
+		c = vaddq_s16(vmulq_n_s16(yy, YUV_Y_MUL), round);
+
+		r = vqaddq_s16(c, vmulq_n_s16(vv, YUV_R_V));
+		g = vqsubq_s16(vqsubq_s16(c, vmulq_n_s16(uu, YUV_G_U)),
+			       vmulq_n_s16(vv, YUV_G_V));
+		b = vqaddq_s16(c, vmulq_n_s16(uu, YUV_B_U));
+
+		argb.val[0] = vqmovun_s16(vshrq_n_s16(b, 6));
+		argb.val[1] = vqmovun_s16(vshrq_n_s16(g, 6));
+		argb.val[2] = vqmovun_s16(vshrq_n_s16(r, 6));
+		vst4_u8((uint8_t *)(dest + i), argb);
+	}
+
+	if (i < width)
+		yuv_row_c(dest + i, y, u, v, uv_step, x + i, width - i);
+}
+#endif
+
+/* The box scaler first sums the covered source rows into a row of 16-bit
+ * channels using 8-bit weights, then sums across that row with 14-bit
+ * weights.  The row is halved before the second pass so that it fits in
+ * signed 16-bit lanes. */
+#define BOX_V_BITS	8
+#define BOX_H_BITS	14
+#define BOX_SHIFT	(BOX_V_BITS - 1 + BOX_H_BITS)
+
+typedef void (*box_accumulate_func_t)(uint16_t *row, const uint32_t *src,
+				      int32_t width, uint16_t weight);
+typedef void (*box_reduce_func_t)(uint32_t *dest, const uint16_t *row,
+				  int32_t col0, const int32_t *start,
+				  const int32_t *count, const int16_t *weights,
+				  int32_t max_count, int32_t width,
+				  uint32_t alpha);
+
+static void
+box_accumulate_c(uint16_t *row, const uint32_t *src, int32_t width,
+		 uint16_t weight)
+{
+	int32_t i, c;
+
+	for (i = 0; i < width; ++i)
+		for (c = 0; c < 4; ++c)
+			row[i * 4 + c] += ((src[i] >> (c * 8)) & 0xff) * weight;
+}
+
+static void
+box_reduce_c(uint32_t *dest, const uint16_t *row, int32_t col0,
+	     const int32_t *start, const int32_t *count,
+	     const int16_t *weights, int32_t max_count,
+	     int32_t width, uint32_t alpha)
+{
+	const uint16_t *p;
+	const int16_t *w;
+	int32_t i, k, c, sum[4];
+
+	for (i = 0; i < width; ++i) {
+		p = row + (start[i] - col0) * 4;
+		w = weights + i * max_count;
+
+		sum[0] = sum[1] = sum[2] = sum[3] = 0;
+		for (k = 0; k < count[i]; ++k)
+			for (c = 0; c < 4; ++c)
+				sum[c] += (p[k * 4 + c] >> 1) * w[k];
+
+		dest[i] = alpha;
+		for (c = 0; c < 4; ++c)
+			dest[i] |= clamp_u8((sum[c] + (1 << (BOX_SHIFT - 1))) >>
+					    BOX_SHIFT) << (c * 8);
+	}
+}
+
+#ifdef BLIT_HAVE_X86
+__attribute__((target("sse2"))) static void
+box_accumulate_sse2(uint16_t *row, const uint32_t *src, int32_t width,
+		    uint16_t weight)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i w = _mm_set1_epi16(weight);
+	__m128i p, lo, hi;
+	int32_t i = 0;
+
+	for (; i + 4 <= width; i += 4) {
+		p = _mm_loadu_si128((const __m128i *)(src + i));
+		lo = _mm_mullo_epi16(_mm_unpacklo_epi8(p, zero), w);
+		hi = _mm_mullo_epi16(_mm_unpackhi_epi8(p, zero), w);
+		_mm_storeu_si128((__m128i *)(row + i * 4),
+				 _mm_add_epi16(_mm_loadu_si128((__m128i *)
+							       (row + i * 4)),
+					       lo));
+		_mm_storeu_si128((__m128i *)(row + i * 4 + 8),
+				 _mm_add_epi16(_mm_loadu_si128((__m128i *)
+							       (row + i * 4 + 8)),
+					       hi));
+	}
+
+	if (i < width)
+		box_accumulate_c(row + i * 4, src + i, width - i, weight);
+}
+
+__attribute__((target("sse2"))) static void
+box_reduce_sse2(uint32_t *dest, const uint16_t *row, int32_t col0,
+		const int32_t *start, const int32_t *count,
+		const int16_t *weights, int32_t max_count,
+		int32_t width, uint32_t alpha)
+{
+	const __m128i round = _mm_set1_epi32(1 << (BOX_SHIFT - 1));
+	__m128i sum, p0, p1, w;
+	const uint16_t *p;
+	const int16_t *wk;
+	int32_t i, k;
+
+	for (i = 0; i < width; ++i) {
+		p = row + (start[i] - col0) * 4;
+		wk = weights + i * max_count;
+
+		/* Two source pixels at a time: interleaving their channels
+		 * lets madd weight and add both in one go. */
+		sum = round;
+		for (k = 0; k + 2 <= count[i]; k += 2) {
+			p0 = _mm_srli_epi16(_mm_loadl_epi64((const __m128i *)
+							    (p + k * 4)), 1);
+			p1 = _mm_srli_epi16(_mm_loadl_epi64((const __m128i *)
+							    (p + k * 4 + 4)), 1);
+			w = _mm_set1_epi32((uint16_t)wk[k] |
+					   ((uint32_t)(uint16_t)wk[k + 1] << 16));
+			sum = _mm_add_epi32(sum,
+					    _mm_madd_epi16(_mm_unpacklo_epi16(p0, p1),
+							   w));
+		}
+		if (k < count[i]) {
+			p0 = _mm_srli_epi16(_mm_loadl_epi64((const __m128i *)
+							    (p + k * 4)), 1);
+			w = _mm_set1_epi32((uint16_t)wk[k]);
+			sum = _mm_add_epi32(sum,
+					    _mm_madd_epi16(_mm_unpacklo_epi16(p0, p0),
+							   w));
+		}
+
+		sum = _mm_srai_epi32(sum, BOX_SHIFT);
+		sum = _mm_packs_epi32(sum, sum);
+		sum = _mm_packus_epi16(sum, sum);
+		dest[i] = (uint32_t)_mm_cvtsi128_si32(sum) | alpha;
+	}
+}
+#endif
+
+static pthread_once_t blit_once = PTHREAD_ONCE_INIT;
+static blit_row_func_t copy_row = copy_row_c;
+static blit_row_func_t opaque_row = opaque_row_c;
+static blit_row_func_t stream_row = copy_row_c;
+static void (*stream_fence)(void) = NULL;
+static yuv_row_func_t yuv_row = yuv_row_c;
+static box_accumulate_func_t box_accumulate = box_accumulate_c;
+static box_reduce_func_t box_reduce = box_reduce_c;
+
+static void
+blit_init(void)
+{
+#if defined(BLIT_HAVE_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		copy_row = copy_row_avx2;
+		opaque_row = opaque_row_avx2;
+		stream_row = stream_row_avx2;
+	} else if (__builtin_cpu_supports("sse2")) {
+		copy_row = copy_row_sse2;
+		opaque_row = opaque_row_sse2;
+		stream_row = stream_row_sse2;
+	}
+
+	if (__builtin_cpu_supports("sse2"))
+		stream_fence = stream_fence_sse2;
+
+	if (__builtin_cpu_supports("sse2")) {
+		yuv_row = yuv_row_sse2;
+		box_accumulate = box_accumulate_sse2;
+		box_reduce = box_reduce_sse2;
+	}
+#elif defined(BLIT_HAVE_NEON)
+	copy_row = copy_row_neon;
+	opaque_row = opaque_row_neon;
+	stream_row = copy_row_neon;
+	yuv_row = yuv_row_neon;
+#endif
+}
+
+void
+wlb_blit_32(void *dest, int32_t dest_stride,
+	    const void *src, int32_t src_stride,
+	    int32_t width, int32_t height, int set_alpha)
+{
+	blit_row_func_t row;
+	int32_t y;
+
+	pthread_once(&blit_once, blit_init);
+
+	row = set_alpha ? opaque_row : copy_row;
+	for (y = 0; y < height; ++y) {
+		row(dest, src, width);
+		dest = (char *)dest + dest_stride;
+		src = (const char *)src + src_stride;
+	}
+}
+
+void
+wlb_blit_32_stream(void *dest, int32_t dest_stride,
+		   const void *src, int32_t src_stride,
+		   int32_t width, int32_t height)
+{
+	int32_t y;
+
+	pthread_once(&blit_once, blit_init);
+
+	for (y = 0; y < height; ++y) {
+		stream_row(dest, src, width);
+		dest = (char *)dest + dest_stride;
+		src = (const char *)src + src_stride;
+	}
+
+	/* Make the stores visible before anyone else reads the data */
+	if (stream_fence)
+		stream_fence();
+}
+
+void
+wlb_blit_yuv(void *dest, int32_t dest_stride,
+	     const struct wlb_yuv_planes *src, int32_t x, int32_t y,
+	     int32_t width, int32_t height)
+{
+	int32_t row, sy;
+
+	pthread_once(&blit_once, blit_init);
+
+	for (row = 0; row < height; ++row) {
+		sy = y + row;
+		yuv_row((uint32_t *)((char *)dest + row * dest_stride),
+			src->y + sy * src->y_stride,
+			src->u + (sy / 2) * src->uv_stride,
+			src->v + (sy / 2) * src->uv_stride,
+			src->uv_step, x, width);
+	}
+}
+
+void
+wlb_blit_32_rotated(void *dest, int32_t dest_stride,
+		    const void *src, int32_t src_dx, int32_t src_dy,
+		    int32_t width, int32_t height, int set_alpha)
+{
+	uint32_t alpha = set_alpha ? ALPHA_MASK : 0;
+	uint32_t *d;
+	const char *s;
+	int32_t x, y, tx, ty, tw, th, tile_width;
+
+	/* Flips still read whole source rows, so only transposes need
+	 * to be broken up into tiles. */
+	if (src_dx == 4 || src_dx == -4)
+		tile_width = width;
+	else
+		tile_width = BLIT_TILE_SIZE;
+
+	for (ty = 0; ty < height; ty += BLIT_TILE_SIZE) {
+		th = WLB_MIN(BLIT_TILE_SIZE, height - ty);
+		for (tx = 0; tx < width; tx += tile_width) {
+			tw = WLB_MIN(tile_width, width - tx);
+			for (y = ty; y < ty + th; ++y) {
+				d = (uint32_t *)((char *)dest +
+						 y * dest_stride) + tx;
+				s = (const char *)src +
+				    y * src_dy + tx * src_dx;
+				for (x = 0; x < tw; ++x) {
+					d[x] = *(const uint32_t *)s | alpha;
+					s += src_dx;
+				}
+			}
+		}
+	}
+}
+
+struct box_weights {
+	int32_t *start;
+	int32_t *count;
+	int16_t *weights;
+	int32_t max_count;
+};
+
+static void
+box_weights_fini(struct box_weights *bw)
+{
+	free(bw->start);
+	free(bw->count);
+	free(bw->weights);
+}
+
+/* Works out which source pixels, and how much of each, fall under each
+ * of the n destination pixels.  Destination pixel i covers the source
+ * interval [origin + i * scale, origin + (i + 1) * scale) clipped to
+ * [0, size).  Weights are fixed point with the given number of bits and
+ * always sum to exactly one. */
+static int
+box_weights_init(struct box_weights *bw, int32_t n, double origin,
+		 double scale, int32_t size, int bits)
+{
+	double lo, hi, total, covered;
+	int32_t i, k, first, last, prev, next;
+	int16_t *w;
+
+	memset(bw, 0, sizeof *bw);
+	bw->max_count = (int32_t)scale + 2;
+
+	bw->start = malloc(n * sizeof *bw->start);
+	bw->count = malloc(n * sizeof *bw->count);
+	bw->weights = calloc((size_t)n * bw->max_count, sizeof *bw->weights);
+	if (!bw->start || !bw->count || !bw->weights) {
+		box_weights_fini(bw);
+		return -1;
+	}
+
+	for (i = 0; i < n; ++i) {
+		lo = WLB_MAX(origin + i * scale, 0.0);
+		hi = WLB_MIN(origin + (i + 1) * scale, (double)size);
+		if (hi <= lo) {
+			/* Off the edge; repeat the nearest pixel */
+			lo = WLB_MIN(WLB_MAX(lo, 0.0), size - 1.0);
+			hi = lo + 1.0;
+		}
+
+		/* lo and hi are never negative here */
+		first = (int32_t)lo;
+		last = (int32_t)hi;
+		if (last < hi)
+			last++;
+		last = WLB_MIN(last, size);
+		if (last - first > bw->max_count)
+			last = first + bw->max_count;
+
+		/* Rounding the running total rather than each weight keeps
+		 * the sum exact without any weight going negative, even
+		 * when most of them are below one */
+		total = hi - lo;
+		w = bw->weights + i * bw->max_count;
+		prev = 0;
+		for (k = 0; k < last - first; ++k) {
+			covered = WLB_MIN(hi, first + k + 1.0) - lo;
+			if (k == last - first - 1)
+				next = 1 << bits;
+			else
+				next = (int32_t)(covered / total * (1 << bits) +
+						 0.5);
+			w[k] = next - prev;
+			prev = next;
+		}
+
+		bw->start[i] = first;
+		bw->count[i] = last - first;
+	}
+
+	return 0;
+}
+
+/* Weights for every destination pixel the scaler covers, plus room to
+ * sum the widest span of source columns any row of them reads */
+struct wlb_box_scaler {
+	struct box_weights h, v;
+	uint16_t *row;
+};
+
+struct wlb_box_scaler *
+wlb_box_scaler_create(int32_t width, int32_t height,
+		      int32_t src_width, int32_t src_height,
+		      double x0, double y0, double scale_x, double scale_y)
+{
+	struct wlb_box_scaler *scaler;
+	int32_t cols;
+
+	pthread_once(&blit_once, blit_init);
+
+	scaler = calloc(1, sizeof *scaler);
+	if (!scaler)
+		return NULL;
+
+	if (box_weights_init(&scaler->h, width, x0, scale_x, src_width,
+			     BOX_H_BITS) < 0)
+		goto err_free;
+	if (box_weights_init(&scaler->v, height, y0, scale_y, src_height,
+			     BOX_V_BITS) < 0)
+		goto err_h;
+
+	cols = scaler->h.start[width - 1] + scaler->h.count[width - 1] -
+	       scaler->h.start[0];
+	scaler->row = malloc((size_t)cols * 4 * sizeof *scaler->row);
+	if (!scaler->row)
+		goto err_v;
+
+	return scaler;
+
+err_v:
+	box_weights_fini(&scaler->v);
+err_h:
+	box_weights_fini(&scaler->h);
+err_free:
+	free(scaler);
+
+	return NULL;
+}
+
+void
+wlb_box_scaler_destroy(struct wlb_box_scaler *scaler)
+{
+	free(scaler->row);
+	box_weights_fini(&scaler->v);
+	box_weights_fini(&scaler->h);
+	free(scaler);
+}
+
+void
+wlb_box_scaler_scale_32(struct wlb_box_scaler *scaler,
+			void *dest, int32_t dest_stride,
+			const void *src, int32_t src_stride,
+			int32_t x, int32_t y, int32_t width, int32_t height,
+			int set_alpha)
+{
+	struct box_weights *h = &scaler->h, *v = &scaler->v;
+	uint16_t *row = scaler->row;
+	int32_t i, k, col0, cols;
+
+	/* Only the columns we actually read get summed */
+	col0 = h->start[x];
+	cols = h->start[x + width - 1] + h->count[x + width - 1] - col0;
+
+	for (i = y; i < y + height; ++i) {
+		memset(row, 0, (size_t)cols * 4 * sizeof *row);
+		for (k = 0; k < v->count[i]; ++k)
+			box_accumulate(row,
+				       (const uint32_t *)((const char *)src +
+					(v->start[i] + k) * src_stride) + col0,
+				       cols, v->weights[i * v->max_count + k]);
+
+		box_reduce((uint32_t *)((char *)dest + (i - y) * dest_stride),
+			   row, col0, h->start + x, h->count + x,
+			   h->weights + x * h->max_count, h->max_count, width,
+			   set_alpha ? ALPHA_MASK : 0);
+	}
+}
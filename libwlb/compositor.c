@@ -29,14 +29,6 @@
 #include <assert.h>
 #include <errno.h>
 
-struct wlb_buffer_type_item {
-	struct wl_list link;
-
-	const struct wlb_buffer_type *type;
-	void *type_data;
-	size_t type_size;
-};
-
 static void
 compositor_create_surface(struct wl_client *client,
 			  struct wl_resource *resource, uint32_t id)
@@ -188,6 +180,59 @@ struct wlb_buffer_type shm_buffer_type = {
 	shm_buffer_munmap
 };
 
+static void
+buffer_info_destroy(struct wlb_buffer_info *info)
+{
+	wl_list_remove(&info->destroy_listener.link);
+	wl_list_remove(&info->link);
+	free(info);
+}
+
+static void
+buffer_info_destroyed(struct wl_listener *listener, void *data)
+{
+	struct wlb_buffer_info *info;
+
+	info = wl_container_of(listener, info, destroy_listener);
+	buffer_info_destroy(info);
+}
+
+static struct wlb_buffer_info *
+buffer_info_get(struct wlb_compositor *comp, struct wl_resource *buffer)
+{
+	struct wlb_buffer_info *info;
+	struct wlb_buffer_type_item *item;
+	struct wl_listener *listener;
+
+	listener = wl_resource_get_destroy_listener(buffer,
+						    buffer_info_destroyed);
+	if (listener)
+		return wl_container_of(listener, info, destroy_listener);
+
+	wl_list_for_each(item, &comp->buffer_type_list, link)
+		if (item->type->is_type(item->type_data, buffer))
+			break;
+
+	/* Unknown buffers are not cached so that a buffer type
+	 * registered later still gets a chance at them. */
+	if (&item->link == &comp->buffer_type_list)
+		return NULL;
+
+	info = zalloc(sizeof *info);
+	if (!info)
+		return NULL;
+
+	info->item = item;
+	item->type->get_size(item->type_data, buffer,
+			     &info->width, &info->height);
+
+	info->destroy_listener.notify = buffer_info_destroyed;
+	wl_resource_add_destroy_listener(buffer, &info->destroy_listener);
+	wl_list_insert(&comp->buffer_info_list, &info->link);
+
+	return info;
+}
+
 WL_EXPORT struct wlb_compositor *
 wlb_compositor_create(struct wl_display *display)
 {
@@ -200,9 +245,11 @@ wlb_compositor_create(struct wl_display *display)
 	comp->display = display;
 
 	wl_list_init(&comp->buffer_type_list);
+	wl_list_init(&comp->buffer_info_list);
 
 	wl_list_init(&comp->output_list);
 	wl_list_init(&comp->seat_list);
+	wl_array_init(&comp->shm_formats);
 	
 	if (!wl_global_create(display, &wl_compositor_interface, 3,
 			      comp, compositor_bind))
@@ -214,6 +261,14 @@ wlb_compositor_create(struct wl_display *display)
 	
 	wlb_compositor_add_buffer_type(comp, &shm_buffer_type, NULL);
 
+	comp->dmabuf = wlb_linux_dmabuf_create(comp);
+	if (!comp->dmabuf)
+		wlb_warn("Failed to create the linux-dmabuf global\n");
+
+	comp->shm_pools = wlb_shm_pools_create(display);
+	if (!comp->shm_pools)
+		wlb_warn("Failed to track wl_shm pool sizes\n");
+
 	return comp;
 
 err_alloc:
@@ -227,6 +282,7 @@ wlb_compositor_destroy(struct wlb_compositor *comp)
 	struct wlb_output *output, *onext;
 	struct wlb_seat *seat, *snext;
 	struct wlb_buffer_type_item *item, *inext;
+	struct wlb_buffer_info *info, *bnext;
 
 	wl_list_for_each_safe(output, onext, &comp->output_list, compositor_link)
 		wlb_output_destroy(output);
@@ -234,6 +290,15 @@ wlb_compositor_destroy(struct wlb_compositor *comp)
 	wl_list_for_each_safe(seat, snext, &comp->seat_list, compositor_link)
 		wlb_seat_destroy(seat);
 
+	if (comp->dmabuf)
+		wlb_linux_dmabuf_destroy(comp->dmabuf);
+	if (comp->shm_pools)
+		wlb_shm_pools_destroy(comp->shm_pools);
+	wl_array_release(&comp->shm_formats);
+
+	wl_list_for_each_safe(info, bnext, &comp->buffer_info_list, link)
+		buffer_info_destroy(info);
+
 	wl_list_for_each_safe(item, inext, &comp->buffer_type_list, link) {
 		wl_list_remove(&item->link);
 		free(item);
@@ -274,22 +339,88 @@ wlb_compositor_add_buffer_type_with_size(struct wlb_compositor *comp,
 	return 0;
 }
 
+void
+wlb_compositor_remove_buffer_type(struct wlb_compositor *comp,
+				  const struct wlb_buffer_type *type)
+{
+	struct wlb_buffer_type_item *item, *inext;
+	struct wlb_buffer_info *info, *bnext;
+
+	wl_list_for_each_safe(item, inext, &comp->buffer_type_list, link) {
+		if (item->type != type)
+			continue;
+
+		/* Buffers it claimed get classified again */
+		wl_list_for_each_safe(info, bnext, &comp->buffer_info_list, link)
+			if (info->item == item)
+				buffer_info_destroy(info);
+
+		wl_list_remove(&item->link);
+		free(item);
+	}
+}
+
+/* wl_display_add_shm_format does not check for duplicates, so we keep
+ * track of what has been added ourselves */
+void
+wlb_compositor_add_shm_format(struct wlb_compositor *comp, uint32_t format)
+{
+	uint32_t *f;
+
+	wl_array_for_each(f, &comp->shm_formats)
+		if (*f == format)
+			return;
+
+	f = wl_array_add(&comp->shm_formats, sizeof *f);
+	if (!f)
+		return;
+
+	*f = format;
+	wl_display_add_shm_format(comp->display, format);
+}
+
+WL_EXPORT int
+wlb_compositor_add_dmabuf_format(struct wlb_compositor *comp,
+				 uint32_t format, uint64_t modifier)
+{
+	if (!comp->dmabuf) {
+		errno = ENOTSUP;
+		return -1;
+	}
+
+	return wlb_linux_dmabuf_add_format(comp->dmabuf, format, modifier);
+}
+
 WL_EXPORT const struct wlb_buffer_type *
 wlb_compositor_get_buffer_type(struct wlb_compositor *comp,
 			       struct wl_resource *buffer,
 			       void **data, size_t *size)
 {
-	struct wlb_buffer_type_item *item;
+	struct wlb_buffer_info *info;
 
-	wl_list_for_each(item, &comp->buffer_type_list, link) {
-		if (item->type->is_type(item->type_data, buffer)) {
-			*data = item->type_data;
-			*size = item->type_size;
-			return item->type;
-		}
-	}
+	info = buffer_info_get(comp, buffer);
+	if (!info)
+		return NULL;
 
-	return NULL;
+	*data = info->item->type_data;
+	*size = info->item->type_size;
+	return info->item->type;
+}
+
+WL_EXPORT int
+wlb_compositor_get_buffer_size(struct wlb_compositor *comp,
+			       struct wl_resource *buffer,
+			       int32_t *width, int32_t *height)
+{
+	struct wlb_buffer_info *info;
+
+	info = buffer_info_get(comp, buffer);
+	if (!info)
+		return -1;
+
+	*width = info->width;
+	*height = info->height;
+	return 0;
 }
 
 WL_EXPORT struct wl_client *
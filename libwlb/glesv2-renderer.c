@@ -26,6 +26,9 @@
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
 
 #include <EGL/egl.h>
 #include <GLES2/gl2.h>
@@ -37,6 +40,177 @@
 #define TRUE 1
 #define FALSE 0
 
+/* How many frames of damage each output remembers for EGL_EXT_buffer_age */
+#define GLES2_DAMAGE_HISTORY 4
+
+/* Packing more than this at once would push the driver's own copy out of
+ * the cache anyway, so bypass it */
+#define GLES2_STAGING_STREAM_SIZE (2 << 20)
+
+/* How many frames of GPU timer queries each output keeps in flight */
+#define GLES2_TIMER_FRAMES 4
+
+/* Bump whenever the layout of cached program binaries changes */
+#define GLES2_PROGRAM_CACHE_MAGIC 0x31627077 /* "wpb1" */
+
+#ifndef GL_BGRA_EXT
+#define GL_BGRA_EXT 0x80E1
+#endif
+#ifndef GL_BGRA8_EXT
+#define GL_BGRA8_EXT 0x93A1
+#endif
+#ifndef GL_RGBA8_OES
+#define GL_RGBA8_OES 0x8058
+#endif
+
+#ifndef GL_EXT_texture_storage
+typedef void (GL_APIENTRYP PFNGLTEXSTORAGE2DEXTPROC) (GLenum target, GLsizei levels, GLenum internalformat, GLsizei width, GLsizei height);
+#endif
+
+/* OpenGL ES 3.0 entry points are looked up at runtime so that we still
+ * build against OpenGL ES 2.0 headers */
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#endif
+#ifndef GL_MAP_WRITE_BIT
+#define GL_MAP_WRITE_BIT 0x0002
+#endif
+#ifndef GL_MAP_INVALIDATE_BUFFER_BIT
+#define GL_MAP_INVALIDATE_BUFFER_BIT 0x0008
+#endif
+#ifndef GL_SYNC_GPU_COMMANDS_COMPLETE
+#define GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#endif
+#ifndef GL_TIMEOUT_IGNORED
+#define GL_TIMEOUT_IGNORED 0xFFFFFFFFFFFFFFFFull
+#endif
+#ifndef GL_PIXEL_PACK_BUFFER
+#define GL_PIXEL_PACK_BUFFER 0x88EB
+#endif
+#ifndef GL_MAP_READ_BIT
+#define GL_MAP_READ_BIT 0x0001
+#endif
+#ifndef GL_STREAM_READ
+#define GL_STREAM_READ 0x88E1
+#endif
+#ifndef GL_ALREADY_SIGNALED
+#define GL_ALREADY_SIGNALED 0x911A
+#endif
+#ifndef GL_CONDITION_SATISFIED
+#define GL_CONDITION_SATISFIED 0x911C
+#endif
+
+struct gles3_funcs {
+	void *(GL_APIENTRYP map_buffer_range)(GLenum target, GLintptr offset,
+					      GLsizeiptr length,
+					      GLbitfield access);
+	GLboolean (GL_APIENTRYP unmap_buffer)(GLenum target);
+	struct __GLsync *(GL_APIENTRYP fence_sync)(GLenum condition,
+						   GLbitfield flags);
+	void (GL_APIENTRYP wait_sync)(struct __GLsync *sync, GLbitfield flags,
+				      uint64_t timeout);
+	void (GL_APIENTRYP delete_sync)(struct __GLsync *sync);
+	GLenum (GL_APIENTRYP client_wait_sync)(struct __GLsync *sync,
+					       GLbitfield flags,
+					       uint64_t timeout);
+};
+
+#ifndef GL_TIME_ELAPSED_EXT
+#define GL_TIME_ELAPSED_EXT 0x88BF
+#endif
+#ifndef GL_QUERY_RESULT_EXT
+#define GL_QUERY_RESULT_EXT 0x8866
+#endif
+#ifndef GL_QUERY_RESULT_AVAILABLE_EXT
+#define GL_QUERY_RESULT_AVAILABLE_EXT 0x8867
+#endif
+#ifndef GL_GPU_DISJOINT_EXT
+#define GL_GPU_DISJOINT_EXT 0x8FBB
+#endif
+
+/* GL_EXT_disjoint_timer_query */
+struct gles2_timer_funcs {
+	void (GL_APIENTRYP gen_queries)(GLsizei n, GLuint *ids);
+	void (GL_APIENTRYP delete_queries)(GLsizei n, const GLuint *ids);
+	void (GL_APIENTRYP begin_query)(GLenum target, GLuint id);
+	void (GL_APIENTRYP end_query)(GLenum target);
+	void (GL_APIENTRYP get_query_objectuiv)(GLuint id, GLenum pname,
+						GLuint *params);
+	void (GL_APIENTRYP get_query_objectui64v)(GLuint id, GLenum pname,
+						  uint64_t *params);
+};
+
+/* EGL_EXT_image_dma_buf_import and friends */
+struct gles2_dmabuf_funcs {
+	void *(EGLAPIENTRYP create_image)(EGLDisplay dpy, EGLContext ctx,
+					  EGLenum target,
+					  EGLClientBuffer buffer,
+					  const EGLint *attribs);
+	EGLBoolean (EGLAPIENTRYP destroy_image)(EGLDisplay dpy, void *image);
+	void (GL_APIENTRYP image_target_texture_2d)(GLenum target,
+						    void *image);
+	EGLBoolean (EGLAPIENTRYP query_formats)(EGLDisplay dpy,
+						EGLint max_formats,
+						EGLint *formats,
+						EGLint *num_formats);
+	EGLBoolean (EGLAPIENTRYP query_modifiers)(EGLDisplay dpy,
+						  EGLint format,
+						  EGLint max_modifiers,
+						  uint64_t *modifiers,
+						  EGLBoolean *external_only,
+						  EGLint *num_modifiers);
+};
+
+/* The EGLImage of a dmabuf wl_buffer, kept for the buffer's lifetime.
+ * image is NULL if the import failed, in which case the buffer is left
+ * to the CPU path. */
+struct gles2_dmabuf_image {
+	struct wlb_gles2_renderer *renderer;
+	struct wl_list link;
+	struct wl_listener destroy_listener;
+
+	void *image;
+};
+
+enum gles2_timer {
+	GLES2_TIMER_UPLOAD,
+	GLES2_TIMER_ATTACH,
+	GLES2_TIMER_CLEAR,
+	GLES2_TIMER_DRAW,
+	GLES2_TIMER_COUNT
+};
+
+/* The timer queries of one frame.  used has a bit set for every timer
+ * that was started. */
+struct gles2_timer_frame {
+	GLuint queries[GLES2_TIMER_COUNT];
+	uint32_t used;
+	uint32_t frame;
+	int pending;
+};
+
+/* A readback queued by wlb_gles2_renderer_read_pixels_async.  It waits on
+ * the output's read_queue for the next repaint and then on the renderer's
+ * read_list until it has been reported. */
+struct gles2_read_request {
+	struct wl_list link;
+
+	pixman_region32_t region;
+	void *dest;
+	int32_t stride;
+	void (*callback)(void *data, int status);
+	void *data;
+
+	/* Set for reads still in flight on the GPU */
+	GLuint pbo;
+	struct __GLsync *fence;
+	GLenum format;
+	GLsizeiptr size;
+
+	int done;
+	int status;
+};
+
 struct gles2_shader {
 	struct wl_list link;
 	union {
@@ -48,8 +222,6 @@ struct gles2_shader {
 	GLuint program;
 
 	GLint va_vertex;
-	GLint vu_buffer_tf;
-	GLint vu_output_tf;
 
 	union {
 		GLint fu_texture;
@@ -57,32 +229,151 @@ struct gles2_shader {
 	};
 };
 
+struct gles2_texture_storage {
+	GLenum format;
+	int32_t width, height;
+};
+
+/* SHM uploads done on the upload thread.  The thread uploads into a
+ * second texture, which is swapped with textures[0] by the next repaint.
+ * Everything but link and queued belongs to the thread while queued is
+ * set and to the main thread otherwise.  The thread only ever writes
+ * pixels; texture storage is allocated by the repaint. */
+struct gles2_upload {
+	struct wl_list link;
+	int queued;
+
+	struct wl_resource *buffer;
+	struct wl_listener buffer_destroy_listener;
+	const struct wlb_buffer_type *buffer_type;
+	void *buffer_type_data;
+	void *data;
+	uint32_t stride, format;
+	int32_t width, height;
+
+	/* What the thread should upload */
+	pixman_region32_t region;
+
+	int uploaded;
+	int pending;
+	struct __GLsync *fence;
+
+	/* Signalled once draws that may sample texture are done */
+	struct __GLsync *read_fence;
+
+	GLuint texture;
+	struct gles2_texture_storage storage;
+
+	/* Where texture and textures[0] differ from the latest commit */
+	pixman_region32_t stale;
+	pixman_region32_t front_stale;
+};
+
 struct gles2_surface {
 	struct wlb_gles2_renderer *renderer;
 	struct wl_list link;
 
 	struct wlb_surface *surface;
 	struct wl_listener destroy_listener;
+	struct wl_listener commit_listener;
 
 	int32_t bwidth, bheight;
-	uint32_t bpitch;
+
+	/* Storage allocated for textures[0] when it holds SHM contents */
+	struct gles2_texture_storage tex_storage;
+	struct gles2_upload upload;
 
 	struct wl_resource *buffer;
 	const struct wlb_buffer_type *buffer_type;
 	void *buffer_type_data;
 	size_t buffer_type_size;
 
-	struct gles2_shader *shader;
+	/* The shader is chosen when new contents arrive rather than on every
+	 * repaint.  shader_type is the buffer type it was chosen for, or
+	 * NULL for SHM.  opaque_shader is the one to use on targets
+	 * without alpha. */
+	struct gles2_shader *shader, *opaque_shader;
+	const struct wlb_buffer_type *shader_type;
+
+	/* The buffer last handed to the buffer type's attach, cleared
+	 * when it is destroyed */
+	struct wl_resource *attached_buffer;
+	struct wl_listener attached_buffer_destroy_listener;
 
 	GLuint textures[WLB_BUFFER_MAX_PLANES];
 };
 
+enum gles2_output_target {
+	GLES2_TARGET_WINDOW,
+	GLES2_TARGET_PBUFFER,
+	GLES2_TARGET_FBO,
+};
+
 struct gles2_output {
 	struct wlb_gles2_renderer *renderer;
 	struct wl_list link;
 	struct wl_listener destroy_listener;
+	struct wl_listener geometry_listener;
 
+	enum gles2_output_target target;
 	EGLSurface egl_surface;
+
+	/* Off-screen targets are sized to the current mode and keep their
+	 * contents from one frame to the next once they have been painted */
+	GLuint fbo, fbo_texture;
+	int32_t target_width, target_height;
+	int target_valid;
+
+	/* Damage of the last few frames in device pixels, most recent first */
+	pixman_region32_t damage_history[GLES2_DAMAGE_HISTORY];
+
+	/* Rebuilt when the output geometry or transform changes */
+	int output_mat_valid;
+	enum wl_output_transform output_mat_transform;
+	struct wlb_matrix output_mat;
+
+	/* Where the surface sits on the output, and the buffer transform
+	 * and vertices built for it.  vertex_count is 0 if there are none
+	 * yet. */
+	struct {
+		enum wl_output_transform transform;
+		int32_t x, y;
+		uint32_t width, height;
+	} placement;
+	struct wlb_matrix buffer_mat;
+	GLuint vbo;
+	GLsizei vertex_count;
+
+	/* The framebuffer we draw to has no alpha channel, so nothing
+	 * reads the alpha we write */
+	int opaque;
+
+	uint32_t frame_count;
+
+	/* Reads to do at the end of the next repaint */
+	struct wl_list read_queue;
+
+	/* GPU timings are read back a few frames later, once the queries
+	 * have results */
+	struct gles2_timer_frame timer_frames[GLES2_TIMER_FRAMES];
+	int timer_index;
+	int has_timings;
+	uint32_t timings_frame;
+	uint64_t timings[GLES2_TIMER_COUNT];
+};
+
+struct gles2_uploader {
+	struct wlb_gles2_renderer *renderer;
+	EGLContext egl_context;
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	struct wl_list job_list;
+	int quit;
+
+	struct wl_array staging;
 };
 
 struct wlb_gles2_renderer {
@@ -100,9 +391,14 @@ struct wlb_gles2_renderer {
 	/* List of outputs */
 	struct wl_list output_list;
 
-	struct wlb_matrix output_mat;
 	struct wl_array vertices;
 
+	/* Objects of destroyed outputs, deleted on the next repaint */
+	struct wl_array dead_buffers;
+	struct wl_array dead_framebuffers;
+	struct wl_array dead_textures;
+	struct wl_array dead_queries;
+
 	GLuint vertex_shader;
 	struct gles2_shader *solid_shader;
 	struct wl_list shm_format_shader_list;
@@ -114,21 +410,80 @@ struct wlb_gles2_renderer {
 
 	struct wlb_wayland_egl_binding *wayland_binding;
 
+	/* dmabuf_display is set once dmabuf_type has been registered */
+	int has_dmabuf_import;
+	int has_dmabuf_modifiers;
+	EGLDisplay dmabuf_display;
+	struct gles2_dmabuf_funcs dmabuf;
+	GLint dmabuf_tex_uniform;
+	struct wl_list dmabuf_image_list;
+
 	int initialized;
 
+	/* Our EGL config has no alpha channel */
+	int opaque_config;
+
 	int has_unpack_subimage;
+	int has_bgra8888;
+	PFNGLTEXSTORAGE2DEXTPROC tex_storage_2d;
+	int has_bgra8_storage;
+
+	int has_gles3;
+	struct gles3_funcs gles3;
+
+	int has_buffer_age;
+	PFNEGLSWAPBUFFERSWITHDAMAGEEXTPROC swap_buffers_with_damage;
+
+	int gpu_timing;
+	int has_timer_query;
+	struct gles2_timer_funcs timer;
+	/* Queries of the frame being repainted, or NULL if not timing */
+	struct gles2_timer_frame *timer_frame;
+
+	int has_read_bgra;
+	struct wl_list read_list;
+	struct wl_event_source *read_timer;
+	struct wl_event_source *read_idle;
+
+	/* Double-buffered staging for uploads on the repaint path */
+	GLuint pbos[2];
+	GLsizeiptr pbo_sizes[2];
+	int pbo_index;
+
+	/* Staging for drivers that cannot upload from a strided source */
+	struct wl_array staging;
+
+	int async_upload;
+	struct gles2_uploader *uploader;
+	int has_surfaceless;
+
+	/* On-disk cache of linked programs, keyed by a hash of the driver
+	 * and the shader sources.  program_cache_dir is NULL if there is
+	 * no cache. */
+	char *program_cache_dir;
+	uint64_t program_cache_seed;
+#ifdef GL_OES_get_program_binary
+	PFNGLGETPROGRAMBINARYOESPROC get_program_binary;
+	PFNGLPROGRAMBINARYOESPROC program_binary;
+#endif
 };
 
+struct gles2_program_cache_header {
+	uint32_t magic;
+	uint32_t format;
+	uint32_t length;
+};
+
+/* Both transforms are baked into the vertex buffer, see
+ * gles2_output_update_placement, so xy is the position in clip space and
+ * zw is the texture coordinate */
 static const GLchar *vertex_shader_source =
-"attribute highp vec2 va_vertex;\n"
-"uniform highp mat3 vu_buffer_tf;\n"
-"uniform highp mat3 vu_output_tf;\n"
+"attribute highp vec4 va_vertex;\n"
 "varying mediump vec2 vo_tex_coord;\n"
 "\n"
 "void main() {\n"
-"	vec3 pos = vu_output_tf * vec3(va_vertex, 1);\n"
-"	vo_tex_coord = (vu_buffer_tf * vec3(va_vertex, 1)).xy;\n"
-"	gl_Position = vec4(pos.xy, 0, pos.z);\n"
+"	vo_tex_coord = va_vertex.zw;\n"
+"	gl_Position = vec4(va_vertex.xy, 0, 1);\n"
 "}\n";
 
 static const GLchar *solid_shader_source =
@@ -143,7 +498,7 @@ static const GLchar *argb8888_shader_source =
 "varying mediump vec2 vo_tex_coord;\n"
 "\n"
 "void main() {\n"
-"	gl_FragColor = vec4(texture2D(fu_texture, vo_tex_coord).bgr, 1);\n"
+"	gl_FragColor = texture2D(fu_texture, vo_tex_coord).bgra;\n"
 "}\n";
 
 static const GLchar *xrgb8888_shader_source =
@@ -151,7 +506,24 @@ static const GLchar *xrgb8888_shader_source =
 "varying mediump vec2 vo_tex_coord;\n"
 "\n"
 "void main() {\n"
-"	gl_FragColor = texture2D(fu_texture, vo_tex_coord).bgra;\n"
+"	gl_FragColor = vec4(texture2D(fu_texture, vo_tex_coord).bgr, 1);\n"
+"}\n";
+
+/* Used when the texture was uploaded as GL_BGRA_EXT */
+static const GLchar *argb8888_bgra_shader_source =
+"uniform sampler2D fu_texture;\n"
+"varying mediump vec2 vo_tex_coord;\n"
+"\n"
+"void main() {\n"
+"	gl_FragColor = texture2D(fu_texture, vo_tex_coord);\n"
+"}\n";
+
+static const GLchar *xrgb8888_bgra_shader_source =
+"uniform sampler2D fu_texture;\n"
+"varying mediump vec2 vo_tex_coord;\n"
+"\n"
+"void main() {\n"
+"	gl_FragColor = vec4(texture2D(fu_texture, vo_tex_coord).rgb, 1);\n"
 "}\n";
 
 static const GLchar *buffer_type_shader_source = 
@@ -237,18 +609,163 @@ gles2_shader_destroy(struct gles2_shader *shader, int cleanup_gl)
 	free(shader);
 }
 
+/* FNV-1a, including the terminating nul so that the concatenation of
+ * several strings is unambiguous */
+static uint64_t
+hash_string(uint64_t hash, const char *str)
+{
+	if (!str)
+		str = "";
+
+	do {
+		hash ^= (uint8_t)*str;
+		hash *= 0x100000001b3ull;
+	} while (*str++);
+
+	return hash;
+}
+
+static char *
+program_cache_path(struct wlb_gles2_renderer *r, uint64_t key,
+		   const char *suffix)
+{
+	char *path;
+	size_t len;
+
+	len = strlen(r->program_cache_dir) + 32 + strlen(suffix);
+	path = malloc(len);
+	if (!path)
+		return NULL;
+
+	snprintf(path, len, "%s/%016" PRIx64 ".bin%s",
+		 r->program_cache_dir, key, suffix);
+
+	return path;
+}
+
+static GLuint
+program_cache_load(struct wlb_gles2_renderer *r, uint64_t key)
+{
+#ifdef GL_OES_get_program_binary
+	struct gles2_program_cache_header header;
+	GLuint program = 0;
+	GLint status;
+	char *path;
+	void *binary = NULL;
+	FILE *file;
+
+	if (!r->program_cache_dir)
+		return 0;
+
+	path = program_cache_path(r, key, "");
+	if (!path)
+		return 0;
+
+	file = fopen(path, "rb");
+	if (!file)
+		goto out;
+
+	if (fread(&header, sizeof header, 1, file) != 1 ||
+	    header.magic != GLES2_PROGRAM_CACHE_MAGIC ||
+	    header.length == 0 || header.length > (64 << 20))
+		goto out;
+
+	binary = malloc(header.length);
+	if (!binary || fread(binary, header.length, 1, file) != 1)
+		goto out;
+
+	program = glCreateProgram();
+	r->program_binary(program, header.format, binary, header.length);
+
+	/* The driver is free to reject binaries, e.g. after an update */
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (status != GL_TRUE) {
+		wlb_debug("Discarding stale program binary %s\n", path);
+		glDeleteProgram(program);
+		unlink(path);
+		program = 0;
+	}
+
+out:
+	if (file)
+		fclose(file);
+	free(binary);
+	free(path);
+
+	return program;
+#else
+	return 0;
+#endif
+}
+
+static void
+program_cache_store(struct wlb_gles2_renderer *r, uint64_t key,
+		    GLuint program)
+{
+#ifdef GL_OES_get_program_binary
+	struct gles2_program_cache_header header;
+	char *path, *tmp_path, suffix[32];
+	void *binary = NULL;
+	GLint length;
+	GLenum format;
+	FILE *file;
+	int ok;
+
+	if (!r->program_cache_dir)
+		return;
+
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+	if (length <= 0)
+		return;
+
+	binary = malloc(length);
+	if (!binary)
+		return;
+
+	r->get_program_binary(program, length, &length, &format, binary);
+	if (length <= 0) {
+		free(binary);
+		return;
+	}
+
+	/* Write to a temporary file first so that a concurrent reader never
+	 * sees a partial binary */
+	snprintf(suffix, sizeof suffix, ".%d", (int)getpid());
+	path = program_cache_path(r, key, "");
+	tmp_path = program_cache_path(r, key, suffix);
+	if (!path || !tmp_path)
+		goto out;
+
+	file = fopen(tmp_path, "wb");
+	if (!file)
+		goto out;
+
+	header.magic = GLES2_PROGRAM_CACHE_MAGIC;
+	header.format = format;
+	header.length = length;
+
+	ok = fwrite(&header, sizeof header, 1, file) == 1 &&
+	     fwrite(binary, length, 1, file) == 1;
+	if (fclose(file) != 0)
+		ok = 0;
+
+	if (!ok || rename(tmp_path, path) < 0)
+		unlink(tmp_path);
+
+out:
+	free(tmp_path);
+	free(path);
+	free(binary);
+#endif
+}
+
 static struct gles2_shader *
 gles2_shader_get_for_source(struct wlb_gles2_renderer *r, GLsizei count,
 			    const GLchar * const *source)
 {
 	struct gles2_shader *shader;
-
-	if (!r->vertex_shader) {
-		r->vertex_shader = shader_from_source(GL_VERTEX_SHADER, 1,
-						      &vertex_shader_source);
-		if (!r->vertex_shader)
-			return NULL;
-	}
+	uint64_t key;
+	GLsizei i;
 
 	shader = zalloc(sizeof *shader);
 	if (!shader)
@@ -256,6 +773,21 @@ gles2_shader_get_for_source(struct wlb_gles2_renderer *r, GLsizei count,
 	
 	wl_list_init(&shader->link);
 
+	key = hash_string(r->program_cache_seed, vertex_shader_source);
+	for (i = 0; i < count; ++i)
+		key = hash_string(key, source[i]);
+
+	shader->program = program_cache_load(r, key);
+	if (shader->program)
+		goto linked;
+
+	if (!r->vertex_shader) {
+		r->vertex_shader = shader_from_source(GL_VERTEX_SHADER, 1,
+						      &vertex_shader_source);
+		if (!r->vertex_shader)
+			goto err_alloc;
+	}
+
 	shader->fshader = shader_from_source(GL_FRAGMENT_SHADER, count, source);
 	if (!shader->fshader)
 		goto err_alloc;
@@ -264,12 +796,11 @@ gles2_shader_get_for_source(struct wlb_gles2_renderer *r, GLsizei count,
 					       shader->fshader);
 	if (!shader->program)
 		goto err_shader;
-	
+
+	program_cache_store(r, key, shader->program);
+
+linked:
 	shader->va_vertex = glGetAttribLocation(shader->program, "va_vertex");
-	shader->vu_buffer_tf =
-		glGetUniformLocation(shader->program, "vu_buffer_tf");
-	shader->vu_output_tf =
-		glGetUniformLocation(shader->program, "vu_output_tf");
 
 	return shader;
 
@@ -291,11 +822,13 @@ gles2_shader_get_for_shm_format(struct wlb_gles2_renderer *r, uint32_t format)
 
 	switch (format) {
 	case WL_SHM_FORMAT_ARGB8888:
-		shader = gles2_shader_get_for_source(r, 1,
+		shader = gles2_shader_get_for_source(r, 1, r->has_bgra8888 ?
+						     &argb8888_bgra_shader_source :
 						     &argb8888_shader_source);
 		break;
 	case WL_SHM_FORMAT_XRGB8888:
-		shader = gles2_shader_get_for_source(r, 1,
+		shader = gles2_shader_get_for_source(r, 1, r->has_bgra8888 ?
+						     &xrgb8888_bgra_shader_source :
 						     &xrgb8888_shader_source);
 		break;
 	default:
@@ -309,7 +842,9 @@ gles2_shader_get_for_shm_format(struct wlb_gles2_renderer *r, uint32_t format)
 
 	shader->fu_texture =
 		glGetUniformLocation(shader->program, "fu_texture");
-	
+	glUseProgram(shader->program);
+	glUniform1i(shader->fu_texture, 0);
+
 	shader->format = format;
 	wl_list_insert(&r->shm_format_shader_list, &shader->link);
 
@@ -363,169 +898,890 @@ gles2_shader_get_solid(struct wlb_gles2_renderer *r)
 }
 
 static void
-gles2_surface_destroy(struct gles2_surface *surface, int cleanup_gl)
+gles2_timer_begin(struct wlb_gles2_renderer *gr, enum gles2_timer timer)
 {
-	if (cleanup_gl)
-		glDeleteTextures(WLB_BUFFER_MAX_PLANES, surface->textures);
+	struct gles2_timer_frame *tf = gr->timer_frame;
 
-	wl_list_remove(&surface->link);
-	wl_list_remove(&surface->destroy_listener.link);
+	if (!tf)
+		return;
 
-	free(surface);
+	if (!tf->queries[timer])
+		gr->timer.gen_queries(1, &tf->queries[timer]);
+
+	gr->timer.begin_query(GL_TIME_ELAPSED_EXT, tf->queries[timer]);
+	tf->used |= 1 << timer;
 }
 
 static void
-surface_destroy_handler(struct wl_listener *listener, void *data)
+gles2_timer_end(struct wlb_gles2_renderer *gr)
 {
-	struct gles2_surface *gs;
-	
-	gs = wl_container_of(listener, gs, destroy_listener);
-
-	wl_list_remove(&gs->link);
-	wl_list_insert(&gs->renderer->surface_cleanup_list, &gs->link);
+	if (gr->timer_frame)
+		gr->timer.end_query(GL_TIME_ELAPSED_EXT);
 }
 
-static struct gles2_surface *
-gles2_surface_get(struct wlb_gles2_renderer *gr, struct wlb_surface *surface)
+static void
+gles2_texture_create(GLuint *texture)
 {
-	struct gles2_surface *gs;
-	struct wl_listener *listener;
-
-	listener = wlb_surface_get_destroy_listener(surface,
-						    surface_destroy_handler);
-	if (listener) {
-		gs = wl_container_of(listener, gs, destroy_listener);
-		return gs;
-	}
-
-	gs = zalloc(sizeof *gs);
-	if (!gs)
-		return NULL;
-
-	gs->renderer = gr;
-	gs->surface = surface;
-	gs->destroy_listener.notify = surface_destroy_handler;
-	wlb_surface_add_destroy_listener(surface, &gs->destroy_listener);
-	wl_list_insert(&gr->surface_list, &gs->link);
+	glGenTextures(1, texture);
 
-	return gs;
+	glBindTexture(GL_TEXTURE_2D, *texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 }
 
+/* Makes sure the texture has storage of the given format and size.
+ * Returns 1 if new storage had to be allocated, in which case the texture
+ * contents are undefined.  Leaves the texture bound. */
 static int
-gles2_surface_update_shm(struct wlb_gles2_renderer *gr,
-			 struct gles2_surface *gs, int full_damage)
+gles2_texture_ensure_storage(struct wlb_gles2_renderer *gr, GLuint *texture,
+			     struct gles2_texture_storage *storage,
+			     GLenum format, int32_t width, int32_t height)
 {
-	struct wlb_rectangle *drects;
-	uint32_t format, stride;
-	void *pixel_data;
-	int i, ndrects, err = 0;
-
-	if (full_damage) {
-		drects = NULL;
-	} else {
-		drects = wlb_surface_get_buffer_damage(gs->surface, &ndrects);
-
-		if (ndrects == 0)
-			return 0;
+	GLenum internal_format;
 
-		if (!drects)
-			/* Failed to get damage, but we can still try and
-			 * upload the entire thing */
-			full_damage = 1;
+	if (*texture && storage->format == format &&
+	    storage->width == width && storage->height == height) {
+		glBindTexture(GL_TEXTURE_2D, *texture);
+		return 0;
 	}
 
-	pixel_data = gs->buffer_type->mmap(gs->buffer_type_data, gs->buffer,
-					   &stride, &format);
-	if (!pixel_data) {
-		wlb_error("Failed to map buffer");
-		err = 1;
-		goto err_damage;
+	/* Immutable storage cannot be respecified, so always start over
+	 * with a fresh texture.  This only happens on resize. */
+	glDeleteTextures(1, texture);
+	gles2_texture_create(texture);
+
+	storage->format = format;
+	storage->width = width;
+	storage->height = height;
+
+	if (gr->tex_storage_2d &&
+	    (format == GL_RGBA || gr->has_bgra8_storage)) {
+		internal_format = (format == GL_RGBA) ? GL_RGBA8_OES : GL_BGRA8_EXT;
+		gr->tex_storage_2d(GL_TEXTURE_2D, 1, internal_format,
+				   width, height);
+		return 1;
 	}
 
-	gs->bpitch = stride / 4;
-
-	gs->shader = gles2_shader_get_for_shm_format(gr, format);
-	if (!gs->shader) {
-		wlb_error("Failed to find shader");
-		err = 1;
-		goto err_mmap;
-	}
+	glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0,
+		     format, GL_UNSIGNED_BYTE, NULL);
 
-	glUseProgram(gs->shader->program);
+	return 1;
+}
 
-	glUniform1i(gs->shader->fu_texture, 0);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, gs->textures[0]);
+static void
+gles2_upload_box(struct wlb_gles2_renderer *gr, int32_t width, GLenum format,
+		 uint8_t *pixels, uint32_t stride, pixman_box32_t *box)
+{
+	int32_t row;
 
 #ifdef GL_EXT_unpack_subimage
-	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, gs->bpitch);
-
-	if (gr->has_unpack_subimage && full_damage) {
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, gs->bwidth, gs->bheight,
-			     0, GL_RGBA, GL_UNSIGNED_BYTE, pixel_data);
-		goto done;
-	} else if (gr->has_unpack_subimage) {
-		for (i = 0; i < ndrects; ++i) {
-			glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, drects[i].x);
-			glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, drects[i].y);
-			glTexSubImage2D(GL_TEXTURE_2D, 0,
-					drects[i].x, drects[i].y,
-					drects[i].width, drects[i].height,
-					GL_RGBA, GL_UNSIGNED_BYTE, pixel_data);
-		}
-		goto done;
+	if (gr->has_unpack_subimage) {
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, box->x1);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, box->y1);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, box->x1, box->y1,
+				box->x2 - box->x1, box->y2 - box->y1,
+				format, GL_UNSIGNED_BYTE, pixels);
+		return;
 	}
 #endif
 
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, gs->bpitch, gs->bheight, 0,
-		     GL_RGBA, GL_UNSIGNED_BYTE, pixel_data);
-
-done:
-err_mmap:
-	if (gs->buffer_type->munmap)
-		gs->buffer_type->munmap(gs->buffer_type_data, gs->buffer,
-					pixel_data);
-err_damage:
-	free(drects);
+	if (stride == (uint32_t)width * 4) {
+		/* The rows are contiguous, so upload whole rows at once */
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, box->y1,
+				width, box->y2 - box->y1, format,
+				GL_UNSIGNED_BYTE, pixels + box->y1 * stride);
+		return;
+	}
 
-	return err ? -1 : 0;
+	for (row = box->y1; row < box->y2; ++row)
+		glTexSubImage2D(GL_TEXTURE_2D, 0, box->x1, row,
+				box->x2 - box->x1, 1, format, GL_UNSIGNED_BYTE,
+				pixels + row * stride + box->x1 * 4);
 }
 
-static void
-gles2_surface_ensure_textures(struct gles2_surface *gs, int num_textures)
+/* Stages the boxes, tightly packed, in a pixel buffer object so that the
+ * texture upload itself can happen asynchronously. */
+static int
+gles2_upload_boxes_pbo(struct wlb_gles2_renderer *gr, GLenum format,
+		       uint8_t *pixels, uint32_t stride,
+		       pixman_box32_t *boxes, int nboxes)
 {
+	GLsizeiptr size, offset;
+	uint8_t *staging;
+	int32_t width, height;
 	int i;
 
-	if (num_textures < 0)
-		num_textures = 0;
+	size = 0;
+	for (i = 0; i < nboxes; ++i)
+		size += (GLsizeiptr)(boxes[i].x2 - boxes[i].x1) *
+			(boxes[i].y2 - boxes[i].y1) * 4;
+
+	/* Alternate between two buffers so that we never map the one the
+	 * last upload may still be reading from */
+	gr->pbo_index = !gr->pbo_index;
+	if (gr->pbos[gr->pbo_index] == 0)
+		glGenBuffers(1, &gr->pbos[gr->pbo_index]);
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, gr->pbos[gr->pbo_index]);
+	if (gr->pbo_sizes[gr->pbo_index] < size) {
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL,
+			     GL_STREAM_DRAW);
+		gr->pbo_sizes[gr->pbo_index] = size;
+	}
+
+	staging = gr->gles3.map_buffer_range(GL_PIXEL_UNPACK_BUFFER, 0, size,
+					     GL_MAP_WRITE_BIT |
+					     GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (!staging) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return -1;
+	}
+
+	/* Mapped buffers are usually write-combined */
+	offset = 0;
+	for (i = 0; i < nboxes; ++i) {
+		width = boxes[i].x2 - boxes[i].x1;
+		height = boxes[i].y2 - boxes[i].y1;
+
+		wlb_blit_32_stream(staging + offset, width * 4,
+				   pixels + boxes[i].y1 * stride +
+				   boxes[i].x1 * 4,
+				   stride, width, height);
+		offset += (GLsizeiptr)width * height * 4;
+	}
+
+	if (!gr->gles3.unmap_buffer(GL_PIXEL_UNPACK_BUFFER)) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		return -1;
+	}
+
+	offset = 0;
+	for (i = 0; i < nboxes; ++i) {
+		glTexSubImage2D(GL_TEXTURE_2D, 0, boxes[i].x1, boxes[i].y1,
+				boxes[i].x2 - boxes[i].x1,
+				boxes[i].y2 - boxes[i].y1,
+				format, GL_UNSIGNED_BYTE,
+				(void *)(uintptr_t)offset);
+		offset += (GLsizeiptr)(boxes[i].x2 - boxes[i].x1) *
+			  (boxes[i].y2 - boxes[i].y1) * 4;
+	}
 
-	for (i = 0; i < num_textures && i < WLB_BUFFER_MAX_PLANES; ++i) {
-		if (gs->textures[0] != 0)
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	return 0;
+}
+
+/* Packs the boxes tightly into memory and uploads each one from there,
+ * for drivers without GL_EXT_unpack_subimage.  Full-width boxes are
+ * already tightly packed in the buffer and go straight from there. */
+static int
+gles2_upload_boxes_staged(struct wlb_gles2_renderer *gr,
+			  struct wl_array *staging, int32_t buffer_width,
+			  GLenum format, uint8_t *pixels, uint32_t stride,
+			  pixman_box32_t *boxes, int nboxes)
+{
+	uint8_t *dest;
+	int32_t width, height;
+	size_t size;
+	int i;
+
+	size = 0;
+	for (i = 0; i < nboxes; ++i)
+		size += (size_t)(boxes[i].x2 - boxes[i].x1) *
+			(boxes[i].y2 - boxes[i].y1) * 4;
+
+	staging->size = 0;
+	dest = wl_array_add(staging, size);
+	if (!dest)
+		return -1;
+
+	for (i = 0; i < nboxes; ++i) {
+		width = boxes[i].x2 - boxes[i].x1;
+		height = boxes[i].y2 - boxes[i].y1;
+
+		if (width == buffer_width && stride == (uint32_t)width * 4) {
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, boxes[i].y1,
+					width, height, format,
+					GL_UNSIGNED_BYTE,
+					pixels + boxes[i].y1 * stride);
 			continue;
+		}
 
-		glGenTextures(1, &gs->textures[i]);
+		if (size > GLES2_STAGING_STREAM_SIZE)
+			wlb_blit_32_stream(dest, width * 4,
+					   pixels + boxes[i].y1 * stride +
+					   boxes[i].x1 * 4,
+					   stride, width, height);
+		else
+			wlb_blit_32(dest, width * 4,
+				    pixels + boxes[i].y1 * stride +
+				    boxes[i].x1 * 4,
+				    stride, width, height, 0);
+
+		glTexSubImage2D(GL_TEXTURE_2D, 0, boxes[i].x1, boxes[i].y1,
+				width, height, format, GL_UNSIGNED_BYTE, dest);
+		dest += (size_t)width * height * 4;
+	}
+
+	return 0;
+}
 
-		glBindTexture(GL_TEXTURE_2D, gs->textures[i]);
-		glTexParameteri(GL_TEXTURE_2D,
-				GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D,
-				GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D,
-				GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D,
-				GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+/* Cuts down on the number of uploads when the boxes have to be packed
+ * anyway.  Boxes sharing a band are merged when they cover at least half
+ * of it, as are bands that end up directly on top of each other.  The
+ * result is written to bands, which must have room for nboxes. */
+static int
+gles2_coalesce_boxes(pixman_box32_t *bands,
+		     pixman_box32_t *boxes, int nboxes)
+{
+	pixman_box32_t *band, *last;
+	int32_t covered;
+	int i, j, nbands;
+
+	nbands = 0;
+	for (i = 0; i < nboxes; i = j) {
+		covered = 0;
+		for (j = i; j < nboxes && boxes[j].y1 == boxes[i].y1; ++j)
+			covered += boxes[j].x2 - boxes[j].x1;
+
+		if (covered * 2 < boxes[j - 1].x2 - boxes[i].x1) {
+			memcpy(&bands[nbands], &boxes[i],
+			       (j - i) * sizeof *boxes);
+			nbands += j - i;
+			continue;
+		}
+
+		band = &bands[nbands];
+		band->x1 = boxes[i].x1;
+		band->y1 = boxes[i].y1;
+		band->x2 = boxes[j - 1].x2;
+		band->y2 = boxes[i].y2;
+
+		last = nbands > 0 ? &bands[nbands - 1] : NULL;
+		if (last && last->x1 == band->x1 && last->x2 == band->x2 &&
+		    last->y2 == band->y1)
+			last->y2 = band->y2;
+		else
+			++nbands;
 	}
 
+	return nbands;
+}
+
+/* Uploads the given region, which must lie inside the buffer, into the
+ * currently bound texture */
+static void
+gles2_upload_region(struct wlb_gles2_renderer *gr, struct wl_array *staging,
+		    int use_pbo, int32_t width, GLenum format,
+		    uint8_t *pixels, uint32_t stride,
+		    pixman_region32_t *region)
+{
+	pixman_box32_t *boxes, *bands;
+	int i, nboxes, nbands, done;
+
+	boxes = pixman_region32_rectangles(region, &nboxes);
+	if (nboxes == 0)
+		return;
+
+	use_pbo = use_pbo && gr->has_gles3;
+	if (use_pbo || !gr->has_unpack_subimage) {
+		bands = malloc(nboxes * sizeof *bands);
+		if (bands) {
+			nbands = gles2_coalesce_boxes(bands, boxes, nboxes);
+
+			done = 0;
+			if (use_pbo)
+				done = gles2_upload_boxes_pbo(gr, format,
+							      pixels, stride,
+							      bands,
+							      nbands) == 0;
+			if (!done && !gr->has_unpack_subimage)
+				done = gles2_upload_boxes_staged(gr, staging,
+								 width, format,
+								 pixels, stride,
+								 bands,
+								 nbands) == 0;
+			free(bands);
+
+			if (done)
+				return;
+		}
+	}
+
+#ifdef GL_EXT_unpack_subimage
+	if (gr->has_unpack_subimage)
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, stride / 4);
+#endif
+
+	for (i = 0; i < nboxes; ++i)
+		gles2_upload_box(gr, width, format, pixels, stride, &boxes[i]);
+
+#ifdef GL_EXT_unpack_subimage
+	/* We may be running in someone else's context */
+	if (gr->has_unpack_subimage) {
+		glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+	}
+#endif
+}
+
+static GLenum
+gles2_shm_texture_format(struct wlb_gles2_renderer *gr)
+{
+	return gr->has_bgra8888 ? GL_BGRA_EXT : GL_RGBA;
+}
+
+/* Runs on the upload thread */
+static void
+gles2_upload_run(struct wlb_gles2_renderer *gr, struct gles2_upload *up)
+{
+	/* The last fence was waited on by the repaint, or never will be */
+	if (up->fence) {
+		gr->gles3.delete_sync(up->fence);
+		up->fence = NULL;
+	}
+
+	if (up->read_fence) {
+		gr->gles3.wait_sync(up->read_fence, 0, GL_TIMEOUT_IGNORED);
+		gr->gles3.delete_sync(up->read_fence);
+		up->read_fence = NULL;
+	}
+
+	glBindTexture(GL_TEXTURE_2D, up->texture);
+	gles2_upload_region(gr, &gr->uploader->staging, FALSE, up->width,
+			    up->storage.format, up->data, up->stride,
+			    &up->region);
+
+	up->fence = gr->gles3.fence_sync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	glFlush();
+
+	up->uploaded = (up->fence != NULL);
+}
+
+static void *
+gles2_uploader_thread(void *data)
+{
+	struct gles2_uploader *uploader = data;
+	struct wlb_gles2_renderer *gr = uploader->renderer;
+	struct gles2_upload *up;
+	EGLBoolean current;
+
+	current = eglMakeCurrent(gr->egl_display, EGL_NO_SURFACE,
+				 EGL_NO_SURFACE, uploader->egl_context);
+	if (!current)
+		wlb_error("Failed to make the upload context current\n");
+
+	pthread_mutex_lock(&uploader->mutex);
+	while (1) {
+		while (!uploader->quit && wl_list_empty(&uploader->job_list))
+			pthread_cond_wait(&uploader->work_cond,
+					  &uploader->mutex);
+
+		if (wl_list_empty(&uploader->job_list))
+			break;
+
+		up = wl_container_of(uploader->job_list.next, up, link);
+		wl_list_remove(&up->link);
+		pthread_mutex_unlock(&uploader->mutex);
+
+		if (current)
+			gles2_upload_run(gr, up);
+
+		pthread_mutex_lock(&uploader->mutex);
+		up->queued = 0;
+		pthread_cond_broadcast(&uploader->done_cond);
+	}
+	pthread_mutex_unlock(&uploader->mutex);
+
+	if (current)
+		eglMakeCurrent(gr->egl_display, EGL_NO_SURFACE,
+			       EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	eglReleaseThread();
+
+	return NULL;
+}
+
+/* Waits for the surface's upload, if any, and lets go of its buffer */
+static void
+gles2_upload_finish(struct gles2_surface *gs)
+{
+	struct gles2_uploader *uploader = gs->renderer->uploader;
+	struct gles2_upload *up = &gs->upload;
+
+	if (!up->buffer)
+		return;
+
+	pthread_mutex_lock(&uploader->mutex);
+	while (up->queued)
+		pthread_cond_wait(&uploader->done_cond, &uploader->mutex);
+	pthread_mutex_unlock(&uploader->mutex);
+
+	if (up->buffer_type->munmap)
+		up->buffer_type->munmap(up->buffer_type_data, up->buffer,
+					up->data);
+	wl_list_remove(&up->buffer_destroy_listener.link);
+	up->buffer = NULL;
+
+	if (up->uploaded) {
+		pixman_region32_clear(&up->stale);
+		up->pending = 1;
+	}
+}
+
+static void
+upload_buffer_destroy_handler(struct wl_listener *listener, void *data)
+{
+	struct gles2_surface *gs;
+
+	gs = wl_container_of(listener, gs, upload.buffer_destroy_listener);
+	gles2_upload_finish(gs);
+}
+
+static int
+gles2_buffer_type_can_attach(const struct wlb_buffer_type *type, size_t size)
+{
+	return type->gles2_shader &&
+	       (type->attach || WLB_BUFFER_TYPE_HAS(type, size, attach_damage));
+}
+
+static void
+attached_buffer_destroy_handler(struct wl_listener *listener, void *data)
+{
+	struct gles2_surface *gs;
+
+	gs = wl_container_of(listener, gs, attached_buffer_destroy_listener);
+	wl_list_remove(&listener->link);
+	wl_list_init(&listener->link);
+	gs->attached_buffer = NULL;
+}
+
+static void
+gles2_surface_set_attached_buffer(struct gles2_surface *gs,
+				  struct wl_resource *buffer)
+{
+	if (gs->attached_buffer == buffer)
+		return;
+
+	wl_list_remove(&gs->attached_buffer_destroy_listener.link);
+	wl_list_init(&gs->attached_buffer_destroy_listener.link);
+
+	gs->attached_buffer = buffer;
+	if (buffer)
+		wl_resource_add_destroy_listener(buffer,
+				&gs->attached_buffer_destroy_listener);
+}
+
+static void
+surface_commit_handler(struct wl_listener *listener, void *data)
+{
+	struct gles2_surface *gs;
+	struct gles2_upload *up;
+	struct gles2_uploader *uploader;
+	struct wl_resource *buffer;
+	struct wlb_rectangle *drects;
+	const struct wlb_buffer_type *type;
+	void *type_data;
+	size_t type_size;
+	int i, ndrects;
+
+	gs = wl_container_of(listener, gs, commit_listener);
+	uploader = gs->renderer->uploader;
+	up = &gs->upload;
+
+	if (!uploader)
+		return;
+
+	/* Anything uploaded but not yet shown is out of date now */
+	gles2_upload_finish(gs);
+	up->pending = 0;
+
+	buffer = wlb_surface_buffer(gs->surface);
+	if (!buffer)
+		return;
+
+	wlb_compositor_get_buffer_size(gs->renderer->compositor, buffer,
+				       &up->width, &up->height);
+	if (up->width <= 0 || up->height <= 0)
+		return;
+
+	drects = wlb_surface_get_buffer_damage(gs->surface, &ndrects);
+	if (ndrects > 0 && !drects) {
+		pixman_region32_union_rect(&up->stale, &up->stale,
+					   0, 0, up->width, up->height);
+		pixman_region32_union_rect(&up->front_stale, &up->front_stale,
+					   0, 0, up->width, up->height);
+	}
+	for (i = 0; drects && i < ndrects; ++i) {
+		pixman_region32_union_rect(&up->stale, &up->stale,
+					   drects[i].x, drects[i].y,
+					   drects[i].width, drects[i].height);
+		pixman_region32_union_rect(&up->front_stale, &up->front_stale,
+					   drects[i].x, drects[i].y,
+					   drects[i].width, drects[i].height);
+	}
+	free(drects);
+
+	pixman_region32_intersect_rect(&up->stale, &up->stale,
+				       0, 0, up->width, up->height);
+	pixman_region32_intersect_rect(&up->front_stale, &up->front_stale,
+				       0, 0, up->width, up->height);
+
+	type = wlb_compositor_get_buffer_type(gs->renderer->compositor, buffer,
+					      &type_data, &type_size);
+	if (!type || !type->mmap ||
+	    gles2_buffer_type_can_attach(type, type_size))
+		return;
+
+	/* The repaint has to allocate storage for a new size first */
+	if (!up->texture || up->storage.width != up->width ||
+	    up->storage.height != up->height)
+		return;
+
+	up->data = type->mmap(type_data, buffer, &up->stride, &up->format);
+	if (!up->data)
+		return;
+
+	if (up->format != WL_SHM_FORMAT_ARGB8888 &&
+	    up->format != WL_SHM_FORMAT_XRGB8888) {
+		if (type->munmap)
+			type->munmap(type_data, buffer, up->data);
+		return;
+	}
+
+	up->buffer = buffer;
+	up->buffer_type = type;
+	up->buffer_type_data = type_data;
+	wl_resource_add_destroy_listener(buffer, &up->buffer_destroy_listener);
+
+	pixman_region32_intersect_rect(&up->region, &up->stale,
+				       0, 0, up->width, up->height);
+	up->uploaded = 0;
+
+	pthread_mutex_lock(&uploader->mutex);
+	up->queued = 1;
+	wl_list_insert(uploader->job_list.prev, &up->link);
+	pthread_cond_signal(&uploader->work_cond);
+	pthread_mutex_unlock(&uploader->mutex);
+}
+
+static void
+gles2_surface_destroy(struct gles2_surface *surface, int cleanup_gl)
+{
+	struct wlb_gles2_renderer *gr = surface->renderer;
+
+	gles2_upload_finish(surface);
+
+	if (cleanup_gl) {
+		glDeleteTextures(WLB_BUFFER_MAX_PLANES, surface->textures);
+		glDeleteTextures(1, &surface->upload.texture);
+		if (surface->upload.fence)
+			gr->gles3.delete_sync(surface->upload.fence);
+		if (surface->upload.read_fence)
+			gr->gles3.delete_sync(surface->upload.read_fence);
+	}
+
+	pixman_region32_fini(&surface->upload.region);
+	pixman_region32_fini(&surface->upload.stale);
+	pixman_region32_fini(&surface->upload.front_stale);
+
+	wl_list_remove(&surface->link);
+	wl_list_remove(&surface->destroy_listener.link);
+	wl_list_remove(&surface->commit_listener.link);
+	wl_list_remove(&surface->attached_buffer_destroy_listener.link);
+
+	free(surface);
+}
+
+static void
+surface_destroy_handler(struct wl_listener *listener, void *data)
+{
+	struct gles2_surface *gs;
+	
+	gs = wl_container_of(listener, gs, destroy_listener);
+
+	/* The surface is going away, so make sure the upload is done with
+	 * it now rather than at cleanup */
+	gles2_upload_finish(gs);
+	wl_list_remove(&gs->commit_listener.link);
+	wl_list_init(&gs->commit_listener.link);
+
+	wl_list_remove(&gs->link);
+	wl_list_insert(&gs->renderer->surface_cleanup_list, &gs->link);
+}
+
+static struct gles2_surface *
+gles2_surface_get(struct wlb_gles2_renderer *gr, struct wlb_surface *surface)
+{
+	struct gles2_surface *gs;
+	struct wl_listener *listener;
+
+	listener = wlb_surface_get_destroy_listener(surface,
+						    surface_destroy_handler);
+	if (listener) {
+		gs = wl_container_of(listener, gs, destroy_listener);
+		return gs;
+	}
+
+	gs = zalloc(sizeof *gs);
+	if (!gs)
+		return NULL;
+
+	gs->renderer = gr;
+	gs->surface = surface;
+	gs->destroy_listener.notify = surface_destroy_handler;
+	wlb_surface_add_destroy_listener(surface, &gs->destroy_listener);
+	wl_list_insert(&gr->surface_list, &gs->link);
+
+	pixman_region32_init(&gs->upload.region);
+	pixman_region32_init(&gs->upload.stale);
+	pixman_region32_init(&gs->upload.front_stale);
+	gs->upload.buffer_destroy_listener.notify =
+		upload_buffer_destroy_handler;
+	gs->attached_buffer_destroy_listener.notify =
+		attached_buffer_destroy_handler;
+	wl_list_init(&gs->attached_buffer_destroy_listener.link);
+
+	/* Does nothing unless uploads are asynchronous */
+	gs->commit_listener.notify = surface_commit_handler;
+	wl_signal_add(&surface->commit_signal, &gs->commit_listener);
+
+	return gs;
+}
+
+static void
+gles2_surface_ensure_textures(struct gles2_surface *gs, int num_textures)
+{
+	int i;
+
+	if (num_textures < 0)
+		num_textures = 0;
+
+	for (i = 0; i < num_textures && i < WLB_BUFFER_MAX_PLANES; ++i)
+		if (gs->textures[i] == 0)
+			gles2_texture_create(&gs->textures[i]);
+
 	for (i = num_textures; i < WLB_BUFFER_MAX_PLANES; ++i) {
 		glDeleteTextures(1, &gs->textures[i]);
+		gs->textures[i] = 0;
+	}
+}
+
+static int
+gles2_surface_set_shm_shader(struct wlb_gles2_renderer *gr,
+			     struct gles2_surface *gs, uint32_t format)
+{
+	struct gles2_shader *shader;
+
+	gs->shader = gles2_shader_get_for_shm_format(gr, format);
+	if (!gs->shader)
+		return -1;
+
+	/* Nothing reads the alpha of an opaque target, so XRGB can use
+	 * the ARGB program there and skip forcing it */
+	gs->opaque_shader = gs->shader;
+	if (format == WL_SHM_FORMAT_XRGB8888) {
+		shader = gles2_shader_get_for_shm_format(gr,
+							 WL_SHM_FORMAT_ARGB8888);
+		if (shader)
+			gs->opaque_shader = shader;
 	}
+
+	return 0;
+}
+
+static int
+gles2_surface_update_shm(struct wlb_gles2_renderer *gr,
+			 struct gles2_surface *gs, int full_damage)
+{
+	struct wlb_rectangle *drects;
+	pixman_region32_t region;
+	uint32_t format, stride;
+	GLenum tex_format;
+	void *pixel_data;
+	int i, ndrects, err = 0;
+
+	drects = NULL;
+	ndrects = 0;
+	if (!full_damage) {
+		drects = wlb_surface_get_buffer_damage(gs->surface, &ndrects);
+
+		if (ndrects > 0 && !drects)
+			/* Failed to get damage, but we can still try and
+			 * upload the entire thing */
+			full_damage = 1;
+		else if (ndrects == 0 &&
+			 !pixman_region32_not_empty(&gs->upload.front_stale))
+			return 0;
+	}
+
+	pixel_data = gs->buffer_type->mmap(gs->buffer_type_data, gs->buffer,
+					   &stride, &format);
+	if (!pixel_data) {
+		wlb_error("Failed to map buffer");
+		err = 1;
+		goto err_damage;
+	}
+
+	if (gles2_surface_set_shm_shader(gr, gs, format) < 0) {
+		wlb_error("Failed to find shader");
+		err = 1;
+		goto err_mmap;
+	}
+
+	glActiveTexture(GL_TEXTURE0);
+
+	tex_format = gles2_shm_texture_format(gr);
+	if (gles2_texture_ensure_storage(gr, &gs->textures[0], &gs->tex_storage,
+					 tex_format, gs->bwidth, gs->bheight))
+		full_damage = 1;
+
+	if (full_damage) {
+		pixman_region32_init_rect(&region, 0, 0,
+					  gs->bwidth, gs->bheight);
+	} else {
+		/* Also bring back anything the upload thread got to first */
+		pixman_region32_init(&region);
+		pixman_region32_copy(&region, &gs->upload.front_stale);
+		for (i = 0; i < ndrects; ++i)
+			pixman_region32_union_rect(&region, &region,
+						   drects[i].x, drects[i].y,
+						   drects[i].width,
+						   drects[i].height);
+		pixman_region32_intersect_rect(&region, &region, 0, 0,
+					       gs->bwidth, gs->bheight);
+	}
+
+	gles2_upload_region(gr, &gr->staging, TRUE, gs->bwidth, tex_format,
+			    pixel_data, stride, &region);
+	pixman_region32_fini(&region);
+	pixman_region32_clear(&gs->upload.front_stale);
+
+err_mmap:
+	if (gs->buffer_type->munmap)
+		gs->buffer_type->munmap(gs->buffer_type_data, gs->buffer,
+					pixel_data);
+err_damage:
+	free(drects);
+
+	return err ? -1 : 0;
+}
+
+/* Picks up the texture uploaded for the latest commit, if there is one */
+static int
+gles2_surface_take_upload(struct wlb_gles2_renderer *gr,
+			  struct gles2_surface *gs)
+{
+	struct gles2_upload *up = &gs->upload;
+	struct gles2_texture_storage storage;
+	pixman_region32_t stale;
+	GLuint texture;
+
+	if (!gr->uploader)
+		return 0;
+
+	gles2_upload_finish(gs);
+	if (!up->pending)
+		return 0;
+
+	if (gles2_surface_set_shm_shader(gr, gs, up->format) < 0)
+		return 0;
+
+	up->pending = 0;
+
+	/* Make the GPU, not us, wait for the upload */
+	gr->gles3.wait_sync(up->fence, 0, GL_TIMEOUT_IGNORED);
+
+	texture = gs->textures[0];
+	gs->textures[0] = up->texture;
+	up->texture = texture;
+
+	storage = gs->tex_storage;
+	gs->tex_storage = up->storage;
+	up->storage = storage;
+
+	stale = up->front_stale;
+	up->front_stale = up->stale;
+	up->stale = stale;
+
+	return 1;
+}
+
+/* Gets the upload texture ready for the next commit.  Its storage is
+ * only ever allocated here and, once it may have been sampled, the upload
+ * thread has to wait for the draws to finish before writing to it. */
+static void
+gles2_surface_prepare_upload(struct wlb_gles2_renderer *gr,
+			     struct gles2_surface *gs, int swapped)
+{
+	struct gles2_upload *up = &gs->upload;
+
+	if (gles2_texture_ensure_storage(gr, &up->texture, &up->storage,
+					 gles2_shm_texture_format(gr),
+					 gs->bwidth, gs->bheight)) {
+		pixman_region32_fini(&up->stale);
+		pixman_region32_init_rect(&up->stale, 0, 0,
+					  gs->bwidth, gs->bheight);
+		swapped = 1;
+	}
+
+	if (!swapped)
+		return;
+
+	if (up->read_fence)
+		gr->gles3.delete_sync(up->read_fence);
+	up->read_fence = gr->gles3.fence_sync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	glFlush();
+}
+
+static void
+gles2_surface_attach(struct gles2_surface *gs, int full_damage)
+{
+	const struct wlb_buffer_type *type = gs->buffer_type;
+	struct wlb_rectangle *drects, whole;
+	int ndrects, unchanged;
+
+	if (!WLB_BUFFER_TYPE_HAS(type, gs->buffer_type_size, attach_damage)) {
+		type->attach(gs->buffer_type_data, gs->buffer,
+			     gs->shader->program, gs->textures);
+		gles2_surface_set_attached_buffer(gs, gs->buffer);
+		return;
+	}
+
+	drects = NULL;
+	ndrects = 0;
+	if (!full_damage) {
+		drects = wlb_surface_get_buffer_damage(gs->surface, &ndrects);
+		if (ndrects > 0 && !drects)
+			full_damage = 1;
+	}
+
+	if (full_damage) {
+		whole.x = 0;
+		whole.y = 0;
+		whole.width = gs->bwidth;
+		whole.height = gs->bheight;
+	}
+
+	unchanged = !full_damage && ndrects == 0 &&
+		    gs->attached_buffer == gs->buffer;
+
+	type->attach_damage(gs->buffer_type_data, gs->buffer,
+			    gs->shader->program, gs->textures,
+			    full_damage ? &whole : drects,
+			    full_damage ? 1 : ndrects, unchanged);
+	gles2_surface_set_attached_buffer(gs, gs->buffer);
+
+	free(drects);
 }
 
 static int
 gles2_surface_prepare(struct wlb_gles2_renderer *gr, struct gles2_surface *gs)
 {
 	int32_t bwidth, bheight;
-	int full_damage = 0;
+	int full_damage = 0, taken;
 
 	gs->buffer = wlb_surface_buffer(gs->surface);
 	gs->buffer_type =
@@ -536,8 +1792,8 @@ gles2_surface_prepare(struct wlb_gles2_renderer *gr, struct gles2_surface *gs)
 		return -1;
 	}
 
-	gs->buffer_type->get_size(gs->buffer_type_data, gs->buffer,
-				  &bwidth, &bheight);
+	wlb_compositor_get_buffer_size(gr->compositor, gs->buffer,
+				       &bwidth, &bheight);
 
 	if (bwidth < 0 || bheight < 0) {
 		gs->bwidth = 0;
@@ -550,48 +1806,426 @@ gles2_surface_prepare(struct wlb_gles2_renderer *gr, struct gles2_surface *gs)
 		full_damage = 1;
 	}
 
-	if (gs->buffer_type->gles2_shader && gs->buffer_type->attach) {
-		gs->bpitch = gs->bwidth;
+	if (gles2_buffer_type_can_attach(gs->buffer_type,
+					 gs->buffer_type_size)) {
+		/* The textures only hold what the same type attached from
+		 * a previous buffer, if anything */
+		if (gs->shader_type != gs->buffer_type || !gs->attached_buffer)
+			full_damage = 1;
+
+		/* The buffer type owns the texture contents now */
+		gs->tex_storage.format = 0;
 		gles2_surface_ensure_textures(gs, gs->buffer_type->num_planes);
-		gs->shader =
-			gles2_shader_get_for_buffer_type(gr, gs->buffer_type,
-							 gs->buffer_type_data);
+		if (!gs->shader || gs->shader_type != gs->buffer_type) {
+			gs->shader =
+				gles2_shader_get_for_buffer_type(gr,
+								 gs->buffer_type,
+								 gs->buffer_type_data);
+			gs->opaque_shader = gs->shader;
+			gs->shader_type = gs->buffer_type;
+		}
+		if (!gs->shader)
+			return -1;
 		glUseProgram(gs->shader->program);
-		gs->buffer_type->attach(gs->buffer_type_data, gs->buffer,
-					gs->shader->program, gs->textures);
+		gles2_timer_begin(gr, GLES2_TIMER_ATTACH);
+		gles2_surface_attach(gs, full_damage);
+		gles2_timer_end(gr);
 	} else if (gs->buffer_type->mmap) {
-		if (gs->textures[0] == 0)
-			full_damage = 1;
-
-		gles2_surface_ensure_textures(gs, 1);
-		if (gles2_surface_update_shm(gr, gs, full_damage) < 0)
+		/* The SHM program is picked on upload */
+		gs->shader_type = NULL;
+		gles2_surface_set_attached_buffer(gs, NULL);
+		gles2_timer_begin(gr, GLES2_TIMER_UPLOAD);
+		taken = gles2_surface_take_upload(gr, gs);
+		if (!taken &&
+		    gles2_surface_update_shm(gr, gs, full_damage) < 0) {
+			gles2_timer_end(gr);
 			return -1;
+		}
+		if (gr->uploader)
+			gles2_surface_prepare_upload(gr, gs, taken);
+		gles2_timer_end(gr);
 	} else {
 		wlb_error("Buffer type is not CPU-mappable and does not proivde a GLES2 attach mechanism");
 		return -1;
 	}
 
-	wlb_surface_reset_damage(gs->surface);
+	wlb_surface_reset_damage(gs->surface);
+
+	return 0;
+}
+
+static void
+gles2_surface_finish(struct wlb_gles2_renderer *gr, struct gles2_surface *gs)
+{
+	if (gs->buffer_type->detach)
+		gs->buffer_type->detach(gs->buffer_type_data, gs->buffer);
+}
+
+static void
+gles2_read_request_destroy(struct gles2_read_request *req)
+{
+	pixman_region32_fini(&req->region);
+	wl_list_remove(&req->link);
+	free(req);
+}
+
+/* Copies the boxes of the request, packed bottom row first as read by
+ * glReadPixels, into the caller's memory */
+static void
+gles2_read_request_copy(struct gles2_read_request *req, const uint8_t *pixels)
+{
+	pixman_box32_t *boxes;
+	const uint8_t *src;
+	uint8_t *dest;
+	int32_t width, x, y;
+	int i, nboxes;
+
+	src = pixels;
+	boxes = pixman_region32_rectangles(&req->region, &nboxes);
+	for (i = 0; i < nboxes; ++i) {
+		width = boxes[i].x2 - boxes[i].x1;
+
+		for (y = boxes[i].y2 - 1; y >= boxes[i].y1; --y) {
+			dest = (uint8_t *)req->dest + y * req->stride +
+			       boxes[i].x1 * 4;
+
+			if (req->format == GL_BGRA_EXT) {
+				memcpy(dest, src, width * 4);
+			} else {
+				for (x = 0; x < width; ++x) {
+					dest[x * 4 + 0] = src[x * 4 + 2];
+					dest[x * 4 + 1] = src[x * 4 + 1];
+					dest[x * 4 + 2] = src[x * 4 + 0];
+					dest[x * 4 + 3] = src[x * 4 + 3];
+				}
+			}
+
+			src += width * 4;
+		}
+	}
+}
+
+/* Reports finished reads.  This is always called straight from the event
+ * loop so that callbacks never run in the middle of a repaint. */
+static void
+gles2_renderer_dispatch_reads(void *data)
+{
+	struct wlb_gles2_renderer *gr = data;
+	struct gles2_read_request *req, *rnext;
+	struct wl_list done;
+
+	gr->read_idle = NULL;
+
+	/* A callback may destroy the renderer, so take the finished reads
+	 * off its list first */
+	wl_list_init(&done);
+	wl_list_for_each_safe(req, rnext, &gr->read_list, link) {
+		if (!req->done)
+			continue;
+
+		wl_list_remove(&req->link);
+		wl_list_insert(done.prev, &req->link);
+	}
+
+	wl_list_for_each_safe(req, rnext, &done, link) {
+		req->callback(req->data, req->status);
+		gles2_read_request_destroy(req);
+	}
+}
+
+static void
+gles2_renderer_schedule_dispatch(struct wlb_gles2_renderer *gr)
+{
+	struct wl_event_loop *loop;
+
+	if (gr->read_idle)
+		return;
+
+	loop = wl_display_get_event_loop(gr->compositor->display);
+	gr->read_idle = wl_event_loop_add_idle(loop,
+					       gles2_renderer_dispatch_reads,
+					       gr);
+}
+
+/* Copies the pixels out of the request's pixel buffer.  Mapping waits
+ * for glReadPixels if the GPU is not done with it yet. */
+static void
+gles2_read_request_finish(struct wlb_gles2_renderer *gr,
+			  struct gles2_read_request *req)
+{
+	void *pixels;
+
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, req->pbo);
+	pixels = gr->gles3.map_buffer_range(GL_PIXEL_PACK_BUFFER, 0,
+					    req->size, GL_MAP_READ_BIT);
+	if (pixels) {
+		gles2_read_request_copy(req, pixels);
+		gr->gles3.unmap_buffer(GL_PIXEL_PACK_BUFFER);
+		req->status = 0;
+	} else {
+		req->status = -1;
+	}
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	glDeleteBuffers(1, &req->pbo);
+	if (req->fence)
+		gr->gles3.delete_sync(req->fence);
+	req->pbo = 0;
+	req->fence = NULL;
+	req->done = 1;
+}
+
+/* Finishes any reads the GPU is done with.  Needs one of our contexts. */
+static void
+gles2_renderer_poll_reads(struct wlb_gles2_renderer *gr)
+{
+	struct gles2_read_request *req;
+	GLenum result;
+	int finished = 0;
+
+	wl_list_for_each(req, &gr->read_list, link) {
+		if (req->done)
+			continue;
+
+		result = gr->gles3.client_wait_sync(req->fence, 0, 0);
+		if (result != GL_ALREADY_SIGNALED &&
+		    result != GL_CONDITION_SATISFIED)
+			continue;
+
+		gles2_read_request_finish(gr, req);
+		finished = 1;
+	}
+
+	if (finished)
+		gles2_renderer_schedule_dispatch(gr);
+}
+
+static int
+gles2_renderer_reads_in_flight(struct wlb_gles2_renderer *gr)
+{
+	struct gles2_read_request *req;
+
+	wl_list_for_each(req, &gr->read_list, link)
+		if (!req->done)
+			return 1;
+
+	return 0;
+}
+
+static int
+gles2_renderer_read_timer(void *data)
+{
+	struct wlb_gles2_renderer *gr = data;
+	EGLDisplay display;
+	EGLContext context;
+	EGLSurface draw, read;
+
+	display = eglGetCurrentDisplay();
+	context = eglGetCurrentContext();
+	draw = eglGetCurrentSurface(EGL_DRAW);
+	read = eglGetCurrentSurface(EGL_READ);
+
+	if (eglMakeCurrent(gr->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+			   gr->egl_context)) {
+		gles2_renderer_poll_reads(gr);
+
+		if (context == EGL_NO_CONTEXT)
+			eglMakeCurrent(gr->egl_display, EGL_NO_SURFACE,
+				       EGL_NO_SURFACE, EGL_NO_CONTEXT);
+		else
+			eglMakeCurrent(display, draw, read, context);
+	}
+
+	if (gles2_renderer_reads_in_flight(gr))
+		wl_event_source_timer_update(gr->read_timer, 1);
+
+	return 1;
+}
+
+/* Starts the reads queued on the output.  Called at the end of a repaint
+ * with the output's framebuffer still bound.  With OpenGL ES 3.0 and a
+ * context we can make current on our own, the pixels are read into a
+ * pixel buffer and picked up once a fence says they are there.
+ * Otherwise they are read straight away. */
+static void
+gles2_output_start_reads(struct wlb_gles2_renderer *gr,
+			 struct gles2_output *go, struct wlb_output *output)
+{
+	struct gles2_read_request *req, *rnext;
+	struct wl_event_loop *loop;
+	pixman_box32_t *boxes;
+	GLsizeiptr size, offset;
+	uint8_t *pixels;
+	int32_t height;
+	int async, i, nboxes;
+
+	async = gr->has_gles3 && gr->has_surfaceless &&
+		gr->egl_context != EGL_NO_CONTEXT;
+	height = output->current_mode->height;
+
+	wl_list_for_each_safe(req, rnext, &go->read_queue, link) {
+		wl_list_remove(&req->link);
+		wl_list_insert(gr->read_list.prev, &req->link);
+
+		pixman_region32_intersect_rect(&req->region, &req->region,
+					       0, 0,
+					       output->current_mode->width,
+					       height);
+		req->format = gr->has_read_bgra ? GL_BGRA_EXT : GL_RGBA;
+
+		boxes = pixman_region32_rectangles(&req->region, &nboxes);
+		size = 0;
+		for (i = 0; i < nboxes; ++i)
+			size += (GLsizeiptr)(boxes[i].x2 - boxes[i].x1) *
+				(boxes[i].y2 - boxes[i].y1) * 4;
+
+		if (size == 0) {
+			req->done = 1;
+			continue;
+		}
+
+		pixels = NULL;
+		if (async) {
+			glGenBuffers(1, &req->pbo);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, req->pbo);
+			glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL,
+				     GL_STREAM_READ);
+		} else {
+			pixels = malloc(size);
+			if (!pixels) {
+				req->status = -1;
+				req->done = 1;
+				continue;
+			}
+		}
+
+		offset = 0;
+		for (i = 0; i < nboxes; ++i) {
+			glReadPixels(boxes[i].x1, height - boxes[i].y2,
+				     boxes[i].x2 - boxes[i].x1,
+				     boxes[i].y2 - boxes[i].y1,
+				     req->format, GL_UNSIGNED_BYTE,
+				     async ? (void *)(uintptr_t)offset :
+					     pixels + offset);
+			offset += (GLsizeiptr)(boxes[i].x2 - boxes[i].x1) *
+				  (boxes[i].y2 - boxes[i].y1) * 4;
+		}
+
+		if (async) {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			req->fence = gr->gles3.fence_sync(
+				GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			req->size = size;
+
+			/* Nothing to poll, so wait for it here */
+			if (!req->fence)
+				gles2_read_request_finish(gr, req);
+			continue;
+		}
+
+		gles2_read_request_copy(req, pixels);
+		free(pixels);
+		req->done = 1;
+	}
+
+	if (gles2_renderer_reads_in_flight(gr)) {
+		glFlush();
+
+		if (!gr->read_timer) {
+			loop = wl_display_get_event_loop(gr->compositor->display);
+			gr->read_timer =
+				wl_event_loop_add_timer(loop,
+							gles2_renderer_read_timer,
+							gr);
+		}
+		if (gr->read_timer)
+			wl_event_source_timer_update(gr->read_timer, 1);
+	}
+
+	gles2_renderer_schedule_dispatch(gr);
+}
 
-	return 0;
+/* We may not be in the right context when an output goes away, so GL
+ * objects are only deleted on the next repaint */
+static void
+gles2_renderer_defer_delete(struct wl_array *dead, GLuint name)
+{
+	GLuint *p;
+
+	if (!name)
+		return;
+
+	p = wl_array_add(dead, sizeof *p);
+	if (p)
+		*p = name;
 }
 
 static void
-gles2_surface_finish(struct wlb_gles2_renderer *gr, struct gles2_surface *gs)
+gles2_renderer_delete_dead_objects(struct wlb_gles2_renderer *gr)
 {
-	if (gs->buffer_type->detach)
-		gs->buffer_type->detach(gs->buffer_type_data, gs->buffer);
+	glDeleteBuffers(gr->dead_buffers.size / sizeof(GLuint),
+			gr->dead_buffers.data);
+	glDeleteFramebuffers(gr->dead_framebuffers.size / sizeof(GLuint),
+			     gr->dead_framebuffers.data);
+	glDeleteTextures(gr->dead_textures.size / sizeof(GLuint),
+			 gr->dead_textures.data);
+	if (gr->timer.delete_queries)
+		gr->timer.delete_queries(gr->dead_queries.size /
+					 sizeof(GLuint),
+					 gr->dead_queries.data);
+
+	gr->dead_buffers.size = 0;
+	gr->dead_framebuffers.size = 0;
+	gr->dead_textures.size = 0;
+	gr->dead_queries.size = 0;
+}
+
+/* Drops whatever the output was rendering into */
+static void
+gles2_output_release_target(struct gles2_output *go)
+{
+	struct wlb_gles2_renderer *gr = go->renderer;
+
+	if (go->egl_surface != EGL_NO_SURFACE)
+		eglDestroySurface(gr->egl_display, go->egl_surface);
+	go->egl_surface = EGL_NO_SURFACE;
+
+	gles2_renderer_defer_delete(&gr->dead_framebuffers, go->fbo);
+	gles2_renderer_defer_delete(&gr->dead_textures, go->fbo_texture);
+	go->fbo = 0;
+	go->fbo_texture = 0;
+
+	go->target_width = 0;
+	go->target_height = 0;
+	go->target_valid = 0;
 }
 
 static void
 gles2_output_destroy(struct gles2_output *output)
 {
-	if (output->egl_surface != EGL_NO_SURFACE)
-		eglDestroySurface(output->renderer->egl_display,
-				  output->egl_surface);
+	struct gles2_read_request *req, *rnext;
+	int i, j;
+
+	/* These were never read, so there is nothing to clean up in GL */
+	wl_list_for_each_safe(req, rnext, &output->read_queue, link) {
+		req->callback(req->data, -1);
+		gles2_read_request_destroy(req);
+	}
+
+	gles2_output_release_target(output);
+	gles2_renderer_defer_delete(&output->renderer->dead_buffers,
+				    output->vbo);
+	for (i = 0; i < GLES2_TIMER_FRAMES; ++i)
+		for (j = 0; j < GLES2_TIMER_COUNT; ++j)
+			gles2_renderer_defer_delete(&output->renderer->dead_queries,
+						    output->timer_frames[i].queries[j]);
+
+	for (i = 0; i < GLES2_DAMAGE_HISTORY; ++i)
+		pixman_region32_fini(&output->damage_history[i]);
 
 	wl_list_remove(&output->link);
 	wl_list_remove(&output->destroy_listener.link);
+	wl_list_remove(&output->geometry_listener.link);
 
 	free(output);
 }
@@ -605,17 +2239,37 @@ output_destroy_handler(struct wl_listener *listener, void *data)
 	gles2_output_destroy(go);
 }
 
+static void
+output_geometry_changed_handler(struct wl_listener *listener, void *data)
+{
+	struct gles2_output *go;
+
+	go = wl_container_of(listener, go, geometry_listener);
+	go->output_mat_valid = 0;
+}
+
 static struct gles2_output *
 gles2_output_create(struct wlb_gles2_renderer *gr, struct wlb_output *output)
 {
 	struct gles2_output *go;
+	int i;
 
 	go = zalloc(sizeof *go);
 	if (!go)
 		return NULL;
 
+	for (i = 0; i < GLES2_DAMAGE_HISTORY; ++i)
+		pixman_region32_init(&go->damage_history[i]);
+
 	go->destroy_listener.notify = output_destroy_handler;
 	wl_signal_add(&output->destroy_signal, &go->destroy_listener);
+	go->geometry_listener.notify = output_geometry_changed_handler;
+	wl_signal_add(&output->geometry_changed_signal,
+		      &go->geometry_listener);
+
+	wl_list_init(&go->read_queue);
+
+	go->egl_surface = EGL_NO_SURFACE;
 
 	go->renderer = gr;
 	wl_list_insert(&gr->output_list, &go->link);
@@ -669,6 +2323,383 @@ egl_error(const char *msg)
 	wlb_error("%s: %s\n", msg, err);
 }
 
+static void
+wlb_gles2_renderer_initialize_surfaceless(struct wlb_gles2_renderer *gr);
+
+static void
+gles2_renderer_prewarm_shaders(struct wlb_gles2_renderer *gr)
+{
+	struct wlb_buffer_type_item *item;
+
+	gles2_shader_get_solid(gr);
+	gles2_shader_get_for_shm_format(gr, WL_SHM_FORMAT_ARGB8888);
+	gles2_shader_get_for_shm_format(gr, WL_SHM_FORMAT_XRGB8888);
+
+	wl_list_for_each(item, &gr->compositor->buffer_type_list, link)
+		if (gles2_buffer_type_can_attach(item->type, item->type_size))
+			gles2_shader_get_for_buffer_type(gr, item->type,
+							 item->type_data);
+}
+
+static struct gles2_uploader *
+gles2_uploader_create(struct wlb_gles2_renderer *gr)
+{
+	struct gles2_uploader *uploader;
+
+	static const EGLint context_attribs[] = {
+		EGL_CONTEXT_CLIENT_VERSION, 2,
+		EGL_NONE
+	};
+
+	uploader = zalloc(sizeof *uploader);
+	if (!uploader)
+		return NULL;
+
+	uploader->renderer = gr;
+	wl_list_init(&uploader->job_list);
+
+	uploader->egl_context = eglCreateContext(gr->egl_display,
+						 gr->egl_config,
+						 gr->egl_context,
+						 context_attribs);
+	if (uploader->egl_context == EGL_NO_CONTEXT) {
+		egl_error("Failed to create the upload context");
+		free(uploader);
+		return NULL;
+	}
+
+	pthread_mutex_init(&uploader->mutex, NULL);
+	pthread_cond_init(&uploader->work_cond, NULL);
+	pthread_cond_init(&uploader->done_cond, NULL);
+
+	if (pthread_create(&uploader->thread, NULL,
+			   gles2_uploader_thread, uploader) != 0) {
+		wlb_error("Failed to start the upload thread\n");
+		pthread_cond_destroy(&uploader->done_cond);
+		pthread_cond_destroy(&uploader->work_cond);
+		pthread_mutex_destroy(&uploader->mutex);
+		eglDestroyContext(gr->egl_display, uploader->egl_context);
+		free(uploader);
+		return NULL;
+	}
+
+	return uploader;
+}
+
+static void
+gles2_uploader_destroy(struct gles2_uploader *uploader)
+{
+	pthread_mutex_lock(&uploader->mutex);
+	uploader->quit = 1;
+	pthread_cond_broadcast(&uploader->work_cond);
+	pthread_mutex_unlock(&uploader->mutex);
+
+	pthread_join(uploader->thread, NULL);
+
+	pthread_cond_destroy(&uploader->done_cond);
+	pthread_cond_destroy(&uploader->work_cond);
+	pthread_mutex_destroy(&uploader->mutex);
+
+	eglDestroyContext(uploader->renderer->egl_display,
+			  uploader->egl_context);
+	wl_array_release(&uploader->staging);
+	free(uploader);
+}
+
+static void
+gles2_dmabuf_image_destroy(struct gles2_dmabuf_image *di)
+{
+	struct wlb_gles2_renderer *gr = di->renderer;
+
+	if (di->image)
+		gr->dmabuf.destroy_image(gr->dmabuf_display, di->image);
+
+	wl_list_remove(&di->destroy_listener.link);
+	wl_list_remove(&di->link);
+	free(di);
+}
+
+static void
+dmabuf_buffer_destroy_handler(struct wl_listener *listener, void *data)
+{
+	struct gles2_dmabuf_image *di;
+
+	di = wl_container_of(listener, di, destroy_listener);
+	gles2_dmabuf_image_destroy(di);
+}
+
+static void *
+gles2_dmabuf_import(struct wlb_gles2_renderer *gr,
+		    struct wlb_dmabuf_buffer *buffer)
+{
+	static const EGLint plane_attribs[WLB_DMABUF_MAX_PLANES][5] = {
+		{
+			EGL_DMA_BUF_PLANE0_FD_EXT,
+			EGL_DMA_BUF_PLANE0_OFFSET_EXT,
+			EGL_DMA_BUF_PLANE0_PITCH_EXT,
+			EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT,
+			EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT
+		}, {
+			EGL_DMA_BUF_PLANE1_FD_EXT,
+			EGL_DMA_BUF_PLANE1_OFFSET_EXT,
+			EGL_DMA_BUF_PLANE1_PITCH_EXT,
+			EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT,
+			EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT
+		}, {
+			EGL_DMA_BUF_PLANE2_FD_EXT,
+			EGL_DMA_BUF_PLANE2_OFFSET_EXT,
+			EGL_DMA_BUF_PLANE2_PITCH_EXT,
+			EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT,
+			EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT
+		}, {
+			EGL_DMA_BUF_PLANE3_FD_EXT,
+			EGL_DMA_BUF_PLANE3_OFFSET_EXT,
+			EGL_DMA_BUF_PLANE3_PITCH_EXT,
+			EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT,
+			EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT
+		}
+	};
+	EGLint attribs[7 + WLB_DMABUF_MAX_PLANES * 10];
+	struct wlb_dmabuf_plane *plane;
+	int i, n = 0;
+
+	/* A fourth plane needs the modifiers extension */
+	if (buffer->num_planes > 3 && !gr->has_dmabuf_modifiers)
+		return NULL;
+
+	attribs[n++] = EGL_WIDTH;
+	attribs[n++] = buffer->width;
+	attribs[n++] = EGL_HEIGHT;
+	attribs[n++] = buffer->height;
+	attribs[n++] = EGL_LINUX_DRM_FOURCC_EXT;
+	attribs[n++] = buffer->format;
+
+	for (i = 0; i < buffer->num_planes; ++i) {
+		plane = &buffer->planes[i];
+
+		attribs[n++] = plane_attribs[i][0];
+		attribs[n++] = plane->fd;
+		attribs[n++] = plane_attribs[i][1];
+		attribs[n++] = plane->offset;
+		attribs[n++] = plane_attribs[i][2];
+		attribs[n++] = plane->stride;
+
+		if (gr->has_dmabuf_modifiers &&
+		    plane->modifier != WLB_DRM_FORMAT_MOD_INVALID) {
+			attribs[n++] = plane_attribs[i][3];
+			attribs[n++] = plane->modifier & 0xffffffff;
+			attribs[n++] = plane_attribs[i][4];
+			attribs[n++] = plane->modifier >> 32;
+		}
+	}
+	attribs[n++] = EGL_NONE;
+
+	return gr->dmabuf.create_image(gr->dmabuf_display, EGL_NO_CONTEXT,
+				       EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+}
+
+static struct gles2_dmabuf_image *
+gles2_dmabuf_image_get(struct wlb_gles2_renderer *gr,
+		       struct wl_resource *resource)
+{
+	struct gles2_dmabuf_image *di;
+	struct wlb_dmabuf_buffer *buffer;
+	struct wl_listener *listener;
+
+	listener = wl_resource_get_destroy_listener(resource,
+					dmabuf_buffer_destroy_handler);
+	if (listener)
+		return wl_container_of(listener, di, destroy_listener);
+
+	buffer = wlb_dmabuf_buffer_get(resource);
+	if (!buffer)
+		return NULL;
+
+	di = zalloc(sizeof *di);
+	if (!di)
+		return NULL;
+
+	di->renderer = gr;
+	di->image = gles2_dmabuf_import(gr, buffer);
+	if (!di->image)
+		wlb_debug("Failed to import dmabuf, falling back to mmap\n");
+
+	di->destroy_listener.notify = dmabuf_buffer_destroy_handler;
+	wl_resource_add_destroy_listener(resource, &di->destroy_listener);
+	wl_list_insert(&gr->dmabuf_image_list, &di->link);
+
+	return di;
+}
+
+static int
+dmabuf_is_type(void *data, struct wl_resource *buffer)
+{
+	struct gles2_dmabuf_image *di;
+
+	di = gles2_dmabuf_image_get(data, buffer);
+	return di && di->image;
+}
+
+static void
+dmabuf_get_size(void *data, struct wl_resource *resource,
+		int32_t *width, int32_t *height)
+{
+	struct wlb_dmabuf_buffer *buffer = wlb_dmabuf_buffer_get(resource);
+
+	*width = buffer->width;
+	*height = buffer->height;
+}
+
+static void *
+dmabuf_mmap(void *data, struct wl_resource *resource,
+	    uint32_t *stride, uint32_t *format)
+{
+	return wlb_dmabuf_buffer_mmap(wlb_dmabuf_buffer_get(resource),
+				      stride, format);
+}
+
+static void
+dmabuf_munmap(void *data, struct wl_resource *resource, void *mapped)
+{
+	wlb_dmabuf_buffer_munmap(wlb_dmabuf_buffer_get(resource));
+}
+
+static void
+dmabuf_program_linked(void *data, GLuint program)
+{
+	struct wlb_gles2_renderer *gr = data;
+
+	gr->dmabuf_tex_uniform = glGetUniformLocation(program, "tex");
+}
+
+static void
+dmabuf_attach(void *data, struct wl_resource *resource,
+	      GLuint program, GLuint textures[])
+{
+	struct wlb_gles2_renderer *gr = data;
+	struct gles2_dmabuf_image *di;
+
+	di = gles2_dmabuf_image_get(gr, resource);
+	if (!di || !di->image)
+		return;
+
+	glUniform1i(gr->dmabuf_tex_uniform, 0);
+	glActiveTexture(GL_TEXTURE0);
+	glBindTexture(GL_TEXTURE_EXTERNAL_OES, textures[0]);
+	gr->dmabuf.image_target_texture_2d(GL_TEXTURE_EXTERNAL_OES, di->image);
+}
+
+/* Imported dmabufs are sampled as external images so that the driver
+ * takes care of any format conversion */
+static const struct wlb_buffer_type gles2_dmabuf_buffer_type = {
+	dmabuf_is_type, dmabuf_get_size,
+	dmabuf_mmap, dmabuf_munmap,
+"#extension GL_OES_EGL_image_external : require\n"
+"uniform samplerExternalOES tex;\n"
+"lowp vec4 wlb_get_fragment_color(mediump vec2 coords)\n"
+"{\n"
+"	return texture2D(tex, coords);\n"
+"}\n", 1,
+	dmabuf_program_linked, dmabuf_attach, NULL
+};
+
+static void
+gles2_renderer_advertise_dmabuf_formats(struct wlb_gles2_renderer *gr)
+{
+	static const uint32_t fallback_formats[] = {
+		WLB_DRM_FORMAT_ARGB8888,
+		WLB_DRM_FORMAT_XRGB8888,
+		WLB_DRM_FORMAT_ABGR8888,
+		WLB_DRM_FORMAT_XBGR8888,
+	};
+	EGLint *formats = NULL;
+	uint64_t *modifiers = NULL;
+	EGLint i, j, num_formats = 0, num_modifiers;
+	size_t f;
+
+	/* Without the modifiers extension all we know is that the driver
+	 * can take buffers in its own implicit layout */
+	if (!gr->has_dmabuf_modifiers ||
+	    !gr->dmabuf.query_formats(gr->dmabuf_display, 0, NULL,
+				      &num_formats) ||
+	    num_formats <= 0) {
+		for (f = 0; f < sizeof(fallback_formats) / sizeof(uint32_t); ++f)
+			wlb_compositor_add_dmabuf_format(gr->compositor,
+					fallback_formats[f],
+					WLB_DRM_FORMAT_MOD_INVALID);
+		return;
+	}
+
+	formats = calloc(num_formats, sizeof *formats);
+	if (!formats)
+		return;
+
+	if (!gr->dmabuf.query_formats(gr->dmabuf_display, num_formats,
+				      formats, &num_formats))
+		num_formats = 0;
+
+	for (i = 0; i < num_formats; ++i) {
+		num_modifiers = 0;
+		if (!gr->dmabuf.query_modifiers(gr->dmabuf_display, formats[i],
+						0, NULL, NULL,
+						&num_modifiers))
+			num_modifiers = 0;
+
+		free(modifiers);
+		modifiers = NULL;
+		if (num_modifiers > 0)
+			modifiers = calloc(num_modifiers, sizeof *modifiers);
+		if (!modifiers ||
+		    !gr->dmabuf.query_modifiers(gr->dmabuf_display,
+						formats[i], num_modifiers,
+						modifiers, NULL,
+						&num_modifiers))
+			num_modifiers = 0;
+
+		wlb_compositor_add_dmabuf_format(gr->compositor, formats[i],
+						 WLB_DRM_FORMAT_MOD_INVALID);
+		for (j = 0; j < num_modifiers; ++j)
+			wlb_compositor_add_dmabuf_format(gr->compositor,
+							 formats[i],
+							 modifiers[j]);
+	}
+
+	free(modifiers);
+	free(formats);
+}
+
+static void
+gles2_renderer_init_dmabuf(struct wlb_gles2_renderer *gr, EGLDisplay display)
+{
+	gr->dmabuf.create_image =
+		(void *) eglGetProcAddress("eglCreateImageKHR");
+	gr->dmabuf.destroy_image =
+		(void *) eglGetProcAddress("eglDestroyImageKHR");
+	gr->dmabuf.image_target_texture_2d =
+		(void *) eglGetProcAddress("glEGLImageTargetTexture2DOES");
+
+	if (!gr->dmabuf.create_image || !gr->dmabuf.destroy_image ||
+	    !gr->dmabuf.image_target_texture_2d)
+		return;
+
+	if (gr->has_dmabuf_modifiers) {
+		gr->dmabuf.query_formats =
+			(void *) eglGetProcAddress("eglQueryDmaBufFormatsEXT");
+		gr->dmabuf.query_modifiers =
+			(void *) eglGetProcAddress("eglQueryDmaBufModifiersEXT");
+		gr->has_dmabuf_modifiers = gr->dmabuf.query_formats &&
+					   gr->dmabuf.query_modifiers;
+	}
+
+	if (wlb_compositor_add_buffer_type_with_size(gr->compositor,
+				&gles2_dmabuf_buffer_type, gr,
+				sizeof gles2_dmabuf_buffer_type) < 0)
+		return;
+
+	gr->dmabuf_display = display;
+	gles2_renderer_advertise_dmabuf_formats(gr);
+}
+
 WL_EXPORT struct wlb_gles2_renderer *
 wlb_gles2_renderer_create(struct wlb_compositor *c)
 {
@@ -683,11 +2714,14 @@ wlb_gles2_renderer_create(struct wlb_compositor *c)
 	wl_list_init(&renderer->surface_list);
 	wl_list_init(&renderer->surface_cleanup_list);
 	wl_list_init(&renderer->output_list);
+	wl_list_init(&renderer->read_list);
+	wl_list_init(&renderer->dmabuf_image_list);
 
 	wl_list_init(&renderer->shm_format_shader_list);
 	wl_list_init(&renderer->buffer_type_shader_list);
 
 	renderer->egl_display = EGL_NO_DISPLAY;
+	renderer->dmabuf_display = EGL_NO_DISPLAY;
 	renderer->egl_context = EGL_NO_CONTEXT;
 	
 	return renderer;
@@ -698,8 +2732,8 @@ wlb_gles2_renderer_create_for_egl(struct wlb_compositor *c,
 				  EGLDisplay display, EGLConfig *user_config)
 {
 	struct wlb_gles2_renderer *renderer;
-	const char *version;
-	int major, minor;
+	const char *version, *extensions;
+	int i, major, minor;
 	EGLint matched;
 	EGLConfig config;
 	EGLContext context;
@@ -721,7 +2755,7 @@ wlb_gles2_renderer_create_for_egl(struct wlb_compositor *c,
 		return NULL;
 	}
 
-	static const EGLint attribs[] = {
+	EGLint attribs[] = {
 		EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
 		EGL_RED_SIZE, 1,
 		EGL_GREEN_SIZE, 1,
@@ -730,12 +2764,24 @@ wlb_gles2_renderer_create_for_egl(struct wlb_compositor *c,
 		EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
 		EGL_NONE
 	};
+	/* Displays without windows, such as surfaceless ones, can still
+	 * have pbuffer or off-screen outputs */
+	static const EGLint surface_types[] = {
+		EGL_WINDOW_BIT, EGL_PBUFFER_BIT, 0
+	};
 
 	if (user_config) {
 		config = *user_config;
 	} else {
-		if (!eglChooseConfig(display, attribs, &config, 1, &matched) ||
-		    matched < 1) {
+		matched = 0;
+		for (i = 0; i < 3 && matched < 1; ++i) {
+			attribs[1] = surface_types[i];
+			if (!eglChooseConfig(display, attribs, &config, 1,
+					     &matched))
+				matched = 0;
+		}
+
+		if (matched < 1) {
 			egl_error("Failed to chose EGL configuration");
 			return NULL;
 		}
@@ -763,6 +2809,10 @@ wlb_gles2_renderer_create_for_egl(struct wlb_compositor *c,
 	renderer->egl_config = config;
 	renderer->egl_context = context;
 
+	extensions = eglQueryString(display, EGL_EXTENSIONS);
+	if (extensions && strstr(extensions, "EGL_KHR_surfaceless_context"))
+		wlb_gles2_renderer_initialize_surfaceless(renderer);
+
 	return renderer;
 }
 
@@ -772,6 +2822,8 @@ wlb_gles2_renderer_destroy(struct wlb_gles2_renderer *gr)
 	struct gles2_surface *surface, *sunext;
 	struct gles2_output *output, *onext;
 	struct gles2_shader *shader, *shnext;
+	struct gles2_read_request *req, *rnext;
+	struct gles2_dmabuf_image *dmabuf_image, *dinext;
 
 	/* If we have a context, then we don't need to bother cleanin up
 	 * because we're going to delete that context.  If we're working
@@ -782,6 +2834,14 @@ wlb_gles2_renderer_destroy(struct wlb_gles2_renderer *gr)
 	if (gr->wayland_binding)
 		wlb_wayland_egl_binding_destroy(gr->wayland_binding);
 
+	if (gr->dmabuf_display != EGL_NO_DISPLAY) {
+		wlb_compositor_remove_buffer_type(gr->compositor,
+						  &gles2_dmabuf_buffer_type);
+		wl_list_for_each_safe(dmabuf_image, dinext,
+				      &gr->dmabuf_image_list, link)
+			gles2_dmabuf_image_destroy(dmabuf_image);
+	}
+
 	wl_list_for_each_safe(surface, sunext, &gr->surface_list, link)
 		gles2_surface_destroy(surface, cleanup_gl);
 	wl_list_for_each_safe(surface, sunext, &gr->surface_cleanup_list, link)
@@ -790,7 +2850,32 @@ wlb_gles2_renderer_destroy(struct wlb_gles2_renderer *gr)
 	wl_list_for_each_safe(output, onext, &gr->output_list, link)
 		gles2_output_destroy(output);
 
+	/* Reads still in flight only exist in our own context, so their
+	 * buffers go with it */
+	wl_list_for_each_safe(req, rnext, &gr->read_list, link) {
+		req->callback(req->data, req->done ? req->status : -1);
+		gles2_read_request_destroy(req);
+	}
+	if (gr->read_timer)
+		wl_event_source_remove(gr->read_timer);
+	if (gr->read_idle)
+		wl_event_source_remove(gr->read_idle);
+
+	/* Every surface is done with it by now */
+	if (gr->uploader)
+		gles2_uploader_destroy(gr->uploader);
+
+	if (cleanup_gl) {
+		glDeleteBuffers(2, gr->pbos);
+		gles2_renderer_delete_dead_objects(gr);
+	}
+
 	wl_array_release(&gr->vertices);
+	wl_array_release(&gr->dead_buffers);
+	wl_array_release(&gr->dead_framebuffers);
+	wl_array_release(&gr->dead_textures);
+	wl_array_release(&gr->dead_queries);
+	wl_array_release(&gr->staging);
 
 	if (gr->solid_shader)
 		gles2_shader_destroy(gr->solid_shader, cleanup_gl);
@@ -803,9 +2888,170 @@ wlb_gles2_renderer_destroy(struct wlb_gles2_renderer *gr)
 		eglDestroyContext(gr->egl_display, gr->egl_context);
 	}
 
+	free(gr->program_cache_dir);
 	free(gr);
 }
 
+WL_EXPORT int
+wlb_gles2_renderer_set_async_upload(struct wlb_gles2_renderer *gr, int enable)
+{
+	struct gles2_surface *gs;
+
+	/* The upload context has to share with one of our own */
+	if (gr->egl_context == EGL_NO_CONTEXT) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (!enable && gr->uploader) {
+		/* Uploads left unshown are covered by front_stale.  The
+		 * second textures stop being tracked, so they will need a
+		 * full upload if this is ever turned back on. */
+		wl_list_for_each(gs, &gr->surface_list, link) {
+			gles2_upload_finish(gs);
+			gs->upload.pending = 0;
+			pixman_region32_union_rect(&gs->upload.stale,
+						   &gs->upload.stale, 0, 0,
+						   gs->bwidth, gs->bheight);
+		}
+
+		gles2_uploader_destroy(gr->uploader);
+		gr->uploader = NULL;
+	}
+
+	/* The upload thread is started by the next repaint */
+	gr->async_upload = enable;
+
+	return 0;
+}
+
+WL_EXPORT void
+wlb_gles2_renderer_set_gpu_timing(struct wlb_gles2_renderer *gr, int enable)
+{
+	gr->gpu_timing = enable;
+}
+
+WL_EXPORT int
+wlb_gles2_renderer_get_gpu_timings(struct wlb_gles2_renderer *gr,
+				   struct wlb_output *output,
+				   struct wlb_gles2_gpu_timings *timings)
+{
+	struct gles2_output *go;
+
+	go = gles2_output_get(gr, output);
+	if (!go || !go->has_timings) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	timings->frame = go->timings_frame;
+	timings->upload = go->timings[GLES2_TIMER_UPLOAD];
+	timings->attach = go->timings[GLES2_TIMER_ATTACH];
+	timings->clear = go->timings[GLES2_TIMER_CLEAR];
+	timings->draw = go->timings[GLES2_TIMER_DRAW];
+
+	return 0;
+}
+
+/* Starts the output's reads without waiting for a repaint that may never
+ * come.  Off-screen targets still hold the last frame, so they are read
+ * right away.  Window contents are undefined once swapped, so those
+ * outputs get damaged to make the backend repaint them instead. */
+static void
+gles2_output_read_idle(struct wlb_gles2_renderer *gr,
+		       struct gles2_output *go, struct wlb_output *output)
+{
+	EGLDisplay display;
+	EGLContext context;
+	EGLSurface draw, read;
+	EGLBoolean current;
+
+	if (go->target == GLES2_TARGET_WINDOW || !go->target_valid ||
+	    gr->egl_context == EGL_NO_CONTEXT || !output->current_mode ||
+	    go->target_width != output->current_mode->width ||
+	    go->target_height != output->current_mode->height) {
+		pixman_region32_union_rect(&output->damage, &output->damage,
+					   0, 0, output->width,
+					   output->height);
+		return;
+	}
+
+	display = eglGetCurrentDisplay();
+	context = eglGetCurrentContext();
+	draw = eglGetCurrentSurface(EGL_DRAW);
+	read = eglGetCurrentSurface(EGL_READ);
+
+	if (go->target == GLES2_TARGET_PBUFFER)
+		current = eglMakeCurrent(gr->egl_display, go->egl_surface,
+					 go->egl_surface, gr->egl_context);
+	else
+		current = eglMakeCurrent(gr->egl_display, EGL_NO_SURFACE,
+					 EGL_NO_SURFACE, gr->egl_context);
+	if (!current) {
+		egl_error("Failed to make EGL context current");
+		return;
+	}
+
+	if (go->target == GLES2_TARGET_FBO)
+		glBindFramebuffer(GL_FRAMEBUFFER, go->fbo);
+
+	gles2_output_start_reads(gr, go, output);
+
+	if (go->target == GLES2_TARGET_FBO)
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	if (context == EGL_NO_CONTEXT)
+		eglMakeCurrent(gr->egl_display, EGL_NO_SURFACE,
+			       EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	else
+		eglMakeCurrent(display, draw, read, context);
+}
+
+WL_EXPORT int
+wlb_gles2_renderer_read_pixels_async(struct wlb_gles2_renderer *gr,
+				     struct wlb_output *output,
+				     const struct wlb_rectangle *rects,
+				     int nrects, void *dest, int32_t stride,
+				     void (*callback)(void *data, int status),
+				     void *data)
+{
+	struct gles2_read_request *req;
+	struct gles2_output *go;
+	int i;
+
+	if (nrects < 0 || !dest || !callback) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	go = gles2_output_get(gr, output);
+	if (!go)
+		go = gles2_output_create(gr, output);
+	if (!go)
+		return -1;
+
+	req = zalloc(sizeof *req);
+	if (!req)
+		return -1;
+
+	pixman_region32_init(&req->region);
+	for (i = 0; i < nrects; ++i)
+		pixman_region32_union_rect(&req->region, &req->region,
+					   rects[i].x, rects[i].y,
+					   rects[i].width, rects[i].height);
+
+	req->dest = dest;
+	req->stride = stride;
+	req->callback = callback;
+	req->data = data;
+	wl_list_insert(go->read_queue.prev, &req->link);
+
+	if (!wlb_output_needs_repaint(output))
+		gles2_output_read_idle(gr, go, output);
+
+	return 0;
+}
+
 WL_EXPORT void
 wlb_gles2_renderer_add_egl_output(struct wlb_gles2_renderer *gr,
 				  struct wlb_output *output,
@@ -822,21 +3068,59 @@ wlb_gles2_renderer_add_egl_output(struct wlb_gles2_renderer *gr,
 		if (go == NULL)
 			return;
 	} else {
-		eglDestroySurface(gr->egl_display, go->egl_surface);
+		gles2_output_release_target(go);
+	}
+
+	go->target = GLES2_TARGET_WINDOW;
+	go->egl_surface =
+		eglCreateWindowSurface(gr->egl_display, gr->egl_config,
+				       window, NULL);
+	if (go->egl_surface == EGL_NO_SURFACE)
+		egl_error("Failed to create EGL surface");
+}
+
+WL_EXPORT int
+wlb_gles2_renderer_add_offscreen_output(struct wlb_gles2_renderer *gr,
+					struct wlb_output *output)
+{
+	struct gles2_output *go;
+	const char *extensions;
+
+	if (gr->egl_context == EGL_NO_CONTEXT) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	go = gles2_output_get(gr, output);
+	if (go == NULL) {
+		go = gles2_output_create(gr, output);
+		if (go == NULL)
+			return -1;
+	} else {
+		gles2_output_release_target(go);
 	}
 
-	go->egl_surface =
-		eglCreateWindowSurface(gr->egl_display, gr->egl_config,
-				       window, NULL);
-	if (go->egl_surface == EGL_NO_SURFACE)
-		egl_error("Failed to create EGL surface");
+	/* The target itself is created on the first repaint, once the
+	 * mode is known */
+	extensions = eglQueryString(gr->egl_display, EGL_EXTENSIONS);
+	if (extensions && strstr(extensions, "EGL_KHR_surfaceless_context"))
+		go->target = GLES2_TARGET_FBO;
+	else
+		go->target = GLES2_TARGET_PBUFFER;
+
+	return 0;
 }
 
 static void
 wlb_gles2_renderer_initialize(struct wlb_gles2_renderer *gr)
 {
-	const char *extensions;
+	const char *extensions, *version;
 	EGLDisplay egl_display;
+	int major;
+	EGLint alpha_size;
+#ifdef GL_OES_get_program_binary
+	GLint num_formats = 0;
+#endif
 
 	if (gr->initialized)
 		return;	
@@ -856,6 +3140,26 @@ wlb_gles2_renderer_initialize(struct wlb_gles2_renderer *gr)
 			gr->wayland_binding =
 				wlb_wayland_egl_binding_create(gr->compositor,
 							       egl_display);
+
+		if (strstr(extensions, "EGL_EXT_image_dma_buf_import"))
+			gr->has_dmabuf_import = 1;
+
+		if (strstr(extensions,
+			   "EGL_EXT_image_dma_buf_import_modifiers"))
+			gr->has_dmabuf_modifiers = 1;
+
+		if (strstr(extensions, "EGL_KHR_surfaceless_context"))
+			gr->has_surfaceless = 1;
+
+		if (strstr(extensions, "EGL_EXT_buffer_age"))
+			gr->has_buffer_age = 1;
+
+		if (strstr(extensions, "EGL_KHR_swap_buffers_with_damage"))
+			gr->swap_buffers_with_damage = (void *)
+				eglGetProcAddress("eglSwapBuffersWithDamageKHR");
+		else if (strstr(extensions, "EGL_EXT_swap_buffers_with_damage"))
+			gr->swap_buffers_with_damage = (void *)
+				eglGetProcAddress("eglSwapBuffersWithDamageEXT");
 	}
 	
 	extensions = (const char *) glGetString(GL_EXTENSIONS);
@@ -866,7 +3170,145 @@ wlb_gles2_renderer_initialize(struct wlb_gles2_renderer *gr)
 		gr->has_unpack_subimage = 1;
 #endif
 
+#ifdef GL_EXT_texture_format_BGRA8888
+	if (strstr(extensions, "GL_EXT_texture_format_BGRA8888"))
+		gr->has_bgra8888 = 1;
+#endif
+
+	/* Immutable storage is core in GLES 3.0 */
+	version = (const char *) glGetString(GL_VERSION);
+	if (version && sscanf(version, "OpenGL ES %d.", &major) == 1 &&
+	    major >= 3) {
+		gr->tex_storage_2d =
+			(void *) eglGetProcAddress("glTexStorage2D");
+
+		gr->gles3.map_buffer_range =
+			(void *) eglGetProcAddress("glMapBufferRange");
+		gr->gles3.unmap_buffer =
+			(void *) eglGetProcAddress("glUnmapBuffer");
+		gr->gles3.fence_sync =
+			(void *) eglGetProcAddress("glFenceSync");
+		gr->gles3.wait_sync =
+			(void *) eglGetProcAddress("glWaitSync");
+		gr->gles3.delete_sync =
+			(void *) eglGetProcAddress("glDeleteSync");
+		gr->gles3.client_wait_sync =
+			(void *) eglGetProcAddress("glClientWaitSync");
+
+		gr->has_gles3 = gr->gles3.map_buffer_range &&
+				gr->gles3.unmap_buffer &&
+				gr->gles3.fence_sync &&
+				gr->gles3.wait_sync &&
+				gr->gles3.delete_sync &&
+				gr->gles3.client_wait_sync;
+	}
+
+	/* GL_BGRA8_EXT is only a valid internal format for the EXT entry
+	 * point, and only with GL_EXT_texture_format_BGRA8888 */
+	if (strstr(extensions, "GL_EXT_texture_storage")) {
+		gr->tex_storage_2d =
+			(void *) eglGetProcAddress("glTexStorage2DEXT");
+		gr->has_bgra8_storage = gr->has_bgra8888;
+	}
+
+#ifdef GL_EXT_unpack_subimage
+	/* GL_UNPACK_ROW_LENGTH and friends are core in GLES 3.0 */
+	if (gr->has_gles3)
+		gr->has_unpack_subimage = 1;
+#endif
+
+	if (strstr(extensions, "GL_EXT_read_format_bgra"))
+		gr->has_read_bgra = 1;
+
+	if (gr->has_dmabuf_import &&
+	    strstr(extensions, "GL_OES_EGL_image_external"))
+		gles2_renderer_init_dmabuf(gr, egl_display);
+
+	if (strstr(extensions, "GL_EXT_disjoint_timer_query")) {
+		gr->timer.gen_queries =
+			(void *) eglGetProcAddress("glGenQueriesEXT");
+		gr->timer.delete_queries =
+			(void *) eglGetProcAddress("glDeleteQueriesEXT");
+		gr->timer.begin_query =
+			(void *) eglGetProcAddress("glBeginQueryEXT");
+		gr->timer.end_query =
+			(void *) eglGetProcAddress("glEndQueryEXT");
+		gr->timer.get_query_objectuiv =
+			(void *) eglGetProcAddress("glGetQueryObjectuivEXT");
+		gr->timer.get_query_objectui64v =
+			(void *) eglGetProcAddress("glGetQueryObjectui64vEXT");
+
+		gr->has_timer_query = gr->timer.gen_queries &&
+				      gr->timer.delete_queries &&
+				      gr->timer.begin_query &&
+				      gr->timer.end_query &&
+				      gr->timer.get_query_objectuiv &&
+				      gr->timer.get_query_objectui64v;
+	}
+
+	/* Outputs drawn into the caller's framebuffers check theirs at
+	 * repaint time */
+	if (gr->egl_context != EGL_NO_CONTEXT)
+		gr->opaque_config =
+			eglGetConfigAttrib(gr->egl_display, gr->egl_config,
+					   EGL_ALPHA_SIZE, &alpha_size) &&
+			alpha_size == 0;
+
+	/* Program binaries are only good for the exact same driver */
+	gr->program_cache_seed = hash_string(0xcbf29ce484222325ull, "libwlb");
+	gr->program_cache_seed = hash_string(gr->program_cache_seed,
+		(const char *) glGetString(GL_VENDOR));
+	gr->program_cache_seed = hash_string(gr->program_cache_seed,
+		(const char *) glGetString(GL_RENDERER));
+	gr->program_cache_seed = hash_string(gr->program_cache_seed, version);
+
+#ifdef GL_OES_get_program_binary
+	if (strstr(extensions, "GL_OES_get_program_binary")) {
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &num_formats);
+		gr->get_program_binary =
+			(void *) eglGetProcAddress("glGetProgramBinaryOES");
+		gr->program_binary =
+			(void *) eglGetProcAddress("glProgramBinaryOES");
+
+		if (num_formats > 0 && gr->get_program_binary &&
+		    gr->program_binary)
+			gr->program_cache_dir = wlb_util_get_cache_dir();
+	}
+#endif
+
 	gr->initialized = 1;
+
+	/* Build every program we know of now so that the first frame that
+	 * needs one does not have to */
+	gles2_renderer_prewarm_shaders(gr);
+}
+
+/* Initializes the renderer in its own context without needing an output,
+ * so that the shaders are ready before the first frame */
+static void
+wlb_gles2_renderer_initialize_surfaceless(struct wlb_gles2_renderer *gr)
+{
+	EGLDisplay display;
+	EGLContext context;
+	EGLSurface draw, read;
+
+	display = eglGetCurrentDisplay();
+	context = eglGetCurrentContext();
+	draw = eglGetCurrentSurface(EGL_DRAW);
+	read = eglGetCurrentSurface(EGL_READ);
+
+	if (!eglMakeCurrent(gr->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+			    gr->egl_context))
+		return;
+
+	wlb_gles2_renderer_initialize(gr);
+
+	/* Put back whatever the caller had current */
+	if (context == EGL_NO_CONTEXT)
+		eglMakeCurrent(gr->egl_display, EGL_NO_SURFACE,
+			       EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	else
+		eglMakeCurrent(display, draw, read, context);
 }
 
 static void
@@ -890,34 +3332,84 @@ make_triangles_from_region(struct wl_array *array, pixman_region32_t *region)
 	}
 }
 
+/* Builds the output transform for the current geometry if it is out of
+ * date.  Transforms that keep the size do not change the geometry, so the
+ * transform is checked here as well. */
 static void
-paint_surface(struct wlb_gles2_renderer *gr, struct wlb_output *output)
+gles2_output_update_matrix(struct gles2_output *go, struct wlb_output *output)
 {
-	struct wlb_matrix buffer_mat;
-	struct wlb_surface *surface;
-	struct gles2_surface *gs;
-	enum wl_output_transform sbtrans;
-	pixman_region32_t damage;
-	int32_t sx, sy, sbscale;
-	uint32_t swidth, sheight;
+	struct wlb_matrix ortho_mat;
 
-	surface = wlb_output_surface(output);
-	gs = gles2_surface_get(gr, surface);
-	if (!gs)
-		return;
-	if (gles2_surface_prepare(gr, gs) < 0)
+	if (go->output_mat_valid &&
+	    go->output_mat_transform == output->physical.transform)
 		return;
 
-	glUniformMatrix3fv(gs->shader->vu_output_tf, 1, GL_FALSE,
-			   gr->output_mat.d);
+	wlb_matrix_ortho(&ortho_mat, 0, output->width, 0, output->height);
+
+	wlb_matrix_init(&go->output_mat);
+	switch (output->physical.transform) {
+	case WL_OUTPUT_TRANSFORM_NORMAL:
+	case WL_OUTPUT_TRANSFORM_FLIPPED:
+		break;
+	case WL_OUTPUT_TRANSFORM_90:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+		wlb_matrix_rotate(&go->output_mat, &go->output_mat, 0, -1);
+		break;
+	case WL_OUTPUT_TRANSFORM_180:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+		wlb_matrix_rotate(&go->output_mat, &go->output_mat, -1, 0);
+		break;
+	case WL_OUTPUT_TRANSFORM_270:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		wlb_matrix_rotate(&go->output_mat, &go->output_mat, 0, 1);
+		break;
+	}
+
+	switch (output->physical.transform) {
+	case WL_OUTPUT_TRANSFORM_NORMAL:
+	case WL_OUTPUT_TRANSFORM_90:
+	case WL_OUTPUT_TRANSFORM_180:
+	case WL_OUTPUT_TRANSFORM_270:
+		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		wlb_matrix_scale(&go->output_mat, &go->output_mat, -1, 1);
+		break;
+	}
+
+	wlb_matrix_mult(&go->output_mat, &go->output_mat, &ortho_mat);
+
+	go->output_mat_transform = output->physical.transform;
+	go->output_mat_valid = 1;
+
+	/* The vertex buffer has the old transform baked in */
+	go->vertex_count = 0;
+}
+
+/* Rebuilds the buffer transform and vertex buffer if the surface has moved,
+ * its buffer transform has changed or the output transform was rebuilt.
+ * Leaves the vertex buffer bound. */
+static void
+gles2_output_update_placement(struct wlb_gles2_renderer *gr,
+			      struct gles2_output *go,
+			      enum wl_output_transform sbtrans,
+			      int32_t sx, int32_t sy,
+			      uint32_t swidth, uint32_t sheight)
+{
+	pixman_region32_t region;
+	GLfloat *verts;
+	size_t i, count;
 
-	wlb_matrix_init(&buffer_mat);
-	if ((int32_t)gs->bpitch != gs->bwidth)
-		wlb_matrix_scale(&buffer_mat, &buffer_mat,
-				 gs->bwidth / (float)gs->bpitch, 1);
+	if (go->vertex_count > 0 && go->placement.transform == sbtrans &&
+	    go->placement.x == sx && go->placement.y == sy &&
+	    go->placement.width == swidth && go->placement.height == sheight) {
+		glBindBuffer(GL_ARRAY_BUFFER, go->vbo);
+		return;
+	}
 
-	sbtrans = wlb_surface_buffer_transform(surface);
-	sbscale = wlb_surface_buffer_scale(surface);
+	wlb_matrix_init(&go->buffer_mat);
 
 	switch (sbtrans) {
 	case WL_OUTPUT_TRANSFORM_NORMAL:
@@ -925,18 +3417,18 @@ paint_surface(struct wlb_gles2_renderer *gr, struct wlb_output *output)
 		break;
 	case WL_OUTPUT_TRANSFORM_90:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
-		wlb_matrix_translate(&buffer_mat, &buffer_mat, 1, 0);
-		wlb_matrix_rotate(&buffer_mat, &buffer_mat, 0, 1);
+		wlb_matrix_translate(&go->buffer_mat, &go->buffer_mat, 1, 0);
+		wlb_matrix_rotate(&go->buffer_mat, &go->buffer_mat, 0, 1);
 		break;
 	case WL_OUTPUT_TRANSFORM_180:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
-		wlb_matrix_translate(&buffer_mat, &buffer_mat, 1, 1);
-		wlb_matrix_rotate(&buffer_mat, &buffer_mat, -1, 0);
+		wlb_matrix_translate(&go->buffer_mat, &go->buffer_mat, 1, 1);
+		wlb_matrix_rotate(&go->buffer_mat, &go->buffer_mat, -1, 0);
 		break;
 	case WL_OUTPUT_TRANSFORM_270:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
-		wlb_matrix_translate(&buffer_mat, &buffer_mat, 0, 1);
-		wlb_matrix_rotate(&buffer_mat, &buffer_mat, 0, -1);
+		wlb_matrix_translate(&go->buffer_mat, &go->buffer_mat, 0, 1);
+		wlb_matrix_rotate(&go->buffer_mat, &go->buffer_mat, 0, -1);
 		break;
 	}
 
@@ -950,110 +3442,474 @@ paint_surface(struct wlb_gles2_renderer *gr, struct wlb_output *output)
 	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
-		wlb_matrix_translate(&buffer_mat, &buffer_mat, 1, 0);
-		wlb_matrix_scale(&buffer_mat, &buffer_mat, -1, 1);
+		wlb_matrix_translate(&go->buffer_mat, &go->buffer_mat, 1, 0);
+		wlb_matrix_scale(&go->buffer_mat, &go->buffer_mat, -1, 1);
 		break;
 	}
 
-	wlb_output_surface_position(output, &sx, &sy, &swidth, &sheight);
-	wlb_matrix_scale(&buffer_mat, &buffer_mat,
+	wlb_matrix_scale(&go->buffer_mat, &go->buffer_mat,
 			 1 / (float)swidth, 1 / (float)sheight);
-	wlb_matrix_translate(&buffer_mat, &buffer_mat, -sx, -sy);
+	wlb_matrix_translate(&go->buffer_mat, &go->buffer_mat, -sx, -sy);
+
+	pixman_region32_init_rect(&region, sx, sy, swidth, sheight);
+	gr->vertices.size = 0;
+	make_triangles_from_region(&gr->vertices, &region);
+	pixman_region32_fini(&region);
+
+	/* Expand each vertex to a clip-space position and a texture
+	 * coordinate so that the vertex shader has nothing left to do */
+	count = gr->vertices.size / (sizeof(GLfloat) * 2);
+	verts = wl_array_add(&gr->vertices, count * 2 * sizeof(GLfloat));
+	if (!verts) {
+		go->vertex_count = 0;
+		return;
+	}
+	verts = gr->vertices.data;
+	for (i = count; i-- > 0;) {
+		verts[i * 4 + 0] = verts[i * 2 + 0];
+		verts[i * 4 + 1] = verts[i * 2 + 1];
+		verts[i * 4 + 2] = verts[i * 4 + 0];
+		verts[i * 4 + 3] = verts[i * 4 + 1];
+
+		wlb_matrix_transform_point(&go->output_mat,
+					   &verts[i * 4 + 0], &verts[i * 4 + 1]);
+		wlb_matrix_transform_point(&go->buffer_mat,
+					   &verts[i * 4 + 2], &verts[i * 4 + 3]);
+	}
 
-	glUniformMatrix3fv(gs->shader->vu_buffer_tf, 1, GL_FALSE, buffer_mat.d);
+	if (!go->vbo)
+		glGenBuffers(1, &go->vbo);
+	glBindBuffer(GL_ARRAY_BUFFER, go->vbo);
+	glBufferData(GL_ARRAY_BUFFER, gr->vertices.size, gr->vertices.data,
+		     GL_STATIC_DRAW);
+
+	go->vertex_count = count;
+	go->placement.transform = sbtrans;
+	go->placement.x = sx;
+	go->placement.y = sy;
+	go->placement.width = swidth;
+	go->placement.height = sheight;
+}
 
-	pixman_region32_init_rect(&damage, sx, sy, swidth, sheight);
+static void
+paint_surface(struct wlb_gles2_renderer *gr, struct gles2_output *go,
+	      struct wlb_output *output)
+{
+	struct wlb_surface *surface;
+	struct gles2_surface *gs;
+	struct gles2_shader *shader;
+	int32_t sx, sy;
+	uint32_t swidth, sheight;
 
-	gr->vertices.size = 0;
-	make_triangles_from_region(&gr->vertices, &damage);
-	pixman_region32_fini(&damage);
+	surface = wlb_output_surface(output);
+	gs = gles2_surface_get(gr, surface);
+	if (!gs)
+		return;
+	if (gles2_surface_prepare(gr, gs) < 0)
+		return;
+
+	wlb_output_surface_position(output, &sx, &sy, &swidth, &sheight);
+	gles2_output_update_placement(gr, go,
+				      wlb_surface_buffer_transform(surface),
+				      sx, sy, swidth, sheight);
+
+	if (go->vertex_count == 0) {
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		gles2_surface_finish(gr, gs);
+		return;
+	}
+
+	shader = go->opaque ? gs->opaque_shader : gs->shader;
+
+	/* Buffer types bind their own textures in attach */
+	glUseProgram(shader->program);
+	if (!gs->shader_type) {
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, gs->textures[0]);
+	}
 
-	glVertexAttribPointer(gs->shader->va_vertex, 2, GL_FLOAT, GL_FALSE, 0,
-			      gr->vertices.data);
-	glEnableVertexAttribArray(gs->shader->va_vertex);
-	glDrawArrays(GL_TRIANGLES, 0, gr->vertices.size / (sizeof(GLfloat)*2));
-	glDisableVertexAttribArray(gs->shader->va_vertex);
+	glVertexAttribPointer(shader->va_vertex, 4, GL_FLOAT, GL_FALSE, 0,
+			      NULL);
+	glEnableVertexAttribArray(shader->va_vertex);
+	gles2_timer_begin(gr, GLES2_TIMER_DRAW);
+	glDrawArrays(GL_TRIANGLES, 0, go->vertex_count);
+	gles2_timer_end(gr);
+	glDisableVertexAttribArray(shader->va_vertex);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 
 	gles2_surface_finish(gr, gs);
 }
 
+/* (Re)creates the pbuffer if the mode has changed */
+static int
+gles2_output_ensure_pbuffer(struct wlb_gles2_renderer *gr,
+			    struct gles2_output *go, struct wlb_output *output)
+{
+	EGLint attribs[] = {
+		EGL_WIDTH, output->current_mode->width,
+		EGL_HEIGHT, output->current_mode->height,
+		EGL_NONE
+	};
+
+	if (go->egl_surface != EGL_NO_SURFACE &&
+	    go->target_width == output->current_mode->width &&
+	    go->target_height == output->current_mode->height)
+		return 0;
+
+	gles2_output_release_target(go);
+
+	go->egl_surface = eglCreatePbufferSurface(gr->egl_display,
+						  gr->egl_config, attribs);
+	if (go->egl_surface == EGL_NO_SURFACE) {
+		egl_error("Failed to create pbuffer");
+		return -1;
+	}
+
+	go->target_width = output->current_mode->width;
+	go->target_height = output->current_mode->height;
+
+	return 0;
+}
+
+/* (Re)creates the framebuffer if the mode has changed and leaves it
+ * bound.  Needs to be called in our context. */
+static int
+gles2_output_ensure_fbo(struct wlb_gles2_renderer *gr,
+			struct gles2_output *go, struct wlb_output *output)
+{
+	GLenum format;
+
+	if (go->fbo &&
+	    go->target_width == output->current_mode->width &&
+	    go->target_height == output->current_mode->height) {
+		glBindFramebuffer(GL_FRAMEBUFFER, go->fbo);
+		return 0;
+	}
+
+	gles2_output_release_target(go);
+	gles2_renderer_delete_dead_objects(gr);
+
+	/* Match our window surfaces, so the same programs work for both */
+	format = gr->opaque_config ? GL_RGB : GL_RGBA;
+	gles2_texture_create(&go->fbo_texture);
+	glTexImage2D(GL_TEXTURE_2D, 0, format,
+		     output->current_mode->width,
+		     output->current_mode->height, 0,
+		     format, GL_UNSIGNED_BYTE, NULL);
+
+	glGenFramebuffers(1, &go->fbo);
+	glBindFramebuffer(GL_FRAMEBUFFER, go->fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			       GL_TEXTURE_2D, go->fbo_texture, 0);
+
+	if (glCheckFramebufferStatus(GL_FRAMEBUFFER) !=
+	    GL_FRAMEBUFFER_COMPLETE) {
+		wlb_error("Off-screen framebuffer is incomplete\n");
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		gles2_output_release_target(go);
+		return -1;
+	}
+
+	go->target_width = output->current_mode->width;
+	go->target_height = output->current_mode->height;
+
+	return 0;
+}
+
+/* Reads back the results of earlier frames that have them, oldest first */
+static void
+gles2_output_collect_timings(struct wlb_gles2_renderer *gr,
+			     struct gles2_output *go)
+{
+	struct gles2_timer_frame *tf;
+	GLint disjoint = 0;
+	GLuint available;
+	int i, t;
+
+	/* Anything still in flight across a disjoint event is garbage */
+	glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+
+	for (i = 1; i <= GLES2_TIMER_FRAMES; ++i) {
+		tf = &go->timer_frames[(go->timer_index + i) %
+				       GLES2_TIMER_FRAMES];
+		if (!tf->pending)
+			continue;
+
+		if (disjoint) {
+			tf->pending = 0;
+			continue;
+		}
+
+		available = GL_TRUE;
+		for (t = 0; t < GLES2_TIMER_COUNT && available; ++t)
+			if (tf->used & (1 << t))
+				gr->timer.get_query_objectuiv(tf->queries[t],
+							      GL_QUERY_RESULT_AVAILABLE_EXT,
+							      &available);
+		if (!available)
+			break;
+
+		for (t = 0; t < GLES2_TIMER_COUNT; ++t) {
+			go->timings[t] = 0;
+			if (tf->used & (1 << t))
+				gr->timer.get_query_objectui64v(tf->queries[t],
+								GL_QUERY_RESULT_EXT,
+								&go->timings[t]);
+		}
+
+		go->timings_frame = tf->frame;
+		go->has_timings = 1;
+		tf->pending = 0;
+	}
+}
+
+/* Picks the queries for the frame about to be drawn.  If the oldest frame
+ * still has no results by now they are dropped. */
+static void
+gles2_output_start_timing(struct wlb_gles2_renderer *gr,
+			  struct gles2_output *go)
+{
+	struct gles2_timer_frame *tf;
+
+	gr->timer_frame = NULL;
+	if (!gr->gpu_timing)
+		return;
+
+	if (!gr->has_timer_query) {
+		wlb_warn("GPU timing needs GL_EXT_disjoint_timer_query\n");
+		gr->gpu_timing = 0;
+		return;
+	}
+
+	gles2_output_collect_timings(gr, go);
+
+	go->timer_index = (go->timer_index + 1) % GLES2_TIMER_FRAMES;
+	tf = &go->timer_frames[go->timer_index];
+	tf->used = 0;
+	tf->frame = go->frame_count;
+	tf->pending = 0;
+
+	gr->timer_frame = tf;
+}
+
+static void
+gles2_output_finish_timing(struct wlb_gles2_renderer *gr)
+{
+	if (gr->timer_frame && gr->timer_frame->used)
+		gr->timer_frame->pending = 1;
+
+	gr->timer_frame = NULL;
+}
+
+/* Works out which part of the back buffer, in device pixels, has to be
+ * repainted to bring it up to date and remembers this frame's damage.
+ * Returns 1 if that is the whole buffer. */
+static int
+gles2_output_get_repaint(struct wlb_gles2_renderer *gr,
+			 struct gles2_output *go, struct wlb_output *output,
+			 pixman_region32_t *damage, pixman_region32_t *repaint)
+{
+	EGLint age = 0;
+	int i, full;
+
+	/* Off-screen targets are single-buffered */
+	if (go && go->target != GLES2_TARGET_WINDOW)
+		age = go->target_valid ? 1 : 0;
+	else if (!go || go->egl_surface == EGL_NO_SURFACE ||
+		 !gr->has_buffer_age ||
+		 !eglQuerySurface(gr->egl_display, go->egl_surface,
+				  EGL_BUFFER_AGE_EXT, &age))
+		age = 0;
+
+	/* An age of 0 means the contents are undefined */
+	full = (age <= 0 || age > GLES2_DAMAGE_HISTORY + 1);
+	if (full) {
+		pixman_region32_fini(repaint);
+		pixman_region32_init_rect(repaint, 0, 0,
+					  output->current_mode->width,
+					  output->current_mode->height);
+	} else {
+		pixman_region32_copy(repaint, damage);
+		for (i = 0; i < age - 1; ++i)
+			pixman_region32_union(repaint, repaint,
+					      &go->damage_history[i]);
+	}
+
+	if (!go)
+		return full;
+
+	pixman_region32_fini(&go->damage_history[GLES2_DAMAGE_HISTORY - 1]);
+	memmove(&go->damage_history[1], &go->damage_history[0],
+		(GLES2_DAMAGE_HISTORY - 1) * sizeof(pixman_region32_t));
+	pixman_region32_init(&go->damage_history[0]);
+	pixman_region32_copy(&go->damage_history[0], damage);
+
+	return full;
+}
+
+static void
+gles2_output_swap(struct wlb_gles2_renderer *gr, struct gles2_output *go,
+		  struct wlb_output *output, pixman_region32_t *damage)
+{
+	pixman_box32_t *boxes;
+	EGLint *rects;
+	int i, nboxes;
+
+	boxes = pixman_region32_rectangles(damage, &nboxes);
+	if (!gr->swap_buffers_with_damage || nboxes == 0) {
+		eglSwapBuffers(gr->egl_display, go->egl_surface);
+		return;
+	}
+
+	rects = malloc(nboxes * 4 * sizeof *rects);
+	if (!rects) {
+		eglSwapBuffers(gr->egl_display, go->egl_surface);
+		return;
+	}
+
+	/* EGL wants the rectangles relative to the bottom-left corner */
+	for (i = 0; i < nboxes; ++i) {
+		rects[i * 4 + 0] = boxes[i].x1;
+		rects[i * 4 + 1] = output->current_mode->height - boxes[i].y2;
+		rects[i * 4 + 2] = boxes[i].x2 - boxes[i].x1;
+		rects[i * 4 + 3] = boxes[i].y2 - boxes[i].y1;
+	}
+
+	gr->swap_buffers_with_damage(gr->egl_display, go->egl_surface,
+				     rects, nboxes);
+	free(rects);
+}
+
 WL_EXPORT void
 wlb_gles2_renderer_repaint_output(struct wlb_gles2_renderer *gr,
 				  struct wlb_output *output)
 {
 	struct gles2_output *go;
 	struct gles2_surface *surface, *snext;
-	struct wlb_matrix ortho_mat;
+	pixman_region32_t damage, repaint;
+	pixman_box32_t *extents;
+	GLint alpha_bits;
+	int full;
 
 	assert(output->current_mode);
 
+	/* Outputs drawn into the caller's context need one too, for the
+	 * cached geometry */
 	go = gles2_output_get(gr, output);
+	if (!go)
+		go = gles2_output_create(gr, output);
+	if (!go) {
+		wlb_error("Failed to allocate output\n");
+		return;
+	}
 
-	if (go && go->egl_surface != EGL_NO_SURFACE) {
+	if (go->target == GLES2_TARGET_PBUFFER &&
+	    gles2_output_ensure_pbuffer(gr, go, output) < 0)
+		return;
+
+	if (go->egl_surface != EGL_NO_SURFACE) {
 		if (!eglMakeCurrent(gr->egl_display, go->egl_surface,
 				    go->egl_surface, gr->egl_context)) {
 			egl_error("Failed to make EGL context current");
 			return;
 		}
+	} else if (go->target == GLES2_TARGET_FBO) {
+		if (!eglMakeCurrent(gr->egl_display, EGL_NO_SURFACE,
+				    EGL_NO_SURFACE, gr->egl_context)) {
+			egl_error("Failed to make EGL context current");
+			return;
+		}
 	}
 
 	wlb_gles2_renderer_initialize(gr);
 
+	if (gr->async_upload && !gr->uploader) {
+		if (gr->has_gles3 && gr->has_surfaceless)
+			gr->uploader = gles2_uploader_create(gr);
+		else
+			wlb_warn("Asynchronous uploads need OpenGL ES 3.0 and EGL_KHR_surfaceless_context\n");
+
+		if (!gr->uploader)
+			gr->async_upload = 0;
+	}
+
 	/* We clean up dead surfaces here.  This way we are sure that the
 	 * cleanup happens inside the correct OpenGL context */
 	wl_list_for_each_safe(surface, snext, &gr->surface_cleanup_list, link)
 		gles2_surface_destroy(surface, TRUE);
 
 
+	gles2_renderer_delete_dead_objects(gr);
+
+	if (gr->has_gles3)
+		gles2_renderer_poll_reads(gr);
+
+	if (go->target == GLES2_TARGET_FBO &&
+	    gles2_output_ensure_fbo(gr, go, output) < 0)
+		return;
+
+	/* Our own targets all use our config.  Otherwise we go by whatever
+	 * framebuffer the caller has bound for this output. */
+	if (go->egl_surface != EGL_NO_SURFACE ||
+	    go->target == GLES2_TARGET_FBO) {
+		go->opaque = gr->opaque_config;
+	} else {
+		glGetIntegerv(GL_ALPHA_BITS, &alpha_bits);
+		go->opaque = (alpha_bits == 0);
+	}
+
 	glViewport(0, 0,
 		   output->current_mode->width,
 		   output->current_mode->height);
 
-	wlb_matrix_ortho(&ortho_mat, 0, output->width, 0, output->height);
-
-	wlb_matrix_init(&gr->output_mat);
-	switch (output->physical.transform) {
-	case WL_OUTPUT_TRANSFORM_NORMAL:
-	case WL_OUTPUT_TRANSFORM_FLIPPED:
-		break;
-	case WL_OUTPUT_TRANSFORM_90:
-	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
-		wlb_matrix_rotate(&gr->output_mat, &gr->output_mat, 0, -1);
-		break;
-	case WL_OUTPUT_TRANSFORM_180:
-	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
-		wlb_matrix_rotate(&gr->output_mat, &gr->output_mat, -1, 0);
-		break;
-	case WL_OUTPUT_TRANSFORM_270:
-	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
-		wlb_matrix_rotate(&gr->output_mat, &gr->output_mat, 0, 1);
-		break;
+	gles2_output_update_matrix(go, output);
+
+	pixman_region32_init(&damage);
+	pixman_region32_init(&repaint);
+	wlb_output_transform_region(output, &damage, &output->damage);
+	full = gles2_output_get_repaint(gr, go, output, &damage, &repaint);
+
+	if (!full) {
+		/* The scissor box is in GL window coordinates, which start
+		 * at the bottom-left corner */
+		extents = pixman_region32_extents(&repaint);
+		glEnable(GL_SCISSOR_TEST);
+		glScissor(extents->x1,
+			  output->current_mode->height - extents->y2,
+			  extents->x2 - extents->x1,
+			  extents->y2 - extents->y1);
 	}
 
-	switch (output->physical.transform) {
-	case WL_OUTPUT_TRANSFORM_NORMAL:
-	case WL_OUTPUT_TRANSFORM_90:
-	case WL_OUTPUT_TRANSFORM_180:
-	case WL_OUTPUT_TRANSFORM_270:
-		break;
-	case WL_OUTPUT_TRANSFORM_FLIPPED:
-	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
-	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
-	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
-		wlb_matrix_scale(&gr->output_mat, &gr->output_mat, -1, 1);
-		break;
+	go->frame_count++;
+	gles2_output_start_timing(gr, go);
+
+	if (full || pixman_region32_not_empty(&repaint)) {
+		glClearColor(0, 0, 0, 1);
+		gles2_timer_begin(gr, GLES2_TIMER_CLEAR);
+		glClear(GL_COLOR_BUFFER_BIT);
+		gles2_timer_end(gr);
+
+		if (wlb_output_surface(output))
+			paint_surface(gr, go, output);
 	}
 
-	wlb_matrix_mult(&gr->output_mat, &gr->output_mat, &ortho_mat);
+	gles2_output_finish_timing(gr);
 
-	glClearColor(0, 0, 0, 1);
-	glClear(GL_COLOR_BUFFER_BIT);
+	if (!wl_list_empty(&go->read_queue))
+		gles2_output_start_reads(gr, go, output);
 
-	if (wlb_output_surface(output))
-		paint_surface(gr, output);
+	if (!full)
+		glDisable(GL_SCISSOR_TEST);
 
-	if (go && go->egl_surface != EGL_NO_SURFACE) {
-		eglSwapBuffers(gr->egl_display, go->egl_surface);
-	}
+	if (go->target == GLES2_TARGET_WINDOW &&
+	    go->egl_surface != EGL_NO_SURFACE)
+		gles2_output_swap(gr, go, output, &damage);
+	else if (go->target == GLES2_TARGET_FBO)
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+	go->target_valid = 1;
+
+	pixman_region32_fini(&repaint);
+	pixman_region32_fini(&damage);
 }
 
@@ -105,6 +105,20 @@ struct wlb_buffer_type {
 	 * type.
 	 */
 	void (*detach)(void *data, struct wl_resource *buffer);
+
+	/* Like attach but also passes the damage, in buffer coordinates,
+	 * since the surface's previous contents.  If the buffer has been
+	 * damaged in its entirety, a single rectangle covering the whole
+	 * buffer is passed.  The unchanged flag is set if this is the same
+	 * buffer as in the last call and no damage has been posted since,
+	 * in which case the textures still hold what was attached before.
+	 *
+	 * If set, this is used in place of attach.  This may be NULL.
+	 */
+	void (*attach_damage)(void *data, struct wl_resource *buffer,
+			      GLuint program, GLuint textures[],
+			      const struct wlb_rectangle *damage, int ndamage,
+			      int unchanged);
 };
 
 WL_EXPORT struct wlb_compositor *
@@ -129,6 +143,23 @@ WL_EXPORT const struct wlb_buffer_type *
 wlb_compositor_get_buffer_type(struct wlb_compositor *compositor,
 			       struct wl_resource *buffer,
 			       void **data, size_t *size);
+/* Retrieves the size of the given buffer as reported by its buffer type.
+ * The buffer type is resolved once per wl_buffer and cached until the
+ * buffer is destroyed.  Returns -1 if the buffer is of an unknown type.
+ */
+WL_EXPORT int
+wlb_compositor_get_buffer_size(struct wlb_compositor *compositor,
+			       struct wl_resource *buffer,
+			       int32_t *width, int32_t *height);
+/* Advertises a buffer format through zwp_linux_dmabuf_v1.  The format is
+ * a DRM fourcc code and the modifier a DRM format modifier.  Linear
+ * ARGB8888 and XRGB8888 are always advertised since they can be read by
+ * the CPU.  Formats added after a client binds the global are only seen
+ * by clients that bind it later.
+ */
+WL_EXPORT int
+wlb_compositor_add_dmabuf_format(struct wlb_compositor *compositor,
+				 uint32_t format, uint64_t modifier);
 WL_EXPORT struct wl_client *
 wlb_compositor_launch_client(struct wlb_compositor *compositor,
 			     const char *exec_path, char * const argv[]);
@@ -282,10 +313,44 @@ WL_EXPORT struct wlb_pixman_renderer *
 wlb_pixman_renderer_create(struct wlb_compositor *c);
 WL_EXPORT void
 wlb_pixman_renderer_destroy(struct wlb_pixman_renderer *renderer);
+/* Sets the number of worker threads used to composite surfaces.  Large
+ * repaints are split into horizontal bands and the calling thread works on
+ * one band itself.  The default of 0 composites everything on the calling
+ * thread.
+ */
+WL_EXPORT int
+wlb_pixman_renderer_set_num_threads(struct wlb_pixman_renderer *renderer,
+				    int num_threads);
+enum wlb_pixman_filter {
+	WLB_PIXMAN_FILTER_NEAREST,
+	WLB_PIXMAN_FILTER_BILINEAR,
+	WLB_PIXMAN_FILTER_AREA_AVERAGE,
+};
+/* Selects how scaled surfaces are filtered on the given output.  The
+ * default is WLB_PIXMAN_FILTER_BILINEAR.  WLB_PIXMAN_FILTER_AREA_AVERAGE
+ * averages all of the buffer pixels under each output pixel when
+ * downscaling and falls back to bilinear when upscaling.
+ */
+WL_EXPORT int
+wlb_pixman_renderer_set_output_filter(struct wlb_pixman_renderer *renderer,
+				      struct wlb_output *output,
+				      enum wlb_pixman_filter filter);
 WL_EXPORT void
 wlb_pixman_renderer_repaint_output(struct wlb_pixman_renderer *renderer,
 				   struct wlb_output *output,
 				   pixman_image_t *output_image);
+/* Repaints the damaged portion of the given output.  The renderer
+ * remembers the last few images used for each output and assumes each
+ * still holds the frame it was last painted with, so only what changed
+ * since then is repainted; an unfamiliar image is repainted entirely.
+ * If repainted is not NULL, it is set to the region of output_image, in
+ * image pixel coordinates, that was touched.
+ */
+WL_EXPORT void
+wlb_pixman_renderer_repaint_output_with_damage(struct wlb_pixman_renderer *renderer,
+					       struct wlb_output *output,
+					       pixman_image_t *output_image,
+					       pixman_region32_t *repainted);
 #endif /* pixman */
 
 struct wlb_gles2_renderer;
@@ -297,6 +362,46 @@ WL_EXPORT void
 wlb_gles2_renderer_repaint_output(struct wlb_gles2_renderer *renderer,
 				  struct wlb_output *output);
 
+/* GPU time, in nanoseconds, spent on each part of one repaint.  frame
+ * counts the repaints of the output, starting at 1. */
+struct wlb_gles2_gpu_timings {
+	uint32_t frame;
+	uint64_t upload;
+	uint64_t attach;
+	uint64_t clear;
+	uint64_t draw;
+};
+
+/* Measures repaints with GL_EXT_disjoint_timer_query.  Results show up a
+ * few frames after the repaint they belong to and are dropped if the
+ * driver reports a disjoint event.  Does nothing without the extension.
+ */
+WL_EXPORT void
+wlb_gles2_renderer_set_gpu_timing(struct wlb_gles2_renderer *renderer,
+				  int enable);
+/* Gets the timings of the most recent repaint of the output that has
+ * finished on the GPU.  Returns -1 if there are none yet.
+ */
+WL_EXPORT int
+wlb_gles2_renderer_get_gpu_timings(struct wlb_gles2_renderer *renderer,
+				   struct wlb_output *output,
+				   struct wlb_gles2_gpu_timings *timings);
+/* Reads the given rectangles of the output, in device pixels, into dest
+ * as XRGB8888 once the next repaint of the output is done.  dest has to
+ * be big enough for the whole mode and stay valid until callback is
+ * called from the event loop with a status of 0, or -1 on failure or if
+ * the output or renderer goes away first.  Where the driver allows it,
+ * the read goes through a pixel buffer so that the repaint does not wait
+ * for it.
+ */
+WL_EXPORT int
+wlb_gles2_renderer_read_pixels_async(struct wlb_gles2_renderer *renderer,
+				     struct wlb_output *output,
+				     const struct wlb_rectangle *rects,
+				     int nrects, void *dest, int32_t stride,
+				     void (*callback)(void *data, int status),
+				     void *data);
+
 #ifdef EGL_OPENGL_ES2_BIT
 WL_EXPORT struct wlb_gles2_renderer *
 wlb_gles2_renderer_create_for_egl(struct wlb_compositor *c,
@@ -305,6 +410,27 @@ WL_EXPORT void
 wlb_gles2_renderer_add_egl_output(struct wlb_gles2_renderer *renderer,
 				  struct wlb_output *output,
 				  EGLNativeWindowType window);
+/* Renders the output off-screen instead of into a window, so no windowing
+ * system is needed.  With EGL_KHR_surfaceless_context the target is a
+ * framebuffer object, otherwise it is a pbuffer and the renderer's config
+ * must support EGL_PBUFFER_BIT.  The target follows the current mode.
+ * Only renderers created with wlb_gles2_renderer_create_for_egl support
+ * it.
+ */
+WL_EXPORT int
+wlb_gles2_renderer_add_offscreen_output(struct wlb_gles2_renderer *renderer,
+					struct wlb_output *output);
+/* Uploads SHM buffers on a separate thread with its own shared EGL context
+ * as soon as they are committed, so that a repaint only has to bind the
+ * finished texture.  This needs OpenGL ES 3.0 and
+ * EGL_KHR_surfaceless_context; without them uploads stay on the repaint
+ * path.  Only renderers created with wlb_gles2_renderer_create_for_egl
+ * support it.  It may be toggled at any time; the upload thread starts with
+ * the next repaint.
+ */
+WL_EXPORT int
+wlb_gles2_renderer_set_async_upload(struct wlb_gles2_renderer *renderer,
+				    int enable);
 
 struct wlb_wayland_egl_binding;
 
@@ -0,0 +1,650 @@
+/*
+ * Copyright © 2013 Jason Ekstrand
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+#include "wlb-private.h"
+#include "linux-dmabuf-unstable-v1-server-protocol.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/dma-buf.h>
+
+#ifndef F_GET_SEALS
+#define F_GET_SEALS 1034
+#endif
+#ifndef F_SEAL_SHRINK
+#define F_SEAL_SHRINK 0x0002
+#endif
+
+struct dmabuf_format {
+	uint32_t format;
+	uint64_t modifier;
+};
+
+struct wlb_linux_dmabuf {
+	struct wlb_compositor *compositor;
+	struct wl_global *global;
+
+	/* Advertised format/modifier pairs */
+	struct wl_array formats;
+};
+
+struct dmabuf_params {
+	struct wlb_linux_dmabuf *dmabuf;
+	struct wl_resource *resource;
+
+	int used;
+	struct wlb_dmabuf_plane planes[WLB_DMABUF_MAX_PLANES];
+};
+
+static const struct wl_buffer_interface dmabuf_buffer_implementation;
+
+static void
+dmabuf_buffer_destroy(struct wlb_dmabuf_buffer *buffer)
+{
+	int i;
+
+	if (buffer->map)
+		munmap(buffer->map, buffer->map_size);
+
+	for (i = 0; i < buffer->num_planes; ++i)
+		close(buffer->planes[i].fd);
+
+	free(buffer);
+}
+
+static void
+dmabuf_buffer_resource_destroyed(struct wl_resource *resource)
+{
+	dmabuf_buffer_destroy(wl_resource_get_user_data(resource));
+}
+
+static void
+dmabuf_buffer_handle_destroy(struct wl_client *client,
+			     struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static const struct wl_buffer_interface dmabuf_buffer_implementation = {
+	dmabuf_buffer_handle_destroy
+};
+
+struct wlb_dmabuf_buffer *
+wlb_dmabuf_buffer_get(struct wl_resource *resource)
+{
+	if (!resource ||
+	    !wl_resource_instance_of(resource, &wl_buffer_interface,
+				     &dmabuf_buffer_implementation))
+		return NULL;
+
+	return wl_resource_get_user_data(resource);
+}
+
+static int
+dmabuf_sync(int fd, uint64_t flags)
+{
+	struct dma_buf_sync sync;
+	int ret;
+
+	sync.flags = flags;
+	do {
+		ret = ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+	} while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+	return ret;
+}
+
+/* Only formats that every renderer can upload are handed out for CPU
+ * access; the GLES2 upload path only knows these two. */
+static int
+dmabuf_format_to_shm(uint32_t format, uint32_t *shm_format)
+{
+	switch (format) {
+	case WLB_DRM_FORMAT_ARGB8888:
+		*shm_format = WL_SHM_FORMAT_ARGB8888;
+		return 0;
+	case WLB_DRM_FORMAT_XRGB8888:
+		*shm_format = WL_SHM_FORMAT_XRGB8888;
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/* Bytes per pixel of the single-plane formats we know, or 0 */
+static uint32_t
+dmabuf_format_cpp(uint32_t format)
+{
+	switch (format) {
+	case WLB_DRM_FORMAT_ARGB8888:
+	case WLB_DRM_FORMAT_XRGB8888:
+	case WLB_DRM_FORMAT_ABGR8888:
+	case WLB_DRM_FORMAT_XBGR8888:
+		return 4;
+	case WLB_DRM_FORMAT_RGB565:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+/* A client could shrink the file under a long-lived mapping and have us
+ * take SIGBUS.  dmabufs cannot change size, and memfds can promise not
+ * to with F_SEAL_SHRINK; anything else is not mapped. */
+static int
+dmabuf_fd_is_fixed_size(int fd)
+{
+	int seals;
+
+	seals = fcntl(fd, F_GET_SEALS);
+	if (seals >= 0)
+		return (seals & F_SEAL_SHRINK) != 0;
+
+	if (dmabuf_sync(fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ) < 0)
+		return 0;
+	dmabuf_sync(fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+
+	return 1;
+}
+
+/* Only single-plane linear buffers can be read directly.  The mapping
+ * is made on first use and kept until the buffer is destroyed; each
+ * access is bracketed with DMA_BUF_IOCTL_SYNC so that the exporter can
+ * flush caches.  Sealed memfds simply fail the ioctl, which is
+ * harmless. */
+void *
+wlb_dmabuf_buffer_mmap(struct wlb_dmabuf_buffer *buffer,
+		       uint32_t *stride, uint32_t *format)
+{
+	struct wlb_dmabuf_plane *plane = &buffer->planes[0];
+	uint64_t needed;
+	off_t size;
+	void *map;
+
+	if (buffer->num_planes != 1 ||
+	    plane->modifier != WLB_DRM_FORMAT_MOD_LINEAR)
+		return NULL;
+
+	if (dmabuf_format_to_shm(buffer->format, format) < 0)
+		return NULL;
+
+	if (!buffer->map) {
+		needed = (uint64_t)plane->offset +
+			 (uint64_t)plane->stride * buffer->height;
+
+		size = lseek(plane->fd, 0, SEEK_END);
+		if (size < 0 || (uint64_t)size < needed) {
+			wlb_warn("Cannot map dmabuf of unknown or short size\n");
+			return NULL;
+		}
+
+		if (!dmabuf_fd_is_fixed_size(plane->fd)) {
+			wlb_warn("Refusing to map a dmabuf that may shrink\n");
+			return NULL;
+		}
+
+		map = mmap(NULL, needed, PROT_READ, MAP_SHARED, plane->fd, 0);
+		if (map == MAP_FAILED) {
+			wlb_warn("Failed to map dmabuf: %s\n",
+				 strerror(errno));
+			return NULL;
+		}
+		buffer->map = map;
+		buffer->map_size = needed;
+	}
+
+	dmabuf_sync(plane->fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+
+	*stride = plane->stride;
+	return (uint8_t *)buffer->map + plane->offset;
+}
+
+void
+wlb_dmabuf_buffer_munmap(struct wlb_dmabuf_buffer *buffer)
+{
+	dmabuf_sync(buffer->planes[0].fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+}
+
+static int
+dmabuf_buffer_is_type(void *data, struct wl_resource *buffer)
+{
+	return wlb_dmabuf_buffer_get(buffer) ? 1 : 0;
+}
+
+static void
+dmabuf_buffer_get_size(void *data, struct wl_resource *resource,
+		       int32_t *width, int32_t *height)
+{
+	struct wlb_dmabuf_buffer *buffer = wlb_dmabuf_buffer_get(resource);
+
+	*width = buffer->width;
+	*height = buffer->height;
+}
+
+static void *
+dmabuf_buffer_mmap(void *data, struct wl_resource *resource,
+		   uint32_t *stride, uint32_t *format)
+{
+	return wlb_dmabuf_buffer_mmap(wlb_dmabuf_buffer_get(resource),
+				      stride, format);
+}
+
+static void
+dmabuf_buffer_munmap(void *data, struct wl_resource *resource, void *mapped)
+{
+	wlb_dmabuf_buffer_munmap(wlb_dmabuf_buffer_get(resource));
+}
+
+static const struct wlb_buffer_type dmabuf_buffer_type = {
+	dmabuf_buffer_is_type,
+	dmabuf_buffer_get_size,
+	dmabuf_buffer_mmap,
+	dmabuf_buffer_munmap
+};
+
+static int
+dmabuf_format_supported(struct wlb_linux_dmabuf *dmabuf,
+			uint32_t format, uint64_t modifier)
+{
+	struct dmabuf_format *fmt;
+
+	wl_array_for_each(fmt, &dmabuf->formats)
+		if (fmt->format == format && fmt->modifier == modifier)
+			return 1;
+
+	return 0;
+}
+
+static void
+params_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void
+params_resource_destroyed(struct wl_resource *resource)
+{
+	struct dmabuf_params *params = wl_resource_get_user_data(resource);
+	int i;
+
+	for (i = 0; i < WLB_DMABUF_MAX_PLANES; ++i)
+		if (params->planes[i].fd >= 0)
+			close(params->planes[i].fd);
+
+	free(params);
+}
+
+static void
+params_add(struct wl_client *client, struct wl_resource *resource,
+	   int32_t fd, uint32_t plane_idx, uint32_t offset, uint32_t stride,
+	   uint32_t modifier_hi, uint32_t modifier_lo)
+{
+	struct dmabuf_params *params = wl_resource_get_user_data(resource);
+
+	if (params->used) {
+		wl_resource_post_error(resource,
+			ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_ALREADY_USED,
+			"params was already used to create a wl_buffer");
+		close(fd);
+		return;
+	}
+
+	if (plane_idx >= WLB_DMABUF_MAX_PLANES) {
+		wl_resource_post_error(resource,
+			ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_PLANE_IDX,
+			"plane index %u is too high", plane_idx);
+		close(fd);
+		return;
+	}
+
+	if (params->planes[plane_idx].fd >= 0) {
+		wl_resource_post_error(resource,
+			ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_PLANE_SET,
+			"a dmabuf has already been added for plane %u",
+			plane_idx);
+		close(fd);
+		return;
+	}
+
+	params->planes[plane_idx].fd = fd;
+	params->planes[plane_idx].offset = offset;
+	params->planes[plane_idx].stride = stride;
+	params->planes[plane_idx].modifier =
+		((uint64_t)modifier_hi << 32) | modifier_lo;
+}
+
+/* Checks the parameters and builds the buffer, taking the fds.  Client
+ * errors are posted on the params resource; NULL without an error
+ * posted means the buffer cannot be used by us. */
+static struct wlb_dmabuf_buffer *
+params_build_buffer(struct dmabuf_params *params, int32_t width,
+		    int32_t height, uint32_t format, uint32_t flags)
+{
+	struct wlb_dmabuf_buffer *buffer;
+	struct wlb_dmabuf_plane *plane;
+	off_t size;
+	uint32_t cpp;
+	int i, num_planes;
+
+	if (params->used) {
+		wl_resource_post_error(params->resource,
+			ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_ALREADY_USED,
+			"params was already used to create a wl_buffer");
+		return NULL;
+	}
+	params->used = 1;
+
+	for (num_planes = 0; num_planes < WLB_DMABUF_MAX_PLANES; ++num_planes)
+		if (params->planes[num_planes].fd < 0)
+			break;
+
+	for (i = num_planes; i < WLB_DMABUF_MAX_PLANES; ++i) {
+		if (params->planes[i].fd >= 0)
+			num_planes = 0;
+	}
+
+	if (num_planes == 0) {
+		wl_resource_post_error(params->resource,
+			ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INCOMPLETE,
+			"planes must be added with consecutive indices");
+		return NULL;
+	}
+
+	if (width < 1 || height < 1) {
+		wl_resource_post_error(params->resource,
+			ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INVALID_DIMENSIONS,
+			"invalid buffer size %dx%d", width, height);
+		return NULL;
+	}
+
+	/* Everything that reads the buffer assumes whole rows */
+	cpp = dmabuf_format_cpp(format);
+	if (cpp && num_planes != 1) {
+		wl_resource_post_error(params->resource,
+			ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INCOMPLETE,
+			"format takes exactly one plane");
+		return NULL;
+	}
+	if (cpp &&
+	    (uint64_t)params->planes[0].stride < (uint64_t)width * cpp) {
+		wl_resource_post_error(params->resource,
+			ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_OUT_OF_BOUNDS,
+			"stride %u is too small for a width of %d",
+			params->planes[0].stride, width);
+		return NULL;
+	}
+
+	for (i = 0; i < num_planes; ++i) {
+		plane = &params->planes[i];
+
+		/* Not every fd can be sized; only check what we can */
+		size = lseek(plane->fd, 0, SEEK_END);
+		if (size < 0)
+			continue;
+
+		if (plane->offset >= size ||
+		    (i == 0 && (uint64_t)plane->offset +
+			       (uint64_t)plane->stride * height > (uint64_t)size)) {
+			wl_resource_post_error(params->resource,
+				ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_OUT_OF_BOUNDS,
+				"plane %d is out of the dmabuf's bounds", i);
+			return NULL;
+		}
+	}
+
+	/* All planes share one layout */
+	for (i = 1; i < num_planes; ++i)
+		if (params->planes[i].modifier != params->planes[0].modifier)
+			return NULL;
+
+	if (!dmabuf_format_supported(params->dmabuf, format,
+				     params->planes[0].modifier))
+		return NULL;
+
+	buffer = zalloc(sizeof *buffer);
+	if (!buffer)
+		return NULL;
+
+	buffer->width = width;
+	buffer->height = height;
+	buffer->format = format;
+	buffer->flags = flags;
+	buffer->num_planes = num_planes;
+	for (i = 0; i < num_planes; ++i) {
+		buffer->planes[i] = params->planes[i];
+		params->planes[i].fd = -1;
+	}
+
+	return buffer;
+}
+
+static struct wl_resource *
+params_create_common(struct wl_client *client, struct wl_resource *resource,
+		     uint32_t buffer_id, int32_t width, int32_t height,
+		     uint32_t format, uint32_t flags)
+{
+	struct dmabuf_params *params = wl_resource_get_user_data(resource);
+	struct wlb_dmabuf_buffer *buffer;
+
+	buffer = params_build_buffer(params, width, height, format, flags);
+	if (!buffer)
+		return NULL;
+
+	buffer->resource = wl_resource_create(client, &wl_buffer_interface,
+					      1, buffer_id);
+	if (!buffer->resource) {
+		wl_client_post_no_memory(client);
+		dmabuf_buffer_destroy(buffer);
+		return NULL;
+	}
+
+	wl_resource_set_implementation(buffer->resource,
+				       &dmabuf_buffer_implementation,
+				       buffer, dmabuf_buffer_resource_destroyed);
+
+	return buffer->resource;
+}
+
+static void
+params_create(struct wl_client *client, struct wl_resource *resource,
+	      int32_t width, int32_t height, uint32_t format, uint32_t flags)
+{
+	struct wl_resource *buffer;
+
+	buffer = params_create_common(client, resource, 0,
+				      width, height, format, flags);
+	if (buffer)
+		zwp_linux_buffer_params_v1_send_created(resource, buffer);
+	else
+		zwp_linux_buffer_params_v1_send_failed(resource);
+}
+
+static void
+params_create_immed(struct wl_client *client, struct wl_resource *resource,
+		    uint32_t buffer_id, int32_t width, int32_t height,
+		    uint32_t format, uint32_t flags)
+{
+	struct wl_resource *buffer;
+
+	buffer = params_create_common(client, resource, buffer_id,
+				      width, height, format, flags);
+	if (!buffer)
+		wl_resource_post_error(resource,
+			ZWP_LINUX_BUFFER_PARAMS_V1_ERROR_INVALID_WL_BUFFER,
+			"importing the dmabufs failed");
+}
+
+static const struct zwp_linux_buffer_params_v1_interface params_implementation = {
+	params_destroy,
+	params_add,
+	params_create,
+	params_create_immed
+};
+
+static void
+linux_dmabuf_destroy(struct wl_client *client, struct wl_resource *resource)
+{
+	wl_resource_destroy(resource);
+}
+
+static void
+linux_dmabuf_create_params(struct wl_client *client,
+			   struct wl_resource *resource, uint32_t id)
+{
+	struct wlb_linux_dmabuf *dmabuf = wl_resource_get_user_data(resource);
+	struct dmabuf_params *params;
+	int i;
+
+	params = zalloc(sizeof *params);
+	if (!params) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	params->dmabuf = dmabuf;
+	for (i = 0; i < WLB_DMABUF_MAX_PLANES; ++i)
+		params->planes[i].fd = -1;
+
+	params->resource =
+		wl_resource_create(client, &zwp_linux_buffer_params_v1_interface,
+				   wl_resource_get_version(resource), id);
+	if (!params->resource) {
+		free(params);
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(params->resource,
+				       &params_implementation,
+				       params, params_resource_destroyed);
+}
+
+static const struct zwp_linux_dmabuf_v1_interface linux_dmabuf_implementation = {
+	linux_dmabuf_destroy,
+	linux_dmabuf_create_params
+};
+
+static void
+linux_dmabuf_bind(struct wl_client *client,
+		  void *data, uint32_t version, uint32_t id)
+{
+	struct wlb_linux_dmabuf *dmabuf = data;
+	struct wl_resource *resource;
+	struct dmabuf_format *fmt, *prev;
+
+	resource = wl_resource_create(client, &zwp_linux_dmabuf_v1_interface,
+				      WLB_MIN(version, 3), id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+
+	wl_resource_set_implementation(resource, &linux_dmabuf_implementation,
+				       dmabuf, NULL);
+
+	wl_array_for_each(fmt, &dmabuf->formats) {
+		if (version >= ZWP_LINUX_DMABUF_V1_MODIFIER_SINCE_VERSION) {
+			zwp_linux_dmabuf_v1_send_modifier(resource, fmt->format,
+							  fmt->modifier >> 32,
+							  fmt->modifier & 0xffffffff);
+			continue;
+		}
+
+		/* Older clients only get each format once */
+		wl_array_for_each(prev, &dmabuf->formats)
+			if (prev == fmt || prev->format == fmt->format)
+				break;
+		if (prev == fmt)
+			zwp_linux_dmabuf_v1_send_format(resource, fmt->format);
+	}
+}
+
+int
+wlb_linux_dmabuf_add_format(struct wlb_linux_dmabuf *dmabuf,
+			    uint32_t format, uint64_t modifier)
+{
+	struct dmabuf_format *fmt;
+
+	if (dmabuf_format_supported(dmabuf, format, modifier))
+		return 0;
+
+	fmt = wl_array_add(&dmabuf->formats, sizeof *fmt);
+	if (!fmt)
+		return -1;
+
+	fmt->format = format;
+	fmt->modifier = modifier;
+
+	return 0;
+}
+
+struct wlb_linux_dmabuf *
+wlb_linux_dmabuf_create(struct wlb_compositor *comp)
+{
+	struct wlb_linux_dmabuf *dmabuf;
+
+	dmabuf = zalloc(sizeof *dmabuf);
+	if (!dmabuf)
+		return NULL;
+
+	dmabuf->compositor = comp;
+	wl_array_init(&dmabuf->formats);
+
+	/* Linear RGB buffers can always be read by the CPU */
+	if (wlb_linux_dmabuf_add_format(dmabuf, WLB_DRM_FORMAT_ARGB8888,
+					WLB_DRM_FORMAT_MOD_LINEAR) < 0 ||
+	    wlb_linux_dmabuf_add_format(dmabuf, WLB_DRM_FORMAT_XRGB8888,
+					WLB_DRM_FORMAT_MOD_LINEAR) < 0)
+		goto err_formats;
+
+	dmabuf->global = wl_global_create(comp->display,
+					  &zwp_linux_dmabuf_v1_interface, 3,
+					  dmabuf, linux_dmabuf_bind);
+	if (!dmabuf->global)
+		goto err_formats;
+
+	if (wlb_compositor_add_buffer_type_with_size(comp, &dmabuf_buffer_type,
+						     dmabuf,
+						     sizeof dmabuf_buffer_type) < 0)
+		goto err_global;
+
+	return dmabuf;
+
+err_global:
+	wl_global_destroy(dmabuf->global);
+err_formats:
+	wl_array_release(&dmabuf->formats);
+	free(dmabuf);
+	return NULL;
+}
+
+void
+wlb_linux_dmabuf_destroy(struct wlb_linux_dmabuf *dmabuf)
+{
+	wl_global_destroy(dmabuf->global);
+	wl_array_release(&dmabuf->formats);
+	free(dmabuf);
+}
@@ -109,6 +109,19 @@ wlb_matrix_ortho(struct wlb_matrix *dest, float l, float r, float t, float b)
 	memcpy(dest, &tmat, sizeof tmat);
 }
 
+void
+wlb_matrix_transform_point(const struct wlb_matrix *M, float *x, float *y)
+{
+	float tx, ty, tw;
+
+	tx = M->d[0] * *x + M->d[3] * *y + M->d[6];
+	ty = M->d[1] * *x + M->d[4] * *y + M->d[7];
+	tw = M->d[2] * *x + M->d[5] * *y + M->d[8];
+
+	*x = tx / tw;
+	*y = ty / tw;
+}
+
 void
 wlb_matrix_log(enum wlb_log_level level, const struct wlb_matrix *matrix)
 {
@@ -98,6 +98,18 @@ output_update_geometry(struct wlb_output *output)
 	}
 }
 
+static void
+output_damage_all(struct wlb_output *output)
+{
+	if (!output->current_mode)
+		return;
+
+	/* Damage is tracked in output coordinates */
+	pixman_region32_fini(&output->damage);
+	pixman_region32_init_rect(&output->damage, 0, 0,
+				  output->width, output->height);
+}
+
 static void
 output_bind(struct wl_client *client,
 	    void *data, uint32_t version, uint32_t id)
@@ -240,6 +252,7 @@ wlb_output_set_transform(struct wlb_output *output,
 	output->physical.transform = transform;
 
 	output_update_geometry(output);
+	output_damage_all(output);
 
 	wl_resource_for_each(resource, &output->resource_list)
 		output_send_geometry(output, resource);
@@ -258,6 +271,7 @@ wlb_output_set_scale(struct wlb_output *output, int32_t scale)
 	output->scale = scale;
 
 	output_update_geometry(output);
+	output_damage_all(output);
 
 	wl_resource_for_each(resource, &output->resource_list)
 		output_send_geometry(output, resource);
@@ -321,9 +335,7 @@ wlb_output_set_mode(struct wlb_output *output,
 	output->current_mode = mode;
 
 	output_update_geometry(output);
-
-	pixman_region32_fini(&output->damage);
-	pixman_region32_init_rect(&output->damage, 0, 0, width, height);
+	output_damage_all(output);
 
 	wl_resource_for_each(resource, &output->resource_list)
 		output_send_mode(output, resource, mode);
@@ -490,6 +502,10 @@ wlb_output_set_surface(struct wlb_output *output, struct wlb_surface *surface,
 	output->surface.surface = surface;
 }
 
+/* Computes the transform from device (mode) pixel coordinates to output
+ * coordinates multiplied by the output scale.  This is the direction pixman
+ * expects for a source image transform.
+ */
 void
 wlb_output_get_matrix(struct wlb_output *output,
 		      pixman_transform_t *transform)
@@ -511,7 +527,7 @@ wlb_output_get_matrix(struct wlb_output *output,
 	case WL_OUTPUT_TRANSFORM_90:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
 		pixman_transform_rotate(transform, NULL, 0, -pixman_fixed_1);
-		pixman_transform_translate(transform, NULL, 0, fh);
+		pixman_transform_translate(transform, NULL, 0, fw);
 		break;
 	case WL_OUTPUT_TRANSFORM_180:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
@@ -521,25 +537,126 @@ wlb_output_get_matrix(struct wlb_output *output,
 	case WL_OUTPUT_TRANSFORM_270:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
 		pixman_transform_rotate(transform, NULL, 0, pixman_fixed_1);
-		pixman_transform_translate(transform, NULL, fw, 0);
+		pixman_transform_translate(transform, NULL, fh, 0);
 		break;
 	}
 
 	switch (output->physical.transform) {
 	case WL_OUTPUT_TRANSFORM_FLIPPED:
-	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
-	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
 		pixman_transform_scale(transform, NULL,
 				       pixman_int_to_fixed (-1),
 				       pixman_int_to_fixed (1));
 		pixman_transform_translate(transform, NULL, fw, 0);
 		break;
+	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+		pixman_transform_scale(transform, NULL,
+				       pixman_int_to_fixed (-1),
+				       pixman_int_to_fixed (1));
+		pixman_transform_translate(transform, NULL, fh, 0);
+		break;
 	default:
 		break;
 	}
 }
 
+/* Transforms a region in output coordinates to device (mode) pixel
+ * coordinates, taking both the output scale and transform into account.
+ * The result is clipped to the current mode.
+ */
+void
+wlb_output_transform_region(struct wlb_output *output,
+			    pixman_region32_t *dest, pixman_region32_t *src)
+{
+	pixman_box32_t *src_rects, *dest_rects;
+	int i, nrects;
+	int32_t w, h, s;
+
+	assert(output->current_mode);
+
+	w = output->current_mode->width;
+	h = output->current_mode->height;
+	s = output->scale;
+
+	src_rects = pixman_region32_rectangles(src, &nrects);
+	if (nrects == 0) {
+		pixman_region32_fini(dest);
+		pixman_region32_init(dest);
+		return;
+	}
+
+	dest_rects = malloc(nrects * sizeof(*dest_rects));
+	if (!dest_rects) {
+		/* Repainting too much is better than not repainting */
+		pixman_region32_fini(dest);
+		pixman_region32_init_rect(dest, 0, 0, w, h);
+		return;
+	}
+
+	for (i = 0; i < nrects; ++i) {
+		pixman_box32_t r = {
+			src_rects[i].x1 * s, src_rects[i].y1 * s,
+			src_rects[i].x2 * s, src_rects[i].y2 * s
+		};
+
+		switch (output->physical.transform) {
+		default:
+		case WL_OUTPUT_TRANSFORM_NORMAL:
+			dest_rects[i] = r;
+			break;
+		case WL_OUTPUT_TRANSFORM_90:
+			dest_rects[i].x1 = w - r.y2;
+			dest_rects[i].y1 = r.x1;
+			dest_rects[i].x2 = w - r.y1;
+			dest_rects[i].y2 = r.x2;
+			break;
+		case WL_OUTPUT_TRANSFORM_180:
+			dest_rects[i].x1 = w - r.x2;
+			dest_rects[i].y1 = h - r.y2;
+			dest_rects[i].x2 = w - r.x1;
+			dest_rects[i].y2 = h - r.y1;
+			break;
+		case WL_OUTPUT_TRANSFORM_270:
+			dest_rects[i].x1 = r.y1;
+			dest_rects[i].y1 = h - r.x2;
+			dest_rects[i].x2 = r.y2;
+			dest_rects[i].y2 = h - r.x1;
+			break;
+		case WL_OUTPUT_TRANSFORM_FLIPPED:
+			dest_rects[i].x1 = w - r.x2;
+			dest_rects[i].y1 = r.y1;
+			dest_rects[i].x2 = w - r.x1;
+			dest_rects[i].y2 = r.y2;
+			break;
+		case WL_OUTPUT_TRANSFORM_FLIPPED_90:
+			dest_rects[i].x1 = w - r.y2;
+			dest_rects[i].y1 = h - r.x2;
+			dest_rects[i].x2 = w - r.y1;
+			dest_rects[i].y2 = h - r.x1;
+			break;
+		case WL_OUTPUT_TRANSFORM_FLIPPED_180:
+			dest_rects[i].x1 = r.x1;
+			dest_rects[i].y1 = h - r.y2;
+			dest_rects[i].x2 = r.x2;
+			dest_rects[i].y2 = h - r.y1;
+			break;
+		case WL_OUTPUT_TRANSFORM_FLIPPED_270:
+			dest_rects[i].x1 = r.y1;
+			dest_rects[i].y1 = r.x1;
+			dest_rects[i].x2 = r.y2;
+			dest_rects[i].y2 = r.x2;
+			break;
+		}
+	}
+
+	pixman_region32_fini(dest);
+	pixman_region32_init_rects(dest, dest_rects, nrects);
+	free(dest_rects);
+
+	pixman_region32_intersect_rect(dest, dest, 0, 0, w, h);
+}
+
 void
 wlb_output_to_surface_coords(struct wlb_output *output,
 			     wl_fixed_t ox, wl_fixed_t oy,
@@ -26,12 +26,508 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+/* Below this many pixels it's cheaper to composite on the calling thread
+ * than to wake up the workers. */
+#define PIXMAN_BAND_MIN_PIXELS (256 * 256)
+
+/* Enough for triple buffering with one image to spare */
+#define PIXMAN_OUTPUT_MAX_IMAGES 4
+
+/* One wrapper around the same pixels per band of a banded composite,
+ * kept for as long as the image they wrap */
+struct pixman_band_images {
+	pixman_image_t **images;
+	int count;
+};
+
+/* An image we have painted this output into before.  As long as the
+ * backend keeps handing us the same images, each one only needs the
+ * damage that has happened since it was last painted. */
+struct pixman_output_image {
+	struct wl_list link;
+	pixman_image_t *image;
+
+	/* Device coordinates that are out of date in this image */
+	pixman_region32_t damage;
+
+	struct pixman_band_images bands;
+
+	/* The black area around the surface as it was last filled */
+	struct {
+		int valid;
+		enum wl_output_transform transform;
+		int32_t mode_width, mode_height;
+		pixman_box32_t surface;
+	} letterbox;
+};
+
+struct pixman_output {
+	struct wlb_pixman_renderer *renderer;
+	struct wl_list link;
+	struct wl_listener destroy_listener;
+
+	/* Most recently used first */
+	struct wl_list image_list;
+
+	enum wlb_pixman_filter filter;
+};
+
+/* Per-wl_buffer state that lives until the buffer is destroyed so that we
+ * don't have to rebuild the pixman image every frame. */
+struct pixman_buffer {
+	struct wlb_pixman_renderer *renderer;
+	struct wl_list link;
+
+	struct wl_resource *resource;
+	struct wl_listener destroy_listener;
+
+	pixman_image_t *image;
+	void *data;
+	uint32_t format;
+	int32_t width, height, stride;
+
+	/* For YUV buffers, image wraps this RGB copy of the buffer.  The
+	 * parts the client has damaged since are left to convert. */
+	void *converted;
+	pixman_region32_t unconverted;
+
+	/* The placement for which transform and filter were computed */
+	struct {
+		int valid;
+		enum wl_output_transform output_transform;
+		int32_t mode_width, mode_height;
+		enum wl_output_transform buffer_transform;
+		struct wlb_rectangle pos;
+		enum wlb_pixman_filter filter;
+	} placement;
+
+	pixman_transform_t transform;
+	pixman_filter_t filter;
+	pixman_fixed_t *filter_params;
+	int n_filter_params;
+
+	/* Set once the band wrappers have transform and filter too */
+	struct pixman_band_images bands;
+	int bands_placed;
+
+	/* Set if the buffer should be downscaled with a wlb_box_scaler.
+	 * Device pixel x covers buffer pixels [x * sx + tx,
+	 * (x + 1) * sx + tx) and likewise for y.  The scaler is made on
+	 * first use and covers the whole mode. */
+	struct {
+		int enabled;
+		double sx, sy, tx, ty;
+		struct wlb_box_scaler *scaler;
+	} box;
+
+	/* Set if the transform has no scaling and only rotates by
+	 * multiples of 90 degrees.  Device pixel (x, y) then shows buffer
+	 * pixel (xx * x + xy * y + dx, yx * x + yy * y + dy). */
+	int is_axis_aligned;
+	int32_t xx, xy, yx, yy, dx, dy;
+};
+
+/* One horizontal slice of a composite.  Each band gets its own source and
+ * destination images wrapping the same pixels because pixman images carry
+ * lazily computed state and may not be used from several threads at once.
+ */
+struct pixman_band {
+	pixman_image_t *src;
+	pixman_image_t *dest;
+	pixman_region32_t region;
+};
+
+struct pixman_worker_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+
+	pthread_t *threads;
+	int num_threads;
+	int shutdown;
+
+	/* The job currently being worked on, protected by mutex */
+	struct pixman_band *bands;
+	int num_bands;
+	int next_band;
+	int bands_done;
+};
 
 struct wlb_pixman_renderer {
 	pixman_image_t *black_image;
+
+	struct wl_list output_list;
+	struct wl_list buffer_list;
+
+	struct pixman_worker_pool *pool;
 };
 
+static pixman_image_t *
+wrap_image(pixman_image_t *image)
+{
+	return pixman_image_create_bits(pixman_image_get_format(image),
+					pixman_image_get_width(image),
+					pixman_image_get_height(image),
+					pixman_image_get_data(image),
+					pixman_image_get_stride(image));
+}
+
+static void
+pixman_band_images_fini(struct pixman_band_images *bi)
+{
+	int i;
+
+	for (i = 0; i < bi->count; ++i)
+		pixman_image_unref(bi->images[i]);
+	free(bi->images);
+
+	bi->images = NULL;
+	bi->count = 0;
+}
+
+/* Returns count wrappers around image, reusing the ones from last time if
+ * there are as many.  The caller is responsible for calling
+ * pixman_band_images_fini whenever image changes. */
+static pixman_image_t **
+pixman_band_images_get(struct pixman_band_images *bi, pixman_image_t *image,
+		       int count)
+{
+	int i;
+
+	if (bi->count == count)
+		return bi->images;
+
+	pixman_band_images_fini(bi);
+
+	bi->images = calloc(count, sizeof *bi->images);
+	if (!bi->images)
+		return NULL;
+
+	for (i = 0; i < count; ++i) {
+		bi->images[i] = wrap_image(image);
+		if (!bi->images[i]) {
+			bi->count = i;
+			pixman_band_images_fini(bi);
+			return NULL;
+		}
+	}
+	bi->count = count;
+
+	return bi->images;
+}
+
+static void
+pixman_output_image_destroy(struct pixman_output_image *oi)
+{
+	pixman_band_images_fini(&oi->bands);
+	pixman_image_unref(oi->image);
+	pixman_region32_fini(&oi->damage);
+	wl_list_remove(&oi->link);
+	free(oi);
+}
+
+static void
+pixman_output_destroy(struct pixman_output *po)
+{
+	struct pixman_output_image *oi, *next;
+
+	wl_list_for_each_safe(oi, next, &po->image_list, link)
+		pixman_output_image_destroy(oi);
+
+	wl_list_remove(&po->link);
+	wl_list_remove(&po->destroy_listener.link);
+
+	free(po);
+}
+
+static void
+output_destroy_handler(struct wl_listener *listener, void *data)
+{
+	struct pixman_output *po;
+
+	po = wl_container_of(listener, po, destroy_listener);
+	pixman_output_destroy(po);
+}
+
+static struct pixman_output *
+pixman_output_get(struct wlb_pixman_renderer *pr, struct wlb_output *output)
+{
+	struct pixman_output *po;
+	struct wl_listener *listener;
+
+	listener = wl_signal_get(&output->destroy_signal,
+				 output_destroy_handler);
+	if (listener) {
+		po = wl_container_of(listener, po, destroy_listener);
+		return po;
+	}
+
+	po = zalloc(sizeof *po);
+	if (!po)
+		return NULL;
+
+	po->renderer = pr;
+	po->filter = WLB_PIXMAN_FILTER_BILINEAR;
+	wl_list_init(&po->image_list);
+	po->destroy_listener.notify = output_destroy_handler;
+	wl_signal_add(&output->destroy_signal, &po->destroy_listener);
+	wl_list_insert(&pr->output_list, &po->link);
+
+	return po;
+}
+
+/* Adds the output's pending damage to every image we know about and
+ * returns the entry for the given image, moved to the front.  An image
+ * we haven't seen before is entirely damaged. */
+static struct pixman_output_image *
+pixman_output_get_image(struct pixman_output *po, struct wlb_output *output,
+			pixman_image_t *image)
+{
+	struct pixman_output_image *oi, *found = NULL;
+	pixman_region32_t damage;
+	int count = 0;
+
+	pixman_region32_init(&damage);
+	wlb_output_transform_region(output, &damage, &output->damage);
+
+	wl_list_for_each(oi, &po->image_list, link) {
+		pixman_region32_union(&oi->damage, &oi->damage, &damage);
+		if (oi->image == image)
+			found = oi;
+		count++;
+	}
+
+	pixman_region32_fini(&damage);
+
+	if (found) {
+		wl_list_remove(&found->link);
+		wl_list_insert(&po->image_list, &found->link);
+		return found;
+	}
+
+	if (count >= PIXMAN_OUTPUT_MAX_IMAGES) {
+		oi = wl_container_of(po->image_list.prev, oi, link);
+		pixman_output_image_destroy(oi);
+	}
+
+	oi = zalloc(sizeof *oi);
+	if (!oi)
+		return NULL;
+
+	oi->image = pixman_image_ref(image);
+	pixman_region32_init_rect(&oi->damage, 0, 0,
+				  output->current_mode->width,
+				  output->current_mode->height);
+	wl_list_insert(&po->image_list, &oi->link);
+
+	return oi;
+}
+
+static void
+pixman_buffer_destroy(struct pixman_buffer *pb)
+{
+	pixman_band_images_fini(&pb->bands);
+	if (pb->box.scaler)
+		wlb_box_scaler_destroy(pb->box.scaler);
+	if (pb->image)
+		pixman_image_unref(pb->image);
+	free(pb->converted);
+	pixman_region32_fini(&pb->unconverted);
+	free(pb->filter_params);
+
+	wl_list_remove(&pb->link);
+	wl_list_remove(&pb->destroy_listener.link);
+
+	free(pb);
+}
+
+static void
+buffer_destroy_handler(struct wl_listener *listener, void *data)
+{
+	struct pixman_buffer *pb;
+
+	pb = wl_container_of(listener, pb, destroy_listener);
+	pixman_buffer_destroy(pb);
+}
+
+static struct pixman_buffer *
+pixman_buffer_get(struct wlb_pixman_renderer *pr, struct wl_resource *resource)
+{
+	struct pixman_buffer *pb;
+	struct wl_listener *listener;
+
+	listener = wl_resource_get_destroy_listener(resource,
+						    buffer_destroy_handler);
+	if (listener) {
+		pb = wl_container_of(listener, pb, destroy_listener);
+		return pb;
+	}
+
+	pb = zalloc(sizeof *pb);
+	if (!pb)
+		return NULL;
+
+	pb->renderer = pr;
+	pb->resource = resource;
+	pixman_region32_init(&pb->unconverted);
+	pb->destroy_listener.notify = buffer_destroy_handler;
+	wl_resource_add_destroy_listener(resource, &pb->destroy_listener);
+	wl_list_insert(&pr->buffer_list, &pb->link);
+
+	return pb;
+}
+
+static void
+pixman_band_composite(struct pixman_band *band)
+{
+	pixman_box32_t *rects;
+	int i, nrects;
+
+	rects = pixman_region32_rectangles(&band->region, &nrects);
+	for (i = 0; i < nrects; ++i)
+		pixman_image_composite32(PIXMAN_OP_SRC,
+					 band->src, NULL, band->dest,
+					 rects[i].x1, rects[i].y1,
+					 0, 0,
+					 rects[i].x1, rects[i].y1,
+					 rects[i].x2 - rects[i].x1,
+					 rects[i].y2 - rects[i].y1);
+}
+
+static void *
+pixman_worker_thread(void *data)
+{
+	struct pixman_worker_pool *pool = data;
+	struct pixman_band *band;
+
+	pthread_mutex_lock(&pool->mutex);
+	for (;;) {
+		while (!pool->shutdown && pool->next_band >= pool->num_bands)
+			pthread_cond_wait(&pool->work_cond, &pool->mutex);
+
+		if (pool->shutdown)
+			break;
+
+		band = &pool->bands[pool->next_band++];
+		pthread_mutex_unlock(&pool->mutex);
+
+		pixman_band_composite(band);
+
+		pthread_mutex_lock(&pool->mutex);
+		if (++pool->bands_done == pool->num_bands)
+			pthread_cond_signal(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+static void
+pixman_worker_pool_destroy(struct pixman_worker_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->num_threads; ++i)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->mutex);
+
+	free(pool->threads);
+	free(pool);
+}
+
+static struct pixman_worker_pool *
+pixman_worker_pool_create(int num_threads)
+{
+	struct pixman_worker_pool *pool;
+	sigset_t set, old_set;
+	int ret;
+
+	pool = zalloc(sizeof *pool);
+	if (!pool)
+		return NULL;
+
+	pool->threads = calloc(num_threads, sizeof *pool->threads);
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	/* Signals belong to the thread running the event loop */
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, &old_set);
+
+	for (; pool->num_threads < num_threads; pool->num_threads++) {
+		ret = pthread_create(&pool->threads[pool->num_threads], NULL,
+				     pixman_worker_thread, pool);
+		if (ret != 0) {
+			wlb_error("Failed to create worker thread: %s\n",
+				  strerror(ret));
+			break;
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old_set, NULL);
+
+	if (pool->num_threads < num_threads) {
+		pixman_worker_pool_destroy(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+/* Hands the bands out to the workers, works on them from the calling
+ * thread as well, and returns once every band has been composited. */
+static void
+pixman_worker_pool_run(struct pixman_worker_pool *pool,
+		       struct pixman_band *bands, int num_bands)
+{
+	struct pixman_band *band;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->bands = bands;
+	pool->num_bands = num_bands;
+	pool->next_band = 0;
+	pool->bands_done = 0;
+	pthread_cond_broadcast(&pool->work_cond);
+
+	while (pool->next_band < pool->num_bands) {
+		band = &pool->bands[pool->next_band++];
+		pthread_mutex_unlock(&pool->mutex);
+
+		pixman_band_composite(band);
+
+		pthread_mutex_lock(&pool->mutex);
+		pool->bands_done++;
+	}
+
+	while (pool->bands_done < pool->num_bands)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+
+	pool->bands = NULL;
+	pool->num_bands = 0;
+	pool->next_band = 0;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
 WL_EXPORT struct wlb_pixman_renderer *
 wlb_pixman_renderer_create(struct wlb_compositor *c)
 {
@@ -49,17 +545,89 @@ wlb_pixman_renderer_create(struct wlb_compositor *c)
 
 	pr->black_image = pixman_image_create_solid_fill(&color);
 
+	wl_list_init(&pr->output_list);
+	wl_list_init(&pr->buffer_list);
+
+	wlb_compositor_add_shm_format(c, WL_SHM_FORMAT_XBGR8888);
+	wlb_compositor_add_shm_format(c, WL_SHM_FORMAT_ABGR8888);
+
+	/* The chroma planes can only be checked against the pool if we
+	 * know how big it is */
+	if (c->shm_pools) {
+		wlb_compositor_add_shm_format(c, WL_SHM_FORMAT_NV12);
+		wlb_compositor_add_shm_format(c, WL_SHM_FORMAT_YUV420);
+	}
+
 	return pr;
 }
 
 WL_EXPORT void
 wlb_pixman_renderer_destroy(struct wlb_pixman_renderer *pr)
 {
+	struct pixman_output *output, *onext;
+	struct pixman_buffer *buffer, *bnext;
+
+	wl_list_for_each_safe(output, onext, &pr->output_list, link)
+		pixman_output_destroy(output);
+	wl_list_for_each_safe(buffer, bnext, &pr->buffer_list, link)
+		pixman_buffer_destroy(buffer);
+
+	if (pr->pool)
+		pixman_worker_pool_destroy(pr->pool);
+
 	pixman_image_unref(pr->black_image);
 
 	free(pr);
 }
 
+WL_EXPORT int
+wlb_pixman_renderer_set_num_threads(struct wlb_pixman_renderer *pr,
+				    int num_threads)
+{
+	if (num_threads < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (pr->pool && pr->pool->num_threads == num_threads)
+		return 0;
+
+	if (pr->pool) {
+		pixman_worker_pool_destroy(pr->pool);
+		pr->pool = NULL;
+	}
+
+	if (num_threads == 0)
+		return 0;
+
+	pr->pool = pixman_worker_pool_create(num_threads);
+	if (!pr->pool)
+		return -1;
+
+	return 0;
+}
+
+WL_EXPORT int
+wlb_pixman_renderer_set_output_filter(struct wlb_pixman_renderer *pr,
+				      struct wlb_output *output,
+				      enum wlb_pixman_filter filter)
+{
+	struct pixman_output *po;
+
+	po = pixman_output_get(pr, output);
+	if (!po)
+		return -1;
+
+	if (po->filter != filter) {
+		po->filter = filter;
+		pixman_region32_union_rect(&output->damage, &output->damage,
+					   0, 0, output->width,
+					   output->height);
+	}
+
+	return 0;
+}
+
 static void
 fill_with_black(struct wlb_pixman_renderer *pr, pixman_image_t *image,
 		pixman_region32_t *region)
@@ -79,19 +647,83 @@ fill_with_black(struct wlb_pixman_renderer *pr, pixman_image_t *image,
 					 rects[i].y2 - rects[i].y1);
 }
 
+static int
+is_yuv_format(uint32_t format)
+{
+	return format == WL_SHM_FORMAT_NV12 || format == WL_SHM_FORMAT_YUV420;
+}
+
+/* wl_shm only describes the luma plane, so the chroma planes follow it
+ * in the pool the same way weston lays them out. */
 static void
-paint_shm_buffer(pixman_image_t *image, pixman_region32_t *region,
-		 struct wl_shm_buffer *buffer,
-		 enum wl_output_transform buffer_transform,
-		 struct wlb_rectangle *pos)
+pixman_buffer_get_planes(struct pixman_buffer *pb,
+			 struct wlb_yuv_planes *planes)
+{
+	planes->y = pb->data;
+	planes->y_stride = pb->stride;
+	planes->u = planes->y + pb->stride * pb->height;
+
+	switch (pb->format) {
+	case WL_SHM_FORMAT_NV12:
+		planes->v = planes->u + 1;
+		planes->uv_stride = pb->stride;
+		planes->uv_step = 2;
+		break;
+	case WL_SHM_FORMAT_YUV420:
+	default:
+		planes->uv_stride = pb->stride / 2;
+		planes->v = planes->u + planes->uv_stride * (pb->height / 2);
+		planes->uv_step = 1;
+		break;
+	}
+}
+
+/* How far past the start of the luma plane pixman_buffer_get_planes
+ * and wlb_blit_yuv read */
+static int64_t
+yuv_buffer_size(uint32_t format, int32_t width, int32_t height,
+		int32_t stride)
+{
+	int64_t luma, uv_stride;
+
+	luma = (int64_t)stride * height;
+
+	switch (format) {
+	case WL_SHM_FORMAT_NV12:
+		return luma + (int64_t)stride * ((height - 1) / 2) +
+		       ((width + 1) / 2) * 2;
+	case WL_SHM_FORMAT_YUV420:
+	default:
+		uv_stride = stride / 2;
+		return luma + uv_stride * (height / 2) +
+		       uv_stride * ((height - 1) / 2) + (width + 1) / 2;
+	}
+}
+
+/* Makes sure pb->image wraps the current contents of the SHM buffer.  The
+ * pool backing a buffer may be resized and remapped by the client, so the
+ * wrapper is recreated whenever the data pointer or layout changes.  size
+ * is how much memory there is at data, or -1 if we don't know. */
+static int
+pixman_buffer_update_image(struct pixman_buffer *pb, void *data,
+			   uint32_t shm_format, int32_t width, int32_t height,
+			   int32_t stride, int64_t size)
 {
 	pixman_format_code_t format;
-	pixman_image_t *buffer_image;
-	pixman_transform_t transform;
-	pixman_fixed_t fw, fh;
-	uint32_t bw, bh; /* Buffer size before/after roatation */
 
-	switch(wl_shm_buffer_get_format(buffer)) {
+	if (pb->image && pb->data == data && pb->format == shm_format &&
+	    pb->width == width && pb->height == height &&
+	    pb->stride == stride)
+		return 0;
+
+	if (is_yuv_format(shm_format) &&
+	    (size < 0 ||
+	     yuv_buffer_size(shm_format, width, height, stride) > size)) {
+		wlb_error("YUV buffer does not fit in its pool\n");
+		return -1;
+	}
+
+	switch(shm_format) {
 	case WL_SHM_FORMAT_XRGB8888:
 		format = PIXMAN_x8r8g8b8;
 		break;
@@ -101,48 +733,98 @@ paint_shm_buffer(pixman_image_t *image, pixman_region32_t *region,
 	case WL_SHM_FORMAT_RGB565:
 		format = PIXMAN_r5g6b5;
 		break;
+	case WL_SHM_FORMAT_XBGR8888:
+		format = PIXMAN_x8b8g8r8;
+		break;
+	case WL_SHM_FORMAT_ABGR8888:
+		format = PIXMAN_a8b8g8r8;
+		break;
+	case WL_SHM_FORMAT_NV12:
+	case WL_SHM_FORMAT_YUV420:
+		/* pixman only ever sees the converted copy */
+		format = PIXMAN_x8r8g8b8;
+		break;
 	default:
 		printf("Unsupported SHM buffer format\n");
-		return;
+		return -1;
 	}
 
-	bw = wl_shm_buffer_get_width(buffer);
-	bh = wl_shm_buffer_get_height(buffer);
+	pixman_band_images_fini(&pb->bands);
+	if (pb->image)
+		pixman_image_unref(pb->image);
+	pb->image = NULL;
+	free(pb->converted);
+	pb->converted = NULL;
+
+	if (is_yuv_format(shm_format)) {
+		pb->converted = malloc((size_t)width * height * 4);
+		if (!pb->converted)
+			return -1;
 
-	buffer_image =
-		pixman_image_create_bits(format, bw, bh,
-					 wl_shm_buffer_get_data(buffer),
-					 wl_shm_buffer_get_stride(buffer));
+		pb->image = pixman_image_create_bits(format, width, height,
+						     pb->converted, width * 4);
+
+		pixman_region32_fini(&pb->unconverted);
+		pixman_region32_init_rect(&pb->unconverted, 0, 0,
+					  width, height);
+	} else {
+		pb->image = pixman_image_create_bits(format, width, height,
+						     data, stride);
+	}
+	if (!pb->image)
+		return -1;
+
+	pb->data = data;
+	pb->format = shm_format;
+	pb->width = width;
+	pb->height = height;
+	pb->stride = stride;
+
+	/* A new image has no transform or filter */
+	pb->placement.valid = 0;
+
+	return 0;
+}
+
+static void
+compute_buffer_transform(struct wlb_output *output,
+			 enum wl_output_transform buffer_transform,
+			 struct wlb_rectangle *pos, uint32_t bw, uint32_t bh,
+			 pixman_transform_t *transform,
+			 pixman_filter_t *filter_out)
+{
+	pixman_filter_t filter = PIXMAN_FILTER_NEAREST;
+	pixman_fixed_t fw, fh;
 
 	fw = pixman_int_to_fixed(bw);
 	fh = pixman_int_to_fixed(bh);
 
-	pixman_transform_init_identity(&transform);
+	/* Device coordinates to surface-local coordinates */
+	wlb_output_get_matrix(output, transform);
+	pixman_transform_translate(transform, NULL,
+				   pixman_int_to_fixed(-pos->x),
+				   pixman_int_to_fixed(-pos->y));
 
 	switch (buffer_transform) {
 	case WL_OUTPUT_TRANSFORM_NORMAL:
 	case WL_OUTPUT_TRANSFORM_180:
 	case WL_OUTPUT_TRANSFORM_FLIPPED:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
-		pixman_transform_scale(&transform, NULL,
+		pixman_transform_scale(transform, NULL,
 				       fw / pos->width, fh / pos->height);
 
 		if (bw != pos->width || bh != pos->height)
-			pixman_image_set_filter(buffer_image,
-						PIXMAN_FILTER_BILINEAR,
-						NULL, 0);
+			filter = PIXMAN_FILTER_BILINEAR;
 		break;
 	case WL_OUTPUT_TRANSFORM_90:
 	case WL_OUTPUT_TRANSFORM_270:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
-		pixman_transform_scale(&transform, NULL,
+		pixman_transform_scale(transform, NULL,
 				       fh / pos->width, fw / pos->height);
 
 		if (bh != pos->width || bw != pos->height)
-			pixman_image_set_filter(buffer_image,
-						PIXMAN_FILTER_BILINEAR,
-						NULL, 0);
+			filter = PIXMAN_FILTER_BILINEAR;
 		break;
 	}
 
@@ -152,18 +834,18 @@ paint_shm_buffer(pixman_image_t *image, pixman_region32_t *region,
 		break;
 	case WL_OUTPUT_TRANSFORM_90:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
-		pixman_transform_rotate(&transform, NULL, 0, pixman_fixed_1);
-		pixman_transform_translate(&transform, NULL, fw, 0);
+		pixman_transform_rotate(transform, NULL, 0, pixman_fixed_1);
+		pixman_transform_translate(transform, NULL, fw, 0);
 		break;
 	case WL_OUTPUT_TRANSFORM_180:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
-		pixman_transform_rotate(&transform, NULL, -pixman_fixed_1, 0);
-		pixman_transform_translate(&transform, NULL, fw, fh);
+		pixman_transform_rotate(transform, NULL, -pixman_fixed_1, 0);
+		pixman_transform_translate(transform, NULL, fw, fh);
 		break;
 	case WL_OUTPUT_TRANSFORM_270:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
-		pixman_transform_rotate(&transform, NULL, 0, -pixman_fixed_1);
-		pixman_transform_translate(&transform, NULL, 0, fh);
+		pixman_transform_rotate(transform, NULL, 0, -pixman_fixed_1);
+		pixman_transform_translate(transform, NULL, 0, fh);
 		break;
 	}
 
@@ -175,83 +857,684 @@ paint_shm_buffer(pixman_image_t *image, pixman_region32_t *region,
 		break;
 	case WL_OUTPUT_TRANSFORM_FLIPPED:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
-		pixman_transform_scale(&transform, NULL,
+		pixman_transform_scale(transform, NULL,
 				       -pixman_fixed_1, pixman_fixed_1);
-		pixman_transform_translate(&transform, NULL, fw, 0);
+		pixman_transform_translate(transform, NULL, fw, 0);
 		break;
 	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
 	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
-		pixman_transform_scale(&transform, NULL,
+		pixman_transform_scale(transform, NULL,
 				       pixman_fixed_1, -pixman_fixed_1);
-		pixman_transform_translate(&transform, NULL, 0, fh);
+		pixman_transform_translate(transform, NULL, 0, fh);
 		break;
 	}
 
-	pixman_image_set_transform(buffer_image, &transform);
+	*filter_out = filter;
+}
 
-	pixman_image_set_clip_region32(image, region);
+static int
+unit_coefficient(pixman_fixed_t f, int32_t *out)
+{
+	if (f == 0)
+		*out = 0;
+	else if (f == pixman_fixed_1)
+		*out = 1;
+	else if (f == -pixman_fixed_1)
+		*out = -1;
+	else
+		return 0;
 
-	pixman_image_composite32(PIXMAN_OP_SRC,
-				 buffer_image, /* src_img */
-				 NULL, /* mask_img */
-				 image, /* dest_img */
-				 0, 0, /* src_x/y */
-				 0, 0, /* mask_x/y */
-				 pos->x, pos->y, /* dest_x/y */
-				 pos->width, pos->height); /* dest_w/h */
+	return 1;
+}
 
-	pixman_image_set_clip_region32(image, NULL);
+static void
+pixman_buffer_classify_transform(struct pixman_buffer *pb)
+{
+	pixman_transform_t *t = &pb->transform;
+
+	pb->is_axis_aligned = 0;
+
+	if (t->matrix[2][0] != 0 || t->matrix[2][1] != 0 ||
+	    t->matrix[2][2] != pixman_fixed_1)
+		return;
+
+	if (pixman_fixed_frac(t->matrix[0][2]) != 0 ||
+	    pixman_fixed_frac(t->matrix[1][2]) != 0)
+		return;
 
-	pixman_image_unref(buffer_image);
+	if (!unit_coefficient(t->matrix[0][0], &pb->xx) ||
+	    !unit_coefficient(t->matrix[0][1], &pb->xy) ||
+	    !unit_coefficient(t->matrix[1][0], &pb->yx) ||
+	    !unit_coefficient(t->matrix[1][1], &pb->yy))
+		return;
+
+	if ((pb->xx == 0) == (pb->xy == 0) ||
+	    (pb->yx == 0) == (pb->yy == 0) ||
+	    (pb->xx == 0) == (pb->yx == 0))
+		return;
+
+	/* pixman samples at pixel centers, so a negative coefficient
+	 * lands us one pixel further to the left or up. */
+	pb->dx = pixman_fixed_to_int(t->matrix[0][2]);
+	if (pb->xx + pb->xy < 0)
+		pb->dx -= 1;
+	pb->dy = pixman_fixed_to_int(t->matrix[1][2]);
+	if (pb->yx + pb->yy < 0)
+		pb->dy -= 1;
+
+	pb->is_axis_aligned = 1;
 }
 
-WL_EXPORT void
-wlb_pixman_renderer_repaint_output(struct wlb_pixman_renderer *pr,
-				   struct wlb_output *output,
-				   pixman_image_t *image)
+/* Turns the output's filter policy into a pixman filter, and decides
+ * whether we can do area averaging ourselves.  compute_buffer_transform
+ * has already picked bilinear if and only if the buffer is scaled. */
+static void
+pixman_buffer_choose_filter(struct pixman_buffer *pb,
+			    enum wlb_pixman_filter policy)
+{
+	pixman_transform_t *t = &pb->transform;
+	pixman_fixed_t scale_x, scale_y;
+
+	free(pb->filter_params);
+	pb->filter_params = NULL;
+	pb->n_filter_params = 0;
+	pb->box.enabled = 0;
+	if (pb->box.scaler) {
+		wlb_box_scaler_destroy(pb->box.scaler);
+		pb->box.scaler = NULL;
+	}
+
+	if (pb->filter != PIXMAN_FILTER_BILINEAR)
+		return;
+
+	switch (policy) {
+	case WLB_PIXMAN_FILTER_NEAREST:
+		pb->filter = PIXMAN_FILTER_NEAREST;
+		return;
+	case WLB_PIXMAN_FILTER_BILINEAR:
+		return;
+	case WLB_PIXMAN_FILTER_AREA_AVERAGE:
+		break;
+	}
+
+	/* Buffer pixels per device pixel along each device axis */
+	scale_x = abs(t->matrix[0][0]) + abs(t->matrix[0][1]);
+	scale_y = abs(t->matrix[1][0]) + abs(t->matrix[1][1]);
+	if (scale_x <= pixman_fixed_1 && scale_y <= pixman_fixed_1)
+		return;
+
+	if (t->matrix[0][1] == 0 && t->matrix[1][0] == 0 &&
+	    t->matrix[0][0] > 0 && t->matrix[1][1] > 0 &&
+	    t->matrix[2][0] == 0 && t->matrix[2][1] == 0 &&
+	    t->matrix[2][2] == pixman_fixed_1) {
+		pb->box.enabled = 1;
+		pb->box.sx = pixman_fixed_to_double(t->matrix[0][0]);
+		pb->box.sy = pixman_fixed_to_double(t->matrix[1][1]);
+		pb->box.tx = pixman_fixed_to_double(t->matrix[0][2]);
+		pb->box.ty = pixman_fixed_to_double(t->matrix[1][2]);
+	}
+
+	/* Rotated buffers, and any pixels the box scaler can't handle,
+	 * still get averaged by pixman, just more slowly. */
+	pb->filter_params =
+		pixman_filter_create_separable_convolution(&pb->n_filter_params,
+							   scale_x, scale_y,
+							   PIXMAN_KERNEL_BOX,
+							   PIXMAN_KERNEL_BOX,
+							   PIXMAN_KERNEL_BOX,
+							   PIXMAN_KERNEL_BOX,
+							   4, 4);
+	if (pb->filter_params)
+		pb->filter = PIXMAN_FILTER_SEPARABLE_CONVOLUTION;
+	else
+		pb->n_filter_params = 0;
+}
+
+/* Sets up the transform and filter for the given placement.  Both are
+ * kept on the cached image, so this is a no-op in the steady state. */
+static void
+pixman_buffer_update_placement(struct pixman_buffer *pb,
+			       struct wlb_output *output,
+			       enum wl_output_transform buffer_transform,
+			       struct wlb_rectangle *pos,
+			       enum wlb_pixman_filter filter)
+{
+	if (pb->placement.valid &&
+	    pb->placement.filter == filter &&
+	    pb->placement.output_transform == output->physical.transform &&
+	    pb->placement.mode_width == output->current_mode->width &&
+	    pb->placement.mode_height == output->current_mode->height &&
+	    pb->placement.buffer_transform == buffer_transform &&
+	    pb->placement.pos.x == pos->x &&
+	    pb->placement.pos.y == pos->y &&
+	    pb->placement.pos.width == pos->width &&
+	    pb->placement.pos.height == pos->height)
+		return;
+
+	compute_buffer_transform(output, buffer_transform, pos,
+				 pb->width, pb->height,
+				 &pb->transform, &pb->filter);
+	pixman_buffer_classify_transform(pb);
+	pixman_buffer_choose_filter(pb, filter);
+
+	pixman_image_set_transform(pb->image, &pb->transform);
+	pixman_image_set_filter(pb->image, pb->filter,
+				pb->filter_params, pb->n_filter_params);
+	pb->bands_placed = 0;
+
+	pb->placement.valid = 1;
+	pb->placement.output_transform = output->physical.transform;
+	pb->placement.mode_width = output->current_mode->width;
+	pb->placement.mode_height = output->current_mode->height;
+	pb->placement.buffer_transform = buffer_transform;
+	pb->placement.pos = *pos;
+	pb->placement.filter = filter;
+}
+
+/* Copies the region straight out of the SHM buffer when it lands on the
+ * output unscaled, which covers the common case as well as rotated
+ * kiosk displays.  Returns -1 if the copy can't be done this way. */
+static int
+composite_blit(struct pixman_buffer *pb, pixman_image_t *image,
+	       pixman_region32_t *region)
+{
+	pixman_format_code_t dest_format;
+	pixman_box32_t *extents, *rects;
+	struct wlb_yuv_planes planes;
+	uint8_t *src, *dest;
+	int32_t dest_stride, sx1, sy1, sx2, sy2, w, h;
+	int i, nrects, set_alpha, yuv;
+
+	if (!pb->is_axis_aligned)
+		return -1;
+
+	/* YUV is converted on the way through, but only unrotated */
+	yuv = is_yuv_format(pb->format);
+	if (yuv && (pb->xx != 1 || pb->yy != 1))
+		return -1;
+
+	if (!yuv && pb->format != WL_SHM_FORMAT_XRGB8888 &&
+	    pb->format != WL_SHM_FORMAT_ARGB8888)
+		return -1;
+
+	dest_format = pixman_image_get_format(image);
+	if (dest_format == PIXMAN_x8r8g8b8)
+		set_alpha = 0;
+	else if (dest_format == PIXMAN_a8r8g8b8)
+		set_alpha = pb->format == WL_SHM_FORMAT_XRGB8888;
+	else
+		return -1;
+
+	/* Anything outside the buffer has to come out transparent, which
+	 * is pixman's job. */
+	extents = pixman_region32_extents(region);
+	sx1 = pb->xx * extents->x1 + pb->xy * extents->y1 + pb->dx;
+	sy1 = pb->yx * extents->x1 + pb->yy * extents->y1 + pb->dy;
+	sx2 = pb->xx * (extents->x2 - 1) + pb->xy * (extents->y2 - 1) + pb->dx;
+	sy2 = pb->yx * (extents->x2 - 1) + pb->yy * (extents->y2 - 1) + pb->dy;
+	if (WLB_MIN(sx1, sx2) < 0 || WLB_MAX(sx1, sx2) >= pb->width ||
+	    WLB_MIN(sy1, sy2) < 0 || WLB_MAX(sy1, sy2) >= pb->height)
+		return -1;
+
+	dest = (uint8_t *)pixman_image_get_data(image);
+	dest_stride = pixman_image_get_stride(image);
+
+	if (yuv)
+		pixman_buffer_get_planes(pb, &planes);
+
+	rects = pixman_region32_rectangles(region, &nrects);
+	for (i = 0; i < nrects; ++i) {
+		if (yuv) {
+			wlb_blit_yuv(dest + rects[i].y1 * dest_stride +
+				     rects[i].x1 * 4, dest_stride, &planes,
+				     rects[i].x1 + pb->dx, rects[i].y1 + pb->dy,
+				     rects[i].x2 - rects[i].x1,
+				     rects[i].y2 - rects[i].y1);
+			continue;
+		}
+
+		sx1 = pb->xx * rects[i].x1 + pb->xy * rects[i].y1 + pb->dx;
+		sy1 = pb->yx * rects[i].x1 + pb->yy * rects[i].y1 + pb->dy;
+		src = (uint8_t *)pb->data + sy1 * pb->stride + sx1 * 4;
+		w = rects[i].x2 - rects[i].x1;
+		h = rects[i].y2 - rects[i].y1;
+
+		if (pb->xx == 1 && pb->yy == 1)
+			wlb_blit_32(dest + rects[i].y1 * dest_stride +
+				    rects[i].x1 * 4, dest_stride,
+				    src, pb->stride, w, h, set_alpha);
+		else
+			wlb_blit_32_rotated(dest + rects[i].y1 * dest_stride +
+					    rects[i].x1 * 4, dest_stride, src,
+					    pb->xx * 4 + pb->yx * pb->stride,
+					    pb->xy * 4 + pb->yy * pb->stride,
+					    w, h, set_alpha);
+	}
+
+	return 0;
+}
+
+/* Downscales the buffer into the region with a wlb_box_scaler.  Returns
+ * -1 if the buffer can't be handled that way. */
+static int
+composite_box(struct pixman_buffer *pb, pixman_image_t *image,
+	      pixman_region32_t *region)
+{
+	pixman_format_code_t src_format, dest_format;
+	pixman_box32_t *rects;
+	uint8_t *dest;
+	int32_t dest_stride;
+	int i, nrects, set_alpha;
+
+	if (!pb->box.enabled)
+		return -1;
+
+	src_format = pixman_image_get_format(pb->image);
+	if (src_format != PIXMAN_x8r8g8b8 && src_format != PIXMAN_a8r8g8b8)
+		return -1;
+
+	dest_format = pixman_image_get_format(image);
+	if (dest_format == PIXMAN_x8r8g8b8)
+		set_alpha = 0;
+	else if (dest_format == PIXMAN_a8r8g8b8)
+		set_alpha = src_format == PIXMAN_x8r8g8b8;
+	else
+		return -1;
+
+	if (!pb->box.scaler)
+		pb->box.scaler =
+			wlb_box_scaler_create(pb->placement.mode_width,
+					      pb->placement.mode_height,
+					      pb->width, pb->height,
+					      pb->box.tx, pb->box.ty,
+					      pb->box.sx, pb->box.sy);
+	if (!pb->box.scaler)
+		return -1;
+
+	dest = (uint8_t *)pixman_image_get_data(image);
+	dest_stride = pixman_image_get_stride(image);
+
+	rects = pixman_region32_rectangles(region, &nrects);
+	for (i = 0; i < nrects; ++i)
+		wlb_box_scaler_scale_32(pb->box.scaler,
+					dest + rects[i].y1 * dest_stride +
+					rects[i].x1 * 4, dest_stride,
+					pixman_image_get_data(pb->image),
+					pixman_image_get_stride(pb->image),
+					rects[i].x1, rects[i].y1,
+					rects[i].x2 - rects[i].x1,
+					rects[i].y2 - rects[i].y1, set_alpha);
+
+	return 0;
+}
+
+static uint64_t
+region_area(pixman_region32_t *region)
 {
+	pixman_box32_t *rects;
+	uint64_t area = 0;
+	int i, nrects;
+
+	rects = pixman_region32_rectangles(region, &nrects);
+	for (i = 0; i < nrects; ++i)
+		area += (uint64_t)(rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1);
+
+	return area;
+}
+
+/* Splits the region into one horizontal band per thread (counting the
+ * caller) and composites them in parallel.  Returns -1 without touching
+ * the destination if the region is too small to be worth it or if we
+ * fail to set the bands up. */
+static int
+composite_banded(struct pixman_worker_pool *pool, struct pixman_buffer *pb,
+		 struct pixman_output_image *oi, pixman_region32_t *region)
+{
+	struct pixman_band *bands;
+	pixman_image_t **src, **dest;
+	pixman_box32_t *extents;
+	int i, num_bands;
+	int32_t y1, y2;
+
+	if (region_area(region) < PIXMAN_BAND_MIN_PIXELS)
+		return -1;
+
+	num_bands = pool->num_threads + 1;
+
+	if (pb->bands.count != num_bands)
+		pb->bands_placed = 0;
+	src = pixman_band_images_get(&pb->bands, pb->image, num_bands);
+	dest = pixman_band_images_get(&oi->bands, oi->image, num_bands);
+	if (!src || !dest)
+		return -1;
+
+	if (!pb->bands_placed) {
+		for (i = 0; i < num_bands; ++i) {
+			pixman_image_set_transform(src[i], &pb->transform);
+			pixman_image_set_filter(src[i], pb->filter,
+						pb->filter_params,
+						pb->n_filter_params);
+		}
+		pb->bands_placed = 1;
+	}
+
+	bands = calloc(num_bands, sizeof *bands);
+	if (!bands)
+		return -1;
+
+	extents = pixman_region32_extents(region);
+	for (i = 0; i < num_bands; ++i) {
+		y1 = extents->y1 +
+		     (int64_t)(extents->y2 - extents->y1) * i / num_bands;
+		y2 = extents->y1 +
+		     (int64_t)(extents->y2 - extents->y1) * (i + 1) / num_bands;
+
+		pixman_region32_init(&bands[i].region);
+		pixman_region32_intersect_rect(&bands[i].region, region,
+					       extents->x1, y1,
+					       extents->x2 - extents->x1,
+					       y2 - y1);
+
+		bands[i].src = src[i];
+		bands[i].dest = dest[i];
+	}
+
+	pixman_worker_pool_run(pool, bands, num_bands);
+
+	for (i = 0; i < num_bands; ++i)
+		pixman_region32_fini(&bands[i].region);
+	free(bands);
+
+	return 0;
+}
+
+static void
+paint_buffer_image(struct wlb_pixman_renderer *pr, struct pixman_buffer *pb,
+		   struct pixman_output_image *oi, pixman_region32_t *region,
+		   enum wl_output_transform buffer_transform,
+		   struct wlb_output *output, struct wlb_rectangle *pos,
+		   enum wlb_pixman_filter filter)
+{
+	pixman_image_t *image = oi->image;
+	struct wlb_yuv_planes planes;
+	pixman_box32_t *rects;
+	int i, nrects;
+
+	pixman_buffer_update_placement(pb, output, buffer_transform, pos,
+				       filter);
+
+	if (composite_blit(pb, image, region) == 0)
+		return;
+
+	/* Scaled or rotated YUV goes through pixman as RGB */
+	if (is_yuv_format(pb->format) &&
+	    pixman_region32_not_empty(&pb->unconverted)) {
+		pixman_buffer_get_planes(pb, &planes);
+		pixman_region32_intersect_rect(&pb->unconverted,
+					       &pb->unconverted, 0, 0,
+					       pb->width, pb->height);
+		rects = pixman_region32_rectangles(&pb->unconverted, &nrects);
+		for (i = 0; i < nrects; ++i)
+			wlb_blit_yuv((uint8_t *)pb->converted +
+				     rects[i].y1 * pb->width * 4 +
+				     rects[i].x1 * 4, pb->width * 4, &planes,
+				     rects[i].x1, rects[i].y1,
+				     rects[i].x2 - rects[i].x1,
+				     rects[i].y2 - rects[i].y1);
+		pixman_region32_clear(&pb->unconverted);
+	}
+
+	if (composite_box(pb, image, region) == 0)
+		return;
+
+	if (pr->pool && composite_banded(pr->pool, pb, oi, region) == 0)
+		return;
+
+	/* The transform takes care of placement so we can composite each
+	 * rectangle of the region at its device coordinates directly. */
+	rects = pixman_region32_rectangles(region, &nrects);
+	for (i = 0; i < nrects; ++i)
+		pixman_image_composite32(PIXMAN_OP_SRC,
+					 pb->image, /* src_img */
+					 NULL, /* mask_img */
+					 image, /* dest_img */
+					 rects[i].x1, rects[i].y1, /* src_x/y */
+					 0, 0, /* mask_x/y */
+					 rects[i].x1, rects[i].y1, /* dest_x/y */
+					 rects[i].x2 - rects[i].x1, /* dest_w */
+					 rects[i].y2 - rects[i].y1); /* dest_h */
+}
+
+/* Buffers other than SHM are only usable if their type can map them */
+static int
+buffer_is_mappable(struct wlb_compositor *comp, struct wl_resource *buffer)
+{
+	const struct wlb_buffer_type *type;
+	void *type_data;
+	size_t type_size;
+
+	if (wl_shm_buffer_get(buffer))
+		return 1;
+
+	type = wlb_compositor_get_buffer_type(comp, buffer,
+					      &type_data, &type_size);
+	return type && type->mmap;
+}
+
+static int
+paint_buffer(struct wlb_pixman_renderer *pr, struct pixman_output_image *oi,
+	     pixman_region32_t *region, struct wlb_surface *surface,
+	     struct wlb_output *output, struct wlb_rectangle *pos,
+	     enum wlb_pixman_filter filter)
+{
+	struct wl_resource *resource = surface->buffer;
+	struct pixman_buffer *pb;
+	struct wl_shm_buffer *shm_buffer;
+	const struct wlb_buffer_type *type = NULL;
+	void *type_data, *data;
+	size_t type_size;
+	uint32_t format, stride;
 	int32_t width, height;
-	pixman_region32_t damage, surface_damage;
-	struct wl_shm_buffer *buffer;
-	pixman_transform_t transform;
-	struct wlb_rectangle pos;
+	int err;
 
-	if (!output->current_mode)
+	pb = pixman_buffer_get(pr, resource);
+	if (!pb)
+		return -1;
+
+	shm_buffer = wl_shm_buffer_get(resource);
+	if (shm_buffer) {
+		err = pixman_buffer_update_image(pb,
+				wl_shm_buffer_get_data(shm_buffer),
+				wl_shm_buffer_get_format(shm_buffer),
+				wl_shm_buffer_get_width(shm_buffer),
+				wl_shm_buffer_get_height(shm_buffer),
+				wl_shm_buffer_get_stride(shm_buffer),
+				wlb_shm_buffer_get_pool_space(resource));
+	} else {
+		type = wlb_compositor_get_buffer_type(surface->compositor,
+						      resource, &type_data,
+						      &type_size);
+		if (wlb_compositor_get_buffer_size(surface->compositor,
+						   resource,
+						   &width, &height) < 0)
+			return -1;
+
+		data = type->mmap(type_data, resource, &stride, &format);
+		if (!data) {
+			wlb_error("Failed to map buffer\n");
+			return -1;
+		}
+
+		err = pixman_buffer_update_image(pb, data, format,
+						 width, height, stride, -1);
+	}
+
+	if (err == 0)
+		paint_buffer_image(pr, pb, oi, region,
+				   wlb_surface_buffer_transform(surface),
+				   output, pos, filter);
+
+	if (type && type->munmap)
+		type->munmap(type_data, resource, data);
+
+	return err;
+}
+
+/* Surface damage is relative to whatever the surface showed before, so
+ * it applies to every converted YUV buffer that may be shown again and
+ * not just to the current one. */
+static void
+add_surface_damage(struct wlb_pixman_renderer *pr, struct wlb_surface *surface)
+{
+	struct pixman_buffer *pb;
+	struct wlb_rectangle *rects;
+	int i, nrects;
+
+	rects = wlb_surface_get_buffer_damage(surface, &nrects);
+	if (nrects == 0)
 		return;
 
+	wl_list_for_each(pb, &pr->buffer_list, link) {
+		if (!pb->converted)
+			continue;
+
+		if (!rects) {
+			pixman_region32_union_rect(&pb->unconverted,
+						   &pb->unconverted, 0, 0,
+						   pb->width, pb->height);
+			continue;
+		}
+
+		for (i = 0; i < nrects; ++i)
+			pixman_region32_union_rect(&pb->unconverted,
+						   &pb->unconverted,
+						   rects[i].x, rects[i].y,
+						   rects[i].width,
+						   rects[i].height);
+	}
+
+	free(rects);
+}
+
+/* Fills everything outside of the surface with black unless this image
+ * already has the same letterbox. */
+static void
+paint_letterbox(struct wlb_pixman_renderer *pr,
+		struct pixman_output_image *oi, struct wlb_output *output,
+		pixman_box32_t *surface, pixman_region32_t *repainted)
+{
+	pixman_region32_t black, hole;
+	int32_t width, height;
+
 	width = output->current_mode->width;
 	height = output->current_mode->height;
 
-	pixman_region32_init_rect(&damage, 0, 0, width, height);
+	if (oi->letterbox.valid &&
+	    oi->letterbox.transform == output->physical.transform &&
+	    oi->letterbox.mode_width == width &&
+	    oi->letterbox.mode_height == height &&
+	    oi->letterbox.surface.x1 == surface->x1 &&
+	    oi->letterbox.surface.y1 == surface->y1 &&
+	    oi->letterbox.surface.x2 == surface->x2 &&
+	    oi->letterbox.surface.y2 == surface->y2)
+		return;
+
+	pixman_region32_init_rect(&black, 0, 0, width, height);
+	pixman_region32_init_rects(&hole, surface, 1);
+	pixman_region32_subtract(&black, &black, &hole);
+	pixman_region32_fini(&hole);
 
-	wlb_output_get_matrix(output, &transform);
-	pixman_image_set_transform(image, &transform);
+	fill_with_black(pr, oi->image, &black);
+	pixman_region32_union(repainted, repainted, &black);
+	pixman_region32_fini(&black);
 
-	if (output->surface.surface && output->surface.surface->buffer) {
+	oi->letterbox.valid = 1;
+	oi->letterbox.transform = output->physical.transform;
+	oi->letterbox.mode_width = width;
+	oi->letterbox.mode_height = height;
+	oi->letterbox.surface = *surface;
+}
+
+WL_EXPORT void
+wlb_pixman_renderer_repaint_output_with_damage(struct wlb_pixman_renderer *pr,
+					       struct wlb_output *output,
+					       pixman_image_t *image,
+					       pixman_region32_t *repainted)
+{
+	struct pixman_output *po;
+	struct pixman_output_image *oi;
+	struct wlb_surface *surface;
+	pixman_region32_t damage, surface_region;
+	pixman_box32_t surface_box = { 0, 0, 0, 0 };
+	struct wlb_rectangle pos;
+
+	if (!output->current_mode)
+		return;
+
+	po = pixman_output_get(pr, output);
+	if (!po)
+		return;
+
+	oi = pixman_output_get_image(po, output, image);
+	if (!oi)
+		return;
+
+	pixman_region32_init(&damage);
+
+	surface = output->surface.surface;
+	if (surface)
+		add_surface_damage(pr, surface);
+
+	if (surface && surface->buffer &&
+	    buffer_is_mappable(surface->compositor, surface->buffer)) {
 		pos.x = output->surface.position.x * output->scale;
 		pos.y = output->surface.position.y * output->scale;
 		pos.width = output->surface.position.width * output->scale;
 		pos.height = output->surface.position.height * output->scale;
 
-		pixman_region32_init_rect(&surface_damage,
-					  pos.x,
-					  pos.y,
-					  pos.width,
-					  pos.height);
-
-		buffer = wl_shm_buffer_get(output->surface.surface->buffer);
-		assert(buffer);
+		pixman_region32_init_rect(&surface_region,
+					  output->surface.position.x,
+					  output->surface.position.y,
+					  output->surface.position.width,
+					  output->surface.position.height);
+		wlb_output_transform_region(output, &surface_region,
+					    &surface_region);
+		surface_box = *pixman_region32_extents(&surface_region);
 
-		paint_shm_buffer(image, &surface_damage, buffer,
-				 wlb_surface_buffer_transform(output->surface.surface),
-				 &pos);
+		pixman_region32_intersect(&damage, &surface_region,
+					  &oi->damage);
+		/* Don't leave whatever was there before behind a buffer
+		 * we can't show */
+		if (pixman_region32_not_empty(&damage) &&
+		    paint_buffer(pr, oi, &damage, surface,
+				 output, &pos, po->filter) < 0)
+			fill_with_black(pr, oi->image, &damage);
 
-		pixman_region32_subtract(&damage, &damage, &surface_damage);
-		pixman_region32_fini(&surface_damage);
+		pixman_region32_fini(&surface_region);
+	} else if (surface && surface->buffer) {
+		wlb_error("pixman renderer only supports CPU-mappable buffers\n");
 	}
 
-	fill_with_black(pr, image, &damage);
+	paint_letterbox(pr, oi, output, &surface_box, &damage);
+
+	pixman_region32_clear(&oi->damage);
+
+	/* Surface damage has already been accumulated into the output
+	 * damage by the time we get here. */
+	if (surface)
+		wlb_surface_reset_damage(surface);
+
+	if (repainted)
+		pixman_region32_copy(repainted, &damage);
 
 	pixman_region32_fini(&damage);
 }
 
+WL_EXPORT void
+wlb_pixman_renderer_repaint_output(struct wlb_pixman_renderer *pr,
+				   struct wlb_output *output,
+				   pixman_image_t *image)
+{
+	wlb_pixman_renderer_repaint_output_with_damage(pr, output, image, NULL);
+}
@@ -0,0 +1,258 @@
+/*
+ * Copyright © 2013 Jason Ekstrand
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+#include "wlb-private.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/* libwayland only checks that the first plane of a wl_shm buffer fits in
+ * its pool and never tells us how big the pool is.  We get the sizes by
+ * watching the create_pool, resize and create_buffer requests go by and
+ * attach them to the resources those requests create. */
+
+struct shm_client {
+	struct wlb_shm_pools *pools;
+	struct wl_list link;
+
+	struct wl_listener destroy_listener;
+	struct wl_listener resource_created_listener;
+};
+
+/* The pool size for wl_shm_pool, and what of the pool lies past the
+ * start of the buffer for wl_buffer */
+struct shm_object {
+	struct wl_list link;
+	struct wl_listener destroy_listener;
+
+	int32_t size;
+};
+
+struct wlb_shm_pools {
+	struct wl_display *display;
+	struct wl_protocol_logger *logger;
+	struct wl_listener client_created_listener;
+
+	struct wl_list client_list;
+	struct wl_list object_list;
+
+	/* Set by the request about to create a resource of this class */
+	const char *pending_class;
+	int32_t pending_size;
+};
+
+static void
+shm_object_destroy(struct shm_object *object)
+{
+	wl_list_remove(&object->destroy_listener.link);
+	wl_list_remove(&object->link);
+	free(object);
+}
+
+static void
+shm_object_destroyed(struct wl_listener *listener, void *data)
+{
+	struct shm_object *object;
+
+	object = wl_container_of(listener, object, destroy_listener);
+	shm_object_destroy(object);
+}
+
+static struct shm_object *
+shm_object_get(struct wl_resource *resource)
+{
+	struct shm_object *object;
+	struct wl_listener *listener;
+
+	listener = wl_resource_get_destroy_listener(resource,
+						    shm_object_destroyed);
+	if (!listener)
+		return NULL;
+
+	return wl_container_of(listener, object, destroy_listener);
+}
+
+static void
+shm_resource_created(struct wl_listener *listener, void *data)
+{
+	struct shm_client *client;
+	struct wlb_shm_pools *pools;
+	struct wl_resource *resource = data;
+	struct shm_object *object;
+
+	client = wl_container_of(listener, client, resource_created_listener);
+	pools = client->pools;
+
+	if (!pools->pending_class ||
+	    strcmp(wl_resource_get_class(resource), pools->pending_class))
+		return;
+
+	pools->pending_class = NULL;
+
+	object = zalloc(sizeof *object);
+	if (!object)
+		return;
+
+	object->size = pools->pending_size;
+	object->destroy_listener.notify = shm_object_destroyed;
+	wl_resource_add_destroy_listener(resource, &object->destroy_listener);
+	wl_list_insert(&pools->object_list, &object->link);
+}
+
+static void
+shm_client_destroy(struct shm_client *client)
+{
+	wl_list_remove(&client->resource_created_listener.link);
+	wl_list_remove(&client->destroy_listener.link);
+	wl_list_remove(&client->link);
+	free(client);
+}
+
+static void
+shm_client_destroyed(struct wl_listener *listener, void *data)
+{
+	struct shm_client *client;
+
+	client = wl_container_of(listener, client, destroy_listener);
+	shm_client_destroy(client);
+}
+
+static void
+shm_client_created(struct wl_listener *listener, void *data)
+{
+	struct wlb_shm_pools *pools;
+	struct shm_client *client;
+
+	pools = wl_container_of(listener, pools, client_created_listener);
+
+	client = zalloc(sizeof *client);
+	if (!client)
+		return;
+
+	client->pools = pools;
+	client->destroy_listener.notify = shm_client_destroyed;
+	wl_client_add_destroy_listener(data, &client->destroy_listener);
+	client->resource_created_listener.notify = shm_resource_created;
+	wl_client_add_resource_created_listener(data,
+					&client->resource_created_listener);
+	wl_list_insert(&pools->client_list, &client->link);
+}
+
+/* Requests are logged right before they are dispatched, so whatever we
+ * note down here is picked up by the resource the request creates. */
+static void
+shm_protocol_logger(void *data, enum wl_protocol_logger_type type,
+		    const struct wl_protocol_logger_message *message)
+{
+	struct wlb_shm_pools *pools = data;
+	struct shm_object *pool;
+	const char *class, *name;
+
+	if (type != WL_PROTOCOL_LOGGER_REQUEST)
+		return;
+
+	pools->pending_class = NULL;
+
+	class = wl_resource_get_class(message->resource);
+	name = message->message->name;
+
+	if (strcmp(class, "wl_shm") == 0) {
+		if (strcmp(name, "create_pool") == 0) {
+			pools->pending_class = "wl_shm_pool";
+			pools->pending_size = message->arguments[2].i;
+		}
+		return;
+	}
+
+	if (strcmp(class, "wl_shm_pool") != 0)
+		return;
+
+	pool = shm_object_get(message->resource);
+	if (!pool)
+		return;
+
+	if (strcmp(name, "resize") == 0) {
+		/* Pools can only grow */
+		pool->size = WLB_MAX(pool->size, message->arguments[0].i);
+	} else if (strcmp(name, "create_buffer") == 0) {
+		pools->pending_class = "wl_buffer";
+		pools->pending_size = pool->size - message->arguments[1].i;
+	}
+}
+
+struct wlb_shm_pools *
+wlb_shm_pools_create(struct wl_display *display)
+{
+	struct wlb_shm_pools *pools;
+
+	pools = zalloc(sizeof *pools);
+	if (!pools)
+		return NULL;
+
+	pools->display = display;
+	wl_list_init(&pools->client_list);
+	wl_list_init(&pools->object_list);
+
+	pools->logger = wl_display_add_protocol_logger(display,
+						       shm_protocol_logger,
+						       pools);
+	if (!pools->logger) {
+		free(pools);
+		return NULL;
+	}
+
+	pools->client_created_listener.notify = shm_client_created;
+	wl_display_add_client_created_listener(display,
+					       &pools->client_created_listener);
+
+	return pools;
+}
+
+void
+wlb_shm_pools_destroy(struct wlb_shm_pools *pools)
+{
+	struct shm_client *client, *cnext;
+	struct shm_object *object, *onext;
+
+	wl_list_for_each_safe(object, onext, &pools->object_list, link)
+		shm_object_destroy(object);
+	wl_list_for_each_safe(client, cnext, &pools->client_list, link)
+		shm_client_destroy(client);
+
+	wl_list_remove(&pools->client_created_listener.link);
+	wl_protocol_logger_destroy(pools->logger);
+	free(pools);
+}
+
+int32_t
+wlb_shm_buffer_get_pool_space(struct wl_resource *buffer)
+{
+	struct shm_object *object;
+
+	if (!wl_shm_buffer_get(buffer))
+		return -1;
+
+	object = shm_object_get(buffer);
+	if (!object)
+		return -1;
+
+	return object->size;
+}
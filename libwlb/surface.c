@@ -155,9 +155,6 @@ static void
 surface_commit(struct wl_client *client, struct wl_resource *resource)
 {
 	struct wlb_surface *surface = wl_resource_get_user_data(resource);
-	const struct wlb_buffer_type *type;
-	void *buffer_type_data;
-	size_t buffer_type_size;
 	int32_t bwidth, bheight;
 
 	if (surface->buffer) {
@@ -175,14 +172,9 @@ surface_commit(struct wl_client *client, struct wl_resource *resource)
 		bwidth = 0;
 		bheight = 0;
 	} else {
-		type = wlb_compositor_get_buffer_type(surface->compositor,
-						      surface->buffer,
-						      &buffer_type_data,
-						      &buffer_type_size);
-		if (type) {
-			type->get_size(buffer_type_data, surface->buffer,
-				       &bwidth, &bheight);
-		} else {
+		if (wlb_compositor_get_buffer_size(surface->compositor,
+						   surface->buffer,
+						   &bwidth, &bheight) < 0) {
 			wlb_warn("Unknown buffer type\n");
 			bwidth = -1;
 			bheight = -1;
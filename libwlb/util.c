@@ -29,6 +29,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/stat.h>
 
 static inline int
 set_cloexec_or_close(int fd)
@@ -118,6 +119,61 @@ wlb_util_create_tmpfile(size_t size)
 	return fd;
 }
 
+static int
+ensure_dir(const char *path)
+{
+	if (mkdir(path, 0700) < 0 && errno != EEXIST)
+		return -1;
+
+	return 0;
+}
+
+/* Returns the directory libwlb should keep its caches in, creating it if
+ * needed.  The caller frees the returned string. */
+char *
+wlb_util_get_cache_dir(void)
+{
+	const char *base;
+	char *path;
+	size_t len;
+
+	base = getenv("XDG_CACHE_HOME");
+	if (base && base[0] == '/') {
+		len = strlen(base) + sizeof "/libwlb";
+		path = malloc(len);
+		if (!path)
+			return NULL;
+
+		snprintf(path, len, "%s", base);
+	} else {
+		base = getenv("HOME");
+		if (!base) {
+			errno = ENOENT;
+			return NULL;
+		}
+
+		len = strlen(base) + sizeof "/.cache/libwlb";
+		path = malloc(len);
+		if (!path)
+			return NULL;
+
+		snprintf(path, len, "%s/.cache", base);
+	}
+
+	if (ensure_dir(path) < 0)
+		goto err;
+
+	strcat(path, "/libwlb");
+	if (ensure_dir(path) < 0)
+		goto err;
+
+	return path;
+
+err:
+	free(path);
+	return NULL;
+}
+
 static int
 default_log_func(enum wlb_log_level level, const char *format, va_list ap)
 {
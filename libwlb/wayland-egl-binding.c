@@ -44,10 +44,17 @@ struct wayland_buffer_type {
 };
 
 struct wayland_buffer {
+	struct wlb_wayland_egl_binding *binding;
+
 	struct wl_list link;
 	struct wl_resource *buffer;
-	int ref_count;
+	struct wl_listener destroy_listener;
+
+	/* NULL if the buffer is not an EGL buffer */
+	struct wayland_buffer_type *type;
+	int32_t width, height;
 
+	int num_images;
 	EGLImageKHR images[3];
 };
 
@@ -73,85 +80,126 @@ struct wlb_wayland_egl_binding {
 	struct wayland_buffer_type type_y_xuxv;
 };
 
-static int
-is_wayland_rgba(void *data, struct wl_resource *buffer)
+static void
+wayland_buffer_destroy(struct wayland_buffer *buffer)
 {
-	struct wayland_buffer_type *type = data;
-	EGLint format;
-	EGLBoolean success;
-
-	success = type->binding->query_buffer(type->binding->egl_display,
-					      (void *) buffer,
-					      EGL_TEXTURE_FORMAT, &format);
-	return success &&
-	       (format == EGL_TEXTURE_RGB || format == EGL_TEXTURE_RGBA);
+	struct wlb_wayland_egl_binding *binding = buffer->binding;
+	int i;
+
+	for (i = 0; i < buffer->num_images; i++)
+		if (buffer->images[i] != EGL_NO_IMAGE_KHR)
+			binding->destroy_image(binding->egl_display,
+					       buffer->images[i]);
+
+	wl_list_remove(&buffer->destroy_listener.link);
+	wl_list_remove(&buffer->link);
+	free(buffer);
 }
 
-static int
-is_wayland_external(void *data, struct wl_resource *buffer)
+static void
+wayland_buffer_destroyed(struct wl_listener *listener, void *data)
 {
-	struct wayland_buffer_type *type = data;
-	EGLint format;
-	EGLBoolean success;
+	struct wayland_buffer *buffer;
 
-	success = type->binding->query_buffer(type->binding->egl_display,
-					      (void *) buffer,
-					      EGL_TEXTURE_FORMAT, &format);
-	return success && format == EGL_TEXTURE_EXTERNAL_WL;
+	buffer = wl_container_of(listener, buffer, destroy_listener);
+	wayland_buffer_destroy(buffer);
 }
 
-static int
-is_wayland_y_uv(void *data, struct wl_resource *buffer)
+static struct wayland_buffer_type *
+wayland_buffer_type_for_format(struct wlb_wayland_egl_binding *binding,
+			       EGLint format)
 {
-	struct wayland_buffer_type *type = data;
-	EGLint format;
-	EGLBoolean success;
-
-	success = type->binding->query_buffer(type->binding->egl_display,
-					      (void *) buffer,
-					      EGL_TEXTURE_FORMAT, &format);
-	return success && format == EGL_TEXTURE_Y_UV_WL;
+	switch (format) {
+	case EGL_TEXTURE_RGB:
+	case EGL_TEXTURE_RGBA:
+		return &binding->type_rgba;
+	case EGL_TEXTURE_EXTERNAL_WL:
+		return &binding->type_external;
+	case EGL_TEXTURE_Y_UV_WL:
+		return &binding->type_y_uv;
+	case EGL_TEXTURE_Y_U_V_WL:
+		return &binding->type_y_u_v;
+	case EGL_TEXTURE_Y_XUXV_WL:
+		return &binding->type_y_xuxv;
+	default:
+		return NULL;
+	}
 }
 
-static int
-is_wayland_y_u_v(void *data, struct wl_resource *buffer)
+/* Every wl_buffer we are asked about gets classified exactly once.  The
+ * format and size are cached alongside the buffer's EGLImages, which
+ * live as long as the wl_buffer so that attaching the same buffer again
+ * does no driver work beyond the texture bind.  Buffers that are not
+ * EGL buffers are remembered as well so that the other buffer types do
+ * not pay for a failed query on every lookup. */
+static struct wayland_buffer *
+wayland_buffer_get(struct wlb_wayland_egl_binding *binding,
+		   struct wl_resource *buffer_res)
 {
-	struct wayland_buffer_type *type = data;
-	EGLint format;
-	EGLBoolean success;
+	struct wayland_buffer *buffer;
+	struct wl_listener *listener;
+	EGLint format, width, height;
+
+	listener = wl_resource_get_destroy_listener(buffer_res,
+						    wayland_buffer_destroyed);
+	if (listener)
+		return wl_container_of(listener, buffer, destroy_listener);
+
+	buffer = zalloc(sizeof *buffer);
+	if (!buffer)
+		return NULL;
 
-	success = type->binding->query_buffer(type->binding->egl_display,
-					      (void *) buffer,
-					      EGL_TEXTURE_FORMAT, &format);
-	return success && format == EGL_TEXTURE_Y_U_V_WL;
+	buffer->binding = binding;
+	buffer->buffer = buffer_res;
+
+	if (binding->query_buffer(binding->egl_display, (void *) buffer_res,
+				  EGL_TEXTURE_FORMAT, &format))
+		buffer->type = wayland_buffer_type_for_format(binding, format);
+
+	if (buffer->type &&
+	    binding->query_buffer(binding->egl_display, (void *) buffer_res,
+				  EGL_WIDTH, &width) &&
+	    binding->query_buffer(binding->egl_display, (void *) buffer_res,
+				  EGL_HEIGHT, &height)) {
+		buffer->width = width;
+		buffer->height = height;
+	}
+
+	buffer->destroy_listener.notify = wayland_buffer_destroyed;
+	wl_resource_add_destroy_listener(buffer_res,
+					 &buffer->destroy_listener);
+	wl_list_insert(&binding->buffer_list, &buffer->link);
+
+	return buffer;
 }
 
 static int
-is_wayland_y_xuxv(void *data, struct wl_resource *buffer)
+is_type(void *data, struct wl_resource *buffer_res)
 {
 	struct wayland_buffer_type *type = data;
-	EGLint format;
-	EGLBoolean success;
+	struct wayland_buffer *buffer;
 
-	success = type->binding->query_buffer(type->binding->egl_display,
-					      (void *) buffer,
-					      EGL_TEXTURE_FORMAT, &format);
-	return success && format == EGL_TEXTURE_Y_XUXV_WL;
+	buffer = wayland_buffer_get(type->binding, buffer_res);
+
+	return buffer && buffer->type == type;
 }
 
 static void
-get_size(void *data, struct wl_resource *buffer,
+get_size(void *data, struct wl_resource *buffer_res,
 	 int32_t *width, int32_t *height)
 {
 	struct wayland_buffer_type *type = data;
-	EGLint twidth, theight;
-
-	type->binding->query_buffer(type->binding->egl_display, (void *) buffer,
-	     			    EGL_WIDTH, &twidth);
-	type->binding->query_buffer(type->binding->egl_display, (void *) buffer,
-				    EGL_HEIGHT, &theight);
-	*width = twidth;
-	*height = theight;
+	struct wayland_buffer *buffer;
+
+	buffer = wayland_buffer_get(type->binding, buffer_res);
+	if (!buffer) {
+		*width = 0;
+		*height = 0;
+		return;
+	}
+
+	*width = buffer->width;
+	*height = buffer->height;
 }
 
 static void
@@ -164,42 +212,27 @@ program_linked(void *data, GLuint program)
 	type->tex_uniforms[2] = glGetUniformLocation(program, "tex2");
 }
 
-static struct wayland_buffer *
-wayland_buffer_get(struct wayland_buffer_type *type,
-		   struct wl_resource *buffer_res, int create)
+static void
+wayland_buffer_create_images(struct wayland_buffer *buffer)
 {
-	struct wayland_buffer *buffer;
+	struct wlb_wayland_egl_binding *binding = buffer->binding;
 	EGLint attribs[3];
 	int i;
 
-	wl_list_for_each(buffer, &type->binding->buffer_list, link)
-		if (buffer->buffer == buffer_res)
-			return buffer;
-	
-	if (!create)
-		return NULL;
-	
-	buffer = zalloc(sizeof *buffer);
-	if (!buffer)
-		return NULL;
-	
-	buffer->buffer = buffer_res;
-	buffer->ref_count = 0;
+	buffer->num_images = buffer->type->type.num_planes;
 
-	for (i = 0; i < type->type.num_planes; ++i) {
+	for (i = 0; i < buffer->num_images; ++i) {
 		attribs[0] = EGL_WAYLAND_PLANE_WL;
 		attribs[1] = i;
 		attribs[2] = EGL_NONE;
 
 		buffer->images[i] =
-			type->binding->create_image(type->binding->egl_display,
-						    NULL, EGL_WAYLAND_BUFFER_WL,
-						    buffer_res, attribs);
+			binding->create_image(binding->egl_display,
+					      NULL, EGL_WAYLAND_BUFFER_WL,
+					      buffer->buffer, attribs);
+		if (buffer->images[i] == EGL_NO_IMAGE_KHR)
+			wlb_warn("Failed to create EGLImage for plane %d\n", i);
 	}
-
-	wl_list_insert(&type->binding->buffer_list, &buffer->link);
-
-	return buffer;
 }
 
 static void
@@ -210,9 +243,12 @@ attach(void *data, struct wl_resource *buffer_res,
 	struct wayland_buffer *buffer;
 	int i;
 
-	buffer = wayland_buffer_get(type, buffer_res, 1);
+	buffer = wayland_buffer_get(type->binding, buffer_res);
+	if (!buffer || buffer->type != type)
+		return;
 
-	buffer->ref_count++;
+	if (buffer->num_images == 0)
+		wayland_buffer_create_images(buffer);
 
 	for (i = 0; i < type->type.num_planes; ++i) {
 		glUniform1i(type->tex_uniforms[i], i);
@@ -226,29 +262,11 @@ attach(void *data, struct wl_resource *buffer_res,
 static void
 detach(void *data, struct wl_resource *buffer_res)
 {
-	struct wayland_buffer_type *type = data;
-	struct wayland_buffer *buffer;
-	int i;
-	
-	buffer = wayland_buffer_get(type, buffer_res, 0);
-	if (!buffer)
-		return;
-	
-	buffer->ref_count--;
-	
-	if (buffer->ref_count > 0)
-		return;
-
-	for (i = 0; i < type->type.num_planes; i++)
-		type->binding->destroy_image(type->binding->egl_display,
-					     buffer->images[i]);
-
-	wl_list_remove(&buffer->link);
-	free(buffer);
+	/* Images are released when the wl_buffer is destroyed */
 }
 
 static const struct wlb_buffer_type buffer_type_rgba = {
-	is_wayland_rgba, get_size,
+	is_type, get_size,
 	NULL, NULL,
 "uniform sampler2D tex;\n"
 "lowp vec4 wlb_get_fragment_color(mediump vec2 coords)\n"
@@ -259,7 +277,7 @@ static const struct wlb_buffer_type buffer_type_rgba = {
 };
 
 static const struct wlb_buffer_type buffer_type_external = {
-	is_wayland_external, get_size,
+	is_type, get_size,
 	NULL, NULL,
 "#extension GL_OES_EGL_image_external : require\n"
 "uniform samplerExternalOES tex;\n"
@@ -278,7 +296,7 @@ static const struct wlb_buffer_type buffer_type_external = {
 	"	return vec4(r, g, b, 1);\n"
 
 static const struct wlb_buffer_type buffer_type_y_uv = {
-	is_wayland_y_uv, get_size,
+	is_type, get_size,
 	NULL, NULL,
 "#extension GL_OES_EGL_image_external : require\n"
 "uniform sampler2D tex;\n"
@@ -294,7 +312,7 @@ FRAGMENT_CONVERT_YUV
 };
 
 static const struct wlb_buffer_type buffer_type_y_u_v = {
-	is_wayland_y_u_v, get_size,
+	is_type, get_size,
 	NULL, NULL,
 "#extension GL_OES_EGL_image_external : require\n"
 "uniform sampler2D tex;\n"
@@ -311,7 +329,7 @@ FRAGMENT_CONVERT_YUV
 };
 
 static const struct wlb_buffer_type buffer_type_y_xuxv = {
-	is_wayland_y_xuxv, get_size,
+	is_type, get_size,
 	NULL, NULL,
 "#extension GL_OES_EGL_image_external : require\n"
 "uniform sampler2D tex;\n"
@@ -407,8 +425,12 @@ wlb_wayland_egl_binding_create(struct wlb_compositor *comp,
 WL_EXPORT void
 wlb_wayland_egl_binding_destroy(struct wlb_wayland_egl_binding *binding)
 {
+	struct wayland_buffer *buffer, *next;
 	struct wl_display *wl_display;
 
+	wl_list_for_each_safe(buffer, next, &binding->buffer_list, link)
+		wayland_buffer_destroy(buffer);
+
 	wl_display = wlb_compositor_get_display(binding->compositor);
 	binding->unbind_display(binding->egl_display, wl_display);
 
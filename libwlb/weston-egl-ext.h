@@ -62,10 +62,45 @@ typedef EGLBoolean (EGLAPIENTRYP PFNEGLQUERYWAYLANDBUFFERWL) (EGLDisplay dpy, st
 #define EGL_BUFFER_AGE_EXT              0x313D
 #endif
 
+#ifndef EGL_EXT_swap_buffers_with_damage
+#define EGL_EXT_swap_buffers_with_damage 1
+typedef EGLBoolean (EGLAPIENTRYP PFNEGLSWAPBUFFERSWITHDAMAGEEXTPROC) (EGLDisplay dpy, EGLSurface surface, EGLint *rects, EGLint n_rects);
+#endif
+
 #ifndef EGL_WAYLAND_Y_INVERTED_WL
 #define EGL_WAYLAND_Y_INVERTED_WL		0x31DB /* eglQueryWaylandBufferWL attribute */
 #endif
 
+#ifndef EGL_EXT_image_dma_buf_import
+#define EGL_EXT_image_dma_buf_import 1
+#define EGL_LINUX_DMA_BUF_EXT			0x3270
+#define EGL_LINUX_DRM_FOURCC_EXT		0x3271
+#define EGL_DMA_BUF_PLANE0_FD_EXT		0x3272
+#define EGL_DMA_BUF_PLANE0_OFFSET_EXT		0x3273
+#define EGL_DMA_BUF_PLANE0_PITCH_EXT		0x3274
+#define EGL_DMA_BUF_PLANE1_FD_EXT		0x3275
+#define EGL_DMA_BUF_PLANE1_OFFSET_EXT		0x3276
+#define EGL_DMA_BUF_PLANE1_PITCH_EXT		0x3277
+#define EGL_DMA_BUF_PLANE2_FD_EXT		0x3278
+#define EGL_DMA_BUF_PLANE2_OFFSET_EXT		0x3279
+#define EGL_DMA_BUF_PLANE2_PITCH_EXT		0x327A
+#endif
+
+#ifndef EGL_EXT_image_dma_buf_import_modifiers
+#define EGL_EXT_image_dma_buf_import_modifiers 1
+#define EGL_DMA_BUF_PLANE3_FD_EXT		0x3440
+#define EGL_DMA_BUF_PLANE3_OFFSET_EXT		0x3441
+#define EGL_DMA_BUF_PLANE3_PITCH_EXT		0x3442
+#define EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT	0x3443
+#define EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT	0x3444
+#define EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT	0x3445
+#define EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT	0x3446
+#define EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT	0x3447
+#define EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT	0x3448
+#define EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT	0x3449
+#define EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT	0x344A
+#endif
+
 /* Mesas gl2ext.h and probably Khronos upstream defined
  * GL_EXT_unpack_subimage with non _EXT suffixed GL_UNPACK_* tokens.
  * In case we're using that mess, manually define the _EXT versions
@@ -28,28 +28,127 @@
 #include "fullscreen-shell-server-protocol.h"
 
 #include <pixman.h>
+#include <stddef.h>
 
 #define WLB_MAX(a, b) (((a) < (b)) ? (b) : (a))
 #define WLB_MIN(a, b) (((a) < (b)) ? (a) : (b))
 
 struct wlb_fullscreen_shell;
+struct wlb_linux_dmabuf;
+struct wlb_shm_pools;
+
+/* Buffer types are registered with the size of the struct the caller was
+ * built against; fields past that size must not be touched. */
+#define WLB_BUFFER_TYPE_HAS(type, size, field)				\
+	((size) >= offsetof(struct wlb_buffer_type, field) +		\
+		   sizeof((type)->field) && (type)->field)
+
+struct wlb_buffer_type_item {
+	struct wl_list link;
+
+	const struct wlb_buffer_type *type;
+	void *type_data;
+	size_t type_size;
+};
+
+/* Classification of a wl_buffer, cached on the resource until it is
+ * destroyed */
+struct wlb_buffer_info {
+	struct wl_list link;
+	struct wl_listener destroy_listener;
+
+	struct wlb_buffer_type_item *item;
+	int32_t width, height;
+};
 
 struct wlb_compositor {
 	struct wl_display *display;
 
 	struct wl_list buffer_type_list;
+	struct wl_list buffer_info_list;
 
 	struct wl_list output_list;
 	struct wl_list seat_list;
 
 	struct wlb_fullscreen_shell *fshell;
+	struct wlb_linux_dmabuf *dmabuf;
+	struct wlb_shm_pools *shm_pools;
+
+	/* wl_shm formats added on top of ARGB8888 and XRGB8888 */
+	struct wl_array shm_formats;
 };
 
+void
+wlb_compositor_remove_buffer_type(struct wlb_compositor *compositor,
+				  const struct wlb_buffer_type *type);
+void
+wlb_compositor_add_shm_format(struct wlb_compositor *compositor,
+			      uint32_t format);
+
+struct wlb_shm_pools *
+wlb_shm_pools_create(struct wl_display *display);
+void
+wlb_shm_pools_destroy(struct wlb_shm_pools *pools);
+int32_t
+wlb_shm_buffer_get_pool_space(struct wl_resource *buffer);
+
 struct wlb_fullscreen_shell *
 wlb_fullscreen_shell_create(struct wlb_compositor *compositor);
 void
 wlb_fullscreen_shell_destroy(struct wlb_fullscreen_shell *fshell);
 
+/* DRM fourcc codes, so that we do not need libdrm's drm_fourcc.h */
+#define WLB_DRM_FOURCC(a, b, c, d)					\
+	((uint32_t)(a) | ((uint32_t)(b) << 8) |				\
+	 ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+#define WLB_DRM_FORMAT_XRGB8888	WLB_DRM_FOURCC('X', 'R', '2', '4')
+#define WLB_DRM_FORMAT_ARGB8888	WLB_DRM_FOURCC('A', 'R', '2', '4')
+#define WLB_DRM_FORMAT_XBGR8888	WLB_DRM_FOURCC('X', 'B', '2', '4')
+#define WLB_DRM_FORMAT_ABGR8888	WLB_DRM_FOURCC('A', 'B', '2', '4')
+#define WLB_DRM_FORMAT_RGB565	WLB_DRM_FOURCC('R', 'G', '1', '6')
+
+#define WLB_DRM_FORMAT_MOD_LINEAR	0ull
+#define WLB_DRM_FORMAT_MOD_INVALID	0x00ffffffffffffffull
+
+#define WLB_DMABUF_MAX_PLANES 4
+
+struct wlb_dmabuf_plane {
+	int fd;
+	uint32_t offset, stride;
+	uint64_t modifier;
+};
+
+struct wlb_dmabuf_buffer {
+	struct wl_resource *resource;
+
+	int32_t width, height;
+	uint32_t format;
+	uint32_t flags;
+
+	int num_planes;
+	struct wlb_dmabuf_plane planes[WLB_DMABUF_MAX_PLANES];
+
+	/* CPU mapping of linear buffers, made on first use */
+	void *map;
+	size_t map_size;
+};
+
+struct wlb_linux_dmabuf *
+wlb_linux_dmabuf_create(struct wlb_compositor *compositor);
+void
+wlb_linux_dmabuf_destroy(struct wlb_linux_dmabuf *dmabuf);
+int
+wlb_linux_dmabuf_add_format(struct wlb_linux_dmabuf *dmabuf,
+			    uint32_t format, uint64_t modifier);
+struct wlb_dmabuf_buffer *
+wlb_dmabuf_buffer_get(struct wl_resource *resource);
+void *
+wlb_dmabuf_buffer_mmap(struct wlb_dmabuf_buffer *buffer,
+		       uint32_t *stride, uint32_t *format);
+void
+wlb_dmabuf_buffer_munmap(struct wlb_dmabuf_buffer *buffer);
+
 struct wlb_region {
 	struct wl_resource *resource;
 	pixman_region32_t region;
@@ -82,6 +181,9 @@ wlb_matrix_scale(struct wlb_matrix *dest,
 		 const struct wlb_matrix *src, float sx, float sy);
 void
 wlb_matrix_ortho(struct wlb_matrix *dest, float l, float r, float t, float b);
+/*! Transforms the point (x, y) in place */
+void
+wlb_matrix_transform_point(const struct wlb_matrix *M, float *x, float *y);
 
 void
 wlb_matrix_log(enum wlb_log_level level, const struct wlb_matrix *matrix);
@@ -148,6 +250,9 @@ void
 wlb_output_get_matrix(struct wlb_output *output,
 		      pixman_transform_t *transform);
 void
+wlb_output_transform_region(struct wlb_output *output,
+			    pixman_region32_t *dest, pixman_region32_t *src);
+void
 wlb_output_to_surface_coords(struct wlb_output *output,
 			     wl_fixed_t ox, wl_fixed_t oy,
 			     wl_fixed_t *sx, wl_fixed_t *sy);
@@ -300,6 +405,89 @@ void
 wlb_seat_send_capabilities(struct wlb_seat *seat);
 
 int wlb_util_create_tmpfile(size_t size);
+char *wlb_util_get_cache_dir(void);
+
+/*! Copies a width x height block of 32-bit pixels
+ *
+ * If set_alpha is non-zero, the top byte of every pixel is set to 0xff on
+ * the way through.  The best kernel for the running CPU is picked the
+ * first time this is called.
+ */
+void
+wlb_blit_32(void *dest, int32_t dest_stride,
+	    const void *src, int32_t src_stride,
+	    int32_t width, int32_t height, int set_alpha);
+/*! Like wlb_blit_32 but for rotated and flipped copies
+ *
+ * Destination pixel (x, y) is read from src + x * src_dx + y * src_dy,
+ * where src_dx and src_dy are in bytes and may be negative.  The copy is
+ * done in tiles so that transposes stay within the cache.
+ */
+void
+wlb_blit_32_rotated(void *dest, int32_t dest_stride,
+		    const void *src, int32_t src_dx, int32_t src_dy,
+		    int32_t width, int32_t height, int set_alpha);
+/*! Like wlb_blit_32 but bypasses the cache on the way out
+ *
+ * Meant for filling staging memory that the CPU will not read again,
+ * such as mapped GL buffers, where it also avoids reading back
+ * write-combined memory.  The copy is complete when this returns.
+ */
+void
+wlb_blit_32_stream(void *dest, int32_t dest_stride,
+		   const void *src, int32_t src_stride,
+		   int32_t width, int32_t height);
+
+/*! The planes of a 4:2:0 YUV image
+ *
+ * Chroma sample i of a row lives at u[i * uv_step] and v[i * uv_step],
+ * which covers both fully planar and NV12-style interleaved chroma.
+ */
+struct wlb_yuv_planes {
+	const uint8_t *y, *u, *v;
+	int32_t y_stride, uv_stride;
+	int32_t uv_step;
+};
+
+/*! Converts a width x height block of YUV starting at (x, y) to XRGB
+ *
+ * BT.601 limited range is assumed.  The alpha byte is set to 0xff.
+ */
+void
+wlb_blit_yuv(void *dest, int32_t dest_stride,
+	     const struct wlb_yuv_planes *src, int32_t x, int32_t y,
+	     int32_t width, int32_t height);
+
+/*! Precomputed weights for downscaling a 32-bit image by averaging
+ *
+ * Destination pixel (x, y) is the average of the source area
+ * [x0 + x * scale_x, x0 + (x + 1) * scale_x) by
+ * [y0 + y * scale_y, y0 + (y + 1) * scale_y), weighted by how much of
+ * each source pixel is covered.  Each channel is averaged on its own, so
+ * any 8-bit-per-channel layout works.  The weights only depend on the
+ * placement, so the scaler can be kept for as long as that stays the
+ * same.  Returns NULL if out of memory.
+ */
+struct wlb_box_scaler;
+
+struct wlb_box_scaler *
+wlb_box_scaler_create(int32_t width, int32_t height,
+		      int32_t src_width, int32_t src_height,
+		      double x0, double y0, double scale_x, double scale_y);
+void
+wlb_box_scaler_destroy(struct wlb_box_scaler *scaler);
+
+/*! Downscales one rectangle of the scaler's destination
+ *
+ * dest points at destination pixel (x, y).  The scaler keeps its scratch
+ * row internally, so it may only be used by one thread at a time.
+ */
+void
+wlb_box_scaler_scale_32(struct wlb_box_scaler *scaler,
+			void *dest, int32_t dest_stride,
+			const void *src, int32_t src_stride,
+			int32_t x, int32_t y, int32_t width, int32_t height,
+			int set_alpha);
 
 int wlb_log(enum wlb_log_level level, const char *format, ...);
 